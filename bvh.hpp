@@ -0,0 +1,129 @@
+#pragma once
+
+#include <vector>
+#include <cfloat>
+#include <algorithm>
+#include "geometry.hpp"
+
+// axis aligned box, empty (lo > hi) until something is added to it
+struct AABB {
+    Vec3f lo, hi;
+
+    AABB() : lo(FLT_MAX, FLT_MAX, FLT_MAX), hi(-FLT_MAX, -FLT_MAX, -FLT_MAX) {}
+    AABB(const Vec3f &l, const Vec3f &h) : lo(l), hi(h) {}
+
+    bool empty() const { return lo.x > hi.x; }
+    Vec3f center() const { return (lo + hi) * .5f; }
+
+    void expand(const Vec3f &p) {
+        for (int i=0; i<3; i++) {
+            lo[i] = std::min(lo[i], p[i]);
+            hi[i] = std::max(hi[i], p[i]);
+        }
+    }
+
+    void expand(const AABB &b) {
+        if (b.empty()) return;
+        expand(b.lo);
+        expand(b.hi);
+    }
+
+    Vec3f corner(int i) const { return Vec3f(i & 1 ? hi.x : lo.x, i & 2 ? hi.y : lo.y, i & 4 ? hi.z : lo.z); }
+};
+
+// box around b after an affine transform
+inline AABB transform_box(const AABB &b, const Mat4f &m) {
+    AABB out;
+    if (b.empty()) return out;
+    for (int i=0; i<8; i++) {
+        Vec4f p = m * Vec4f(b.corner(i));
+        out.expand(Vec3f(p.x, p.y, p.z));
+    }
+    return out;
+}
+
+// what a culling test says about a box
+enum Visibility {
+    VIS_OUTSIDE, // nothing in it can be seen
+    VIS_PARTIAL, // may be, look closer
+    VIS_INSIDE   // entirely inside the view, the children don't need the frustum test
+};
+
+struct BVHNode {
+    AABB box;
+    int first, count; // the items under this node are order()[first .. first+count)
+    int left, right;  // children, -1 for a leaf
+};
+
+// Bounding volume hierarchy over a set of boxes (faces of a mesh, instances of a scene).
+// Built top down, splitting at the median of the box centers along the longest axis until
+// at most leaf_size items are left. Nodes are stored depth first, so every subtree covers one
+// contiguous range of order(): culling a node skips all of its items at once.
+class BVH {
+    std::vector<BVHNode> _nodes;
+    std::vector<int> _order;
+
+    int build(const std::vector<AABB> &boxes, int first, int count, int leaf_size) {
+        int id = (int)_nodes.size();
+        _nodes.push_back(BVHNode());
+        AABB box, centers;
+        for (int i = first; i < first + count; i++) {
+            box.expand(boxes[_order[i]]);
+            centers.expand(boxes[_order[i]].center());
+        }
+        _nodes[id].box = box;
+        _nodes[id].first = first;
+        _nodes[id].count = count;
+        _nodes[id].left = _nodes[id].right = -1;
+        if (count <= leaf_size) return id;
+
+        Vec3f extent = centers.hi - centers.lo;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        int half = count / 2;
+        std::nth_element(_order.begin() + first, _order.begin() + first + half, _order.begin() + first + count,
+                         [&](int a, int b) { return boxes[a].center()[axis] < boxes[b].center()[axis]; });
+        int left = build(boxes, first, half, leaf_size);
+        int right = build(boxes, first + half, count - half, leaf_size);
+        _nodes[id].left = left;
+        _nodes[id].right = right;
+        return id;
+    }
+
+public:
+    void build(const std::vector<AABB> &boxes, int leaf_size) {
+        _nodes.clear();
+        _order.resize(boxes.size());
+        for (size_t i=0; i<boxes.size(); i++) _order[i] = (int)i;
+        if (!boxes.empty()) build(boxes, 0, (int)boxes.size(), leaf_size);
+    }
+
+    bool empty() const { return _nodes.empty(); }
+    const BVHNode &root() const { return _nodes[0]; }
+    int nnodes() const { return (int)_nodes.size(); }
+    const BVHNode &node(int i) const { return _nodes[i]; }
+    const std::vector<int> &order() const { return _order; }
+
+    // test(box, parent_inside) -> Visibility for every node reached, visit(first, count) for
+    // the order() ranges of the leaves that weren't culled, in order
+    template <typename TestFn, typename VisitFn> void traverse(TestFn test, VisitFn visit) const {
+        if (_nodes.empty()) return;
+        int stack[64][2]; // node, parent inside. Median splits keep the depth at log2(items)
+        int top = 0;
+        stack[top][0] = 0;
+        stack[top++][1] = 0;
+        while (top) {
+            top--;
+            const BVHNode &n = _nodes[stack[top][0]];
+            Visibility vis = test(n.box, stack[top][1] != 0);
+            if (vis == VIS_OUTSIDE) continue;
+            if (n.left < 0) {
+                visit(n.first, n.count);
+                continue;
+            }
+            stack[top][0] = n.right;
+            stack[top++][1] = vis == VIS_INSIDE;
+            stack[top][0] = n.left;
+            stack[top++][1] = vis == VIS_INSIDE;
+        }
+    }
+};
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CLEAR_SIMD_X86 1
+#endif
+
+// Buffer fills for clearing render targets. A whole frame buffer is much bigger than the caches
+// and nobody reads it before the rasterizer gets there, so it's written with non-temporal
+// stores: they go around the caches straight to memory in full lines, without first reading
+// every line in like a normal store does, and don't push the rest of the frame's data out.
+// A single tile that is about to be drawn into is the opposite case and takes plain stores.
+
+#ifdef CLEAR_SIMD_X86
+inline bool clear_has_avx() {
+    static bool avx = (__builtin_cpu_init(), __builtin_cpu_supports("avx"));
+    return avx;
+}
+
+// n words from a 32 byte aligned dst, n a multiple of 8
+__attribute__((target("avx")))
+inline void stream32_avx(uint32_t *dst, uint32_t value, size_t n) {
+    __m256i v = _mm256_set1_epi32((int)value);
+    for (size_t i = 0; i < n; i += 8) {
+        _mm256_stream_si256((__m256i*)(dst + i), v);
+    }
+}
+
+// the same with 16 byte stores, which every x86-64 has
+inline void stream32_sse2(uint32_t *dst, uint32_t value, size_t n) {
+    __m128i v = _mm_set1_epi32((int)value);
+    for (size_t i = 0; i < n; i += 8) {
+        _mm_stream_si128((__m128i*)(dst + i), v);
+        _mm_stream_si128((__m128i*)(dst + i + 4), v);
+    }
+}
+#endif
+
+// n copies of value at dst, through the caches. std::fill stays a word at a time at -O2.
+// dst can be any 4 byte type, floats for a depth buffer: it's only written through SIMD
+// stores and memcpy, which don't care what type the memory holds
+inline void fill32(void *buf, uint32_t value, size_t n) {
+    uint32_t *dst = (uint32_t*)buf;
+    if (value == 0) {
+        memset(dst, 0, n * sizeof(uint32_t));
+        return;
+    }
+    size_t i = 0;
+#ifdef CLEAR_SIMD_X86
+    __m128i v = _mm_set1_epi32((int)value);
+    for (; i + 8 <= n; i += 8) {
+        _mm_storeu_si128((__m128i*)(dst + i), v);
+        _mm_storeu_si128((__m128i*)(dst + i + 4), v);
+    }
+#endif
+    for (; i < n; i++) memcpy(dst + i, &value, sizeof(value));
+}
+
+// n copies of value at dst, around the caches where the cpu can. Call stream_fence() after the
+// last one, before anybody else reads the memory; it's slow, so not after every row of a tile
+inline void stream_fill32(void *buf, uint32_t value, size_t n) {
+    uint32_t *dst = (uint32_t*)buf;
+#ifdef CLEAR_SIMD_X86
+    size_t head = std::min(n, (size_t)((32 - ((uintptr_t)dst & 31)) & 31) / sizeof(uint32_t));
+    if (((uintptr_t)dst & 3) == 0 && n - head >= 8) {
+        fill32(dst, value, head);
+        dst += head;
+        n -= head;
+        size_t body = n & ~(size_t)7;
+        if (clear_has_avx()) {
+            stream32_avx(dst, value, body);
+        } else {
+            stream32_sse2(dst, value, body);
+        }
+        dst += body;
+        n -= body;
+    }
+#endif
+    fill32(dst, value, n);
+}
+
+// the same for 16 bit values, two to a word. dst has to be 2 byte aligned
+inline void fill16(uint16_t *dst, uint16_t value, size_t n) {
+    if (n && ((uintptr_t)dst & 2)) {
+        *dst++ = value;
+        n--;
+    }
+    fill32(dst, value | (uint32_t)value << 16, n / 2);
+    if (n & 1) dst[n - 1] = value;
+}
+
+inline void stream_fill16(uint16_t *dst, uint16_t value, size_t n) {
+    if (n && ((uintptr_t)dst & 2)) {
+        *dst++ = value;
+        n--;
+    }
+    stream_fill32(dst, value | (uint32_t)value << 16, n / 2);
+    if (n & 1) dst[n - 1] = value;
+}
+
+// the streamed lines are visible to other threads after this
+inline void stream_fence() {
+#ifdef CLEAR_SIMD_X86
+    _mm_sfence();
+#endif
+}
+
+// the bits of a float, for filling depth buffers
+inline uint32_t float_bits(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <cfloat>
+#include <vector>
+#include <algorithm>
+#include "clear.hpp"
+
+// Storage formats of an Image's depth buffer. Whatever the format, the rasterizer's screen z is
+// larger for closer, a fragment passes when it's strictly closer than what's stored, and the
+// clear value is behind anything that can be drawn. What screen z means is up to the viewport
+// transform, see depth_viewport() in our_gl.hpp: the classic one maps z/w into [0, 225], the
+// others reverse it, a / w + b going from 1 at the near end of the scene to just over 0 at the
+// far end. That's linear on the screen like z/w, so the rasterizer interpolates it the same way,
+// and floats are densest around 0 where the precision is needed most, which is what reversed-Z
+// is about.
+// The unorm formats scale it to their range before interpolating and round the result down,
+// so the kernels compare and store integers straight away
+enum DepthFormat {
+    DEPTH_FLOAT,      // float z/w, cleared to -FLT_MAX
+    DEPTH_REVERSED_Z, // float reversed depth, cleared to 0
+    DEPTH_D24S8,      // reversed depth as 24 bit unorm in the top of a word, 8 bits of stencil below it, cleared to 0
+    DEPTH_D16         // reversed depth as 16 bit unorm, half the bytes and no stencil, cleared to 0
+};
+
+inline const char *depth_format_name(DepthFormat format) {
+    switch (format) {
+        case DEPTH_REVERSED_Z: return "reversed-z";
+        case DEPTH_D24S8:      return "d24s8";
+        case DEPTH_D16:        return "d16";
+        default:               return "float";
+    }
+}
+
+// what the near end of the depth range ends up as, 0 for DEPTH_FLOAT which has a mapping of its own
+inline float depth_scale(DepthFormat format) {
+    switch (format) {
+        case DEPTH_REVERSED_Z: return 1.f;
+        case DEPTH_D24S8:      return 16777215.f;
+        case DEPTH_D16:        return 65535.f;
+        default:               return 0.f;
+    }
+}
+
+// screen z as a unorm format stores it: clamped to [0, scale] and rounded down. Spelled out
+// like max and min do it in SSE, so the SIMD kernels get the same
+inline uint32_t depth_unorm(float z, float scale) {
+    z = z > 0.f ? z : 0.f;
+    return (uint32_t)(z < scale ? z : scale);
+}
+
+// per pixel depth in one of the formats, rows laid out like Image's pixels
+class DepthBuffer {
+    DepthFormat _format;
+    float _scale;
+    // typed storage, only the one of the format holds anything
+    std::vector<float> _floats;    // DEPTH_FLOAT and DEPTH_REVERSED_Z
+    std::vector<uint32_t> _words;  // DEPTH_D24S8
+    std::vector<uint16_t> _halves; // DEPTH_D16
+
+public:
+    DepthBuffer() : _format(DEPTH_FLOAT), _scale(0) {}
+
+    // room for pixels, not cleared yet
+    void init(size_t pixels, DepthFormat format) {
+        _format = format;
+        _scale = depth_scale(format);
+        bool floating = format == DEPTH_FLOAT || format == DEPTH_REVERSED_Z;
+        _floats.assign(floating ? pixels : 0, 0.f);
+        _words.assign(format == DEPTH_D24S8 ? pixels : 0, 0);
+        _halves.assign(format == DEPTH_D16 ? pixels : 0, 0);
+    }
+
+    DepthFormat format() const { return _format; }
+    float scale() const { return _scale; }
+    size_t bytes_per_pixel() const { return _format == DEPTH_D16 ? 2 : 4; }
+
+    // the raw storage, for the SIMD kernels: floats for the float formats, words for D24S8, halves for D16
+    float *floats() { return _floats.data(); }
+    const float *floats() const { return _floats.data(); }
+    uint32_t *words() { return _words.data(); }
+    const uint32_t *words() const { return _words.data(); }
+    uint16_t *halves() { return _halves.data(); }
+    const uint16_t *halves() const { return _halves.data(); }
+
+    // what a cleared pixel holds, as screen z
+    float clear_value() const { return _format == DEPTH_FLOAT ? -FLT_MAX : 0.f; }
+
+    // pixel i's depth as screen z, without the stencil
+    float get(size_t i) const {
+        switch (_format) {
+            case DEPTH_D24S8: return (float)(words()[i] >> 8);
+            case DEPTH_D16:   return (float)halves()[i];
+            default:          return floats()[i];
+        }
+    }
+
+    // something got drawn on pixel i since it was cleared, nothing passes the test against the clear value itself
+    bool covered(size_t i) const {
+        switch (_format) {
+            case DEPTH_D24S8: return (words()[i] >> 8) != 0;
+            case DEPTH_D16:   return halves()[i] != 0;
+            default:          return floats()[i] != clear_value();
+        }
+    }
+
+    // the depth test of z at pixel i
+    bool test(size_t i, float z) const {
+        switch (_format) {
+            case DEPTH_D24S8: return depth_unorm(z, _scale) > (words()[i] >> 8);
+            case DEPTH_D16:   return depth_unorm(z, _scale) > halves()[i];
+            default:          return z > floats()[i];
+        }
+    }
+
+    // stores z at pixel i, the stencil stays
+    void set(size_t i, float z) {
+        switch (_format) {
+            case DEPTH_D24S8:
+                words()[i] = depth_unorm(z, _scale) << 8 | (words()[i] & 0xff);
+                break;
+            case DEPTH_D16:
+                halves()[i] = (uint16_t)depth_unorm(z, _scale);
+                break;
+            default:
+                floats()[i] = z;
+                break;
+        }
+    }
+
+    // the screen z one step farther than z in this format: one unit less for the unorms, the
+    // next float down otherwise. What a z-prepass stores, see depth_raster.hpp
+    float step_back(float z) const {
+        if (_format == DEPTH_D24S8 || _format == DEPTH_D16) return z - 1.f;
+        uint32_t bits = z == 0.f ? 0x80000001u : float_bits(z) + (z > 0.f ? -1 : 1);
+        float out;
+        memcpy(&out, &bits, sizeof(out));
+        return out;
+    }
+
+    // test() and set() if it passes
+    bool update(size_t i, float z) {
+        if (!test(i, z)) return false;
+        set(i, z);
+        return true;
+    }
+
+    // nothing tests against it yet, it's cleared and kept across depth writes. 0 without stencil bits
+    uint8_t stencil(size_t i) const {
+        return _format == DEPTH_D24S8 ? (uint8_t)(words()[i] & 0xff) : 0;
+    }
+
+    void set_stencil(size_t i, uint8_t s) {
+        if (_format == DEPTH_D24S8) words()[i] = (words()[i] & ~0xffu) | s;
+    }
+
+    // pixels [i, i + n) back to the clear value, stencil too. stream as in clear.hpp, fence after
+    void fill(size_t i, size_t n, bool stream) {
+        if (_format == DEPTH_D16) {
+            if (stream) {
+                stream_fill16(halves() + i, 0, n);
+            } else {
+                fill16(halves() + i, 0, n);
+            }
+            return;
+        }
+        void *dst = _format == DEPTH_D24S8 ? (void*)(words() + i) : (void*)(floats() + i);
+        uint32_t value = float_bits(clear_value()); // 0 for everything but DEPTH_FLOAT
+        if (stream) {
+            stream_fill32(dst, value, n);
+        } else {
+            fill32(dst, value, n);
+        }
+    }
+
+    // widens [lo, hi] to the depths of pixels [i, i + n), for the hi-z
+    void bounds(size_t i, int n, float &lo, float &hi) const {
+        switch (_format) {
+            case DEPTH_D24S8: {
+                uint32_t a = UINT32_MAX, b = 0;
+                for (int k=0; k<n; k++) {
+                    a = std::min(a, words()[i + k] >> 8);
+                    b = std::max(b, words()[i + k] >> 8);
+                }
+                if (n > 0) {
+                    lo = std::min(lo, (float)a);
+                    hi = std::max(hi, (float)b);
+                }
+                break;
+            }
+            case DEPTH_D16: {
+                uint16_t a = UINT16_MAX, b = 0;
+                for (int k=0; k<n; k++) {
+                    a = std::min(a, halves()[i + k]);
+                    b = std::max(b, halves()[i + k]);
+                }
+                if (n > 0) {
+                    lo = std::min(lo, (float)a);
+                    hi = std::max(hi, (float)b);
+                }
+                break;
+            }
+            default:
+                for (int k=0; k<n; k++) {
+                    lo = std::min(lo, floats()[i + k]);
+                    hi = std::max(hi, floats()[i + k]);
+                }
+                break;
+        }
+    }
+};
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <stdint.h>
+#include "geometry.hpp"
+#include "image.hpp"
+#include "rasterizer.hpp"
+#include "hiz.hpp"
+#include "bvh.hpp"
+#include "pipeline.hpp"
+#include "raster_simd.hpp"
+
+// Depth only rasterization: coverage and z, nothing else. No varyings are set up, no shader
+// runs and no color is written, so a pixel costs the edge test, three multiply-adds and the
+// depth test. What it's for:
+//  - shadow maps, the scene's depth from the light (see shadow.hpp)
+//  - a z-prepass, so the shading pass after it only shades the fragments that end up visible
+//  - occlusion queries, counting how much of something would pass the depth test
+// The kernels compute z exactly like the textured ones, scalar or SIMD, so a prepass and the
+// shading pass after it agree on every pixel.
+enum DepthOnly {
+    DEPTH_ONLY_QUERY,  // test only, count what passes
+    DEPTH_ONLY_WRITE,  // test and store
+    DEPTH_ONLY_PREPASS // test and store a step farther (DepthBuffer::step_back()): the shading
+                       // pass after it tests strictly closer as always, which then lets exactly
+                       // the fragment through that wins without a prepass, first come on ties
+};
+
+// pixels [x0, x1) of a span of t at row idx of depth, w being the edge functions at x0. Returns how many passed
+inline int depth_span_scalar(const RasterTriangle &t, DepthBuffer &depth, unsigned idx, int x0, int x1, const int64_t *wstart,
+                             bool inside, DepthOnly mode) {
+    int64_t w[3] = { wstart[0], wstart[1], wstart[2] };
+    int passed = 0;
+    for (int x=x0; x<x1; x++, idx++, w[0] += t.A[0], w[1] += t.A[1], w[2] += t.A[2]) {
+        if (!inside && (w[0] | w[1] | w[2]) < 0) continue;
+        float z = interpolate_depth(t, w);
+        if (mode == DEPTH_ONLY_PREPASS) z = depth.step_back(z);
+        if (!depth.test(idx, z)) continue;
+        if (mode != DEPTH_ONLY_QUERY) depth.set(idx, z);
+        passed++;
+    }
+    return passed;
+}
+
+#ifdef RASTER_SIMD_X86
+
+// DepthBuffer::step_back() for 4 and 8 lanes
+__attribute__((target("sse4.1")))
+inline __m128 step_back_sse41(const DepthBuffer &d, __m128 z) {
+    if (d.format() == DEPTH_D24S8 || d.format() == DEPTH_D16) return _mm_sub_ps(z, _mm_set1_ps(1.f));
+    __m128 zero = _mm_setzero_ps();
+    __m128i bits = _mm_castps_si128(z);
+    __m128i delta = _mm_or_si128(_mm_castps_si128(_mm_cmpgt_ps(z, zero)), _mm_set1_epi32(1)); // -1 or 1
+    bits = _mm_add_epi32(bits, delta);
+    return _mm_blendv_ps(_mm_castsi128_ps(bits), _mm_castsi128_ps(_mm_set1_epi32((int)0x80000001u)), _mm_cmpeq_ps(z, zero));
+}
+
+__attribute__((target("avx2")))
+inline __m256 step_back_avx2(const DepthBuffer &d, __m256 z) {
+    if (d.format() == DEPTH_D24S8 || d.format() == DEPTH_D16) return _mm256_sub_ps(z, _mm256_set1_ps(1.f));
+    __m256 zero = _mm256_setzero_ps();
+    __m256i bits = _mm256_castps_si256(z);
+    __m256i delta = _mm256_or_si256(_mm256_castps_si256(_mm256_cmp_ps(z, zero, _CMP_GT_OQ)), _mm256_set1_epi32(1));
+    bits = _mm256_add_epi32(bits, delta);
+    return _mm256_blendv_ps(_mm256_castsi256_ps(bits), _mm256_castsi256_ps(_mm256_set1_epi32((int)0x80000001u)), _mm256_cmp_ps(z, zero, _CMP_EQ_OQ));
+}
+
+__attribute__((target("sse4.1")))
+inline int depth_quad_sse41(const RasterTriangle &t, DepthBuffer &depth, unsigned idx, const int64_t *w, DepthOnly mode) {
+    const __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i w0 = _mm_add_epi32(_mm_set1_epi32((int)w[0]), _mm_mullo_epi32(_mm_set1_epi32((int)t.A[0]), lane));
+    __m128i w1 = _mm_add_epi32(_mm_set1_epi32((int)w[1]), _mm_mullo_epi32(_mm_set1_epi32((int)t.A[1]), lane));
+    __m128i w2 = _mm_add_epi32(_mm_set1_epi32((int)w[2]), _mm_mullo_epi32(_mm_set1_epi32((int)t.A[2]), lane));
+    __m128i cover = _mm_cmpgt_epi32(_mm_or_si128(w0, _mm_or_si128(w1, w2)), _mm_set1_epi32(-1));
+    if (_mm_testz_si128(cover, cover)) return 0;
+
+    __m128 inv = _mm_set1_ps(t.inv_area);
+    __m128 b0 = _mm_mul_ps(_mm_cvtepi32_ps(w0), inv);
+    __m128 b1 = _mm_mul_ps(_mm_cvtepi32_ps(w1), inv);
+    __m128 b2 = _mm_mul_ps(_mm_cvtepi32_ps(w2), inv);
+    __m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.z[0]), b0), _mm_mul_ps(_mm_set1_ps(t.z[1]), b1)), _mm_mul_ps(_mm_set1_ps(t.z[2]), b2));
+    if (mode == DEPTH_ONLY_PREPASS) z = step_back_sse41(depth, z);
+    __m128i pass = depth_pass_sse41(depth, idx, z, cover);
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(pass));
+    if (mask && mode != DEPTH_ONLY_QUERY) depth_store_sse41(depth, idx, z, pass);
+    return __builtin_popcount(mask);
+}
+
+inline int depth_span_sse41(const RasterTriangle &t, DepthBuffer &depth, unsigned idx, int x0, int x1, const int64_t *wstart,
+                            bool inside, DepthOnly mode) {
+    int64_t w[3] = { wstart[0], wstart[1], wstart[2] };
+    int passed = 0, x = x0;
+    for (; x + 4 <= x1; x += 4, idx += 4) {
+        passed += depth_quad_sse41(t, depth, idx, w, mode);
+        w[0] += 4*t.A[0]; w[1] += 4*t.A[1]; w[2] += 4*t.A[2];
+    }
+    if (x < x1) passed += depth_span_scalar(t, depth, idx, x, x1, w, inside, mode);
+    return passed;
+}
+
+__attribute__((target("avx2")))
+inline int depth_span_avx2(const RasterTriangle &t, DepthBuffer &depth, unsigned idx, int x0, int x1, const int64_t *w, DepthOnly mode) {
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i active = _mm256_cmpgt_epi32(_mm256_set1_epi32(x1 - x0), lane);
+    __m256i w0 = _mm256_add_epi32(_mm256_set1_epi32((int)w[0]), _mm256_mullo_epi32(_mm256_set1_epi32((int)t.A[0]), lane));
+    __m256i w1 = _mm256_add_epi32(_mm256_set1_epi32((int)w[1]), _mm256_mullo_epi32(_mm256_set1_epi32((int)t.A[1]), lane));
+    __m256i w2 = _mm256_add_epi32(_mm256_set1_epi32((int)w[2]), _mm256_mullo_epi32(_mm256_set1_epi32((int)t.A[2]), lane));
+    __m256i cover = _mm256_andnot_si256(_mm256_srai_epi32(_mm256_or_si256(w0, _mm256_or_si256(w1, w2)), 31), active);
+    if (_mm256_testz_si256(cover, cover)) return 0;
+
+    __m256 inv = _mm256_set1_ps(t.inv_area);
+    __m256 b0 = _mm256_mul_ps(_mm256_cvtepi32_ps(w0), inv);
+    __m256 b1 = _mm256_mul_ps(_mm256_cvtepi32_ps(w1), inv);
+    __m256 b2 = _mm256_mul_ps(_mm256_cvtepi32_ps(w2), inv);
+    __m256 z = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(t.z[0]), b0), _mm256_mul_ps(_mm256_set1_ps(t.z[1]), b1)),
+                             _mm256_mul_ps(_mm256_set1_ps(t.z[2]), b2));
+    if (mode == DEPTH_ONLY_PREPASS) z = step_back_avx2(depth, z);
+    __m256i pass = depth_pass_avx2(depth, idx, x1 - x0, z, cover);
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(pass));
+    if (mask && mode != DEPTH_ONLY_QUERY) depth_store_avx2(depth, idx, x1 - x0, z, pass);
+    return __builtin_popcount(mask);
+}
+
+#endif // RASTER_SIMD_X86
+
+// the spans of t with the best kernel the cpu supports, block is the block test for rasterize_spans()
+template <typename BlockFn> int64_t depth_spans(const RasterTriangle &t, Image &image, DepthOnly mode, BlockFn block) {
+    int64_t passed = 0;
+#ifdef RASTER_SIMD_X86
+    SimdLevel level = simd_level();
+    if (level != SIMD_SCALAR && fits_int32(t)) {
+        if (level == SIMD_AVX2) {
+            rasterize_spans(t, [&](int y, int x0, int x1, const int64_t *w, bool) {
+                passed += depth_span_avx2(t, image.depth, (image._height - y - 1) * image._width + x0, x0, x1, w, mode);
+            }, block);
+        } else {
+            rasterize_spans(t, [&](int y, int x0, int x1, const int64_t *w, bool inside) {
+                passed += depth_span_sse41(t, image.depth, (image._height - y - 1) * image._width + x0, x0, x1, w, inside, mode);
+            }, block);
+        }
+        return passed;
+    }
+#endif
+    rasterize_spans(t, [&](int y, int x0, int x1, const int64_t *w, bool inside) {
+        passed += depth_span_scalar(t, image.depth, (image._height - y - 1) * image._width + x0, x0, x1, w, inside, mode);
+    }, block);
+    return passed;
+}
+
+// the pixels of t that pass the depth test of image, stored there unless it's a query. With
+// state.hiz hidden triangles and blocks are skipped first. A query leaves the hi-z alone
+inline int64_t rasterize_depth(const RasterTriangle &t, Image &image, DepthOnly mode, const RasterState &state) {
+    if (mode != DEPTH_ONLY_QUERY) {
+        if (state.hiz && hiz_hidden(image.hiz, t)) return 0;
+        return depth_spans(t, image, mode, HiZBlockTest(image.hiz, t, state.hiz));
+    }
+    const HiZ &hiz = image.hiz;
+    if (state.hiz && hiz_hidden_updated(hiz, t)) return 0;
+    // a tile still waiting for its lazy clear holds an old frame's depth, what's really there
+    // is the clear value that anything passes against: skip it and count it as passing
+    bool pending = false;
+    int64_t passed = depth_spans(t, image, mode, [&](int x0, int y0, int x1, int y1, const int64_t *w) {
+        if (image.pending(x0, y0)) {
+            pending = true;
+            return false;
+        }
+        return !state.hiz || block_max_depth(t, x0, y0, x1, y1, w) > hiz.farthest(Rect(x0, y0, x1, y1));
+    });
+    return passed + (pending ? 1 : 0);
+}
+
+// a primitive from PrimitiveAssembly, its pixels inside clip
+inline int64_t depth_primitive(const Primitive &prim, Image &image, const Rect &clip, DepthOnly mode, const RasterState &state) {
+    RasterTriangle t;
+    if (!setup_triangle(prim.pts, clip, t)) return 0;
+    return rasterize_depth(t, image, mode, state);
+}
+
+// Occlusion query of a box under transform (world to homogeneous screen): how many pixels of
+// its faces are in front of image's depth, 0 meaning whatever is inside is hidden. It stops at
+// the first triangle that has any, so past 0 the count is only a lower bound. A box
+// reaching behind the near plane can't be projected and comes back as -1, visible as far as
+// anybody should be concerned. Only reads the image, so queries can run in parallel, but its
+// hi-z has to be up to date (see HiZ::update()). Tiles still waiting for their lazy clear pass.
+// The box is grown a little first, so an object's face lying right on it doesn't hide the object
+inline int64_t occlusion_query(const AABB &box, const Mat4f &transform, Image &image, const RasterState &state) {
+    Vec3f grow = (box.hi - box.lo) * 1e-2f;
+    AABB grown(box.lo - grow, box.hi + grow);
+    Vec3f pts[8];
+    for (int i=0; i<8; i++) {
+        Vec4f p = transform * Vec4f(grown.corner(i));
+        if (p.w < CLIP_NEAR_W) return -1;
+        pts[i] = Vec3f(p.x / p.w, p.y / p.w, p.z / p.w);
+    }
+    // the 6 faces as quads of corners (bit 0 is x, 1 is y, 2 is z), both windings get drawn
+    static const int faces[6][4] = { { 0, 2, 6, 4 }, { 1, 3, 7, 5 }, { 0, 1, 5, 4 }, { 2, 3, 7, 6 }, { 0, 1, 3, 2 }, { 4, 5, 7, 6 } };
+    Rect screen(0, 0, image._width, image._height);
+    int64_t passed = 0;
+    for (int f=0; f<6; f++) {
+        for (int half=0; half<2; half++) {
+            Vec3f tri[3] = { pts[faces[f][0]], pts[faces[f][half + 1]], pts[faces[f][half + 2]] };
+            RasterTriangle t;
+            if (setup_triangle(tri, screen, t)) passed += rasterize_depth(t, image, DEPTH_ONLY_QUERY, state);
+            if (passed > 0) return passed;
+        }
+    }
+    return 0;
+}
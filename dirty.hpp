@@ -0,0 +1,83 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include "geometry.hpp"
+#include "tiler.hpp"
+#include "bvh.hpp"
+#include "pipeline.hpp"
+#include "scene.hpp"
+
+// Incremental redraw of a frame kept from the last time. Remembers the camera and light the
+// image was drawn with; when they're the same and nothing moved nothing needs drawing at all,
+// and when only some instances moved just the screen tiles under their old and new boxes do.
+// Anything else (the first frame, a new camera or light, invalidate()) redraws everything.
+// It works on the tiles of a TileGrid: the tiles to redraw are left active, the others not.
+class DirtyTracker {
+    bool _valid;      // there is a frame to start from
+    bool _all;        // the last update() wants everything redrawn
+    Mat4f _view;
+    Vec3f _light;
+    std::vector<Rect> _rects; // the tiles to redraw, when not all of them
+
+    void mark(TileGrid &tiles, const Rect &r) {
+        int s = tiles.tile_size();
+        for (int ty = r.y0 / s; ty <= (r.y1 - 1) / s; ty++) {
+            for (int tx = r.x0 / s; tx <= (r.x1 - 1) / s; tx++) {
+                tiles.tile(ty * tiles.cols() + tx).active = true;
+            }
+        }
+    }
+
+public:
+    DirtyTracker() : _valid(false), _all(true) {}
+
+    // the next update() redraws everything
+    void invalidate() { _valid = false; }
+
+    // Decides what of the frame drawn with view (world to homogeneous screen) and light has to
+    // be redrawn and marks those tiles active. Takes the scene's moved() list and clears it.
+    // Returns the number of tiles to redraw
+    int update(const Mat4f &view, Vec3f light, Scene &scene, const Rect &screen, TileGrid &tiles) {
+        bool same = _valid && light.x == _light.x && light.y == _light.y && light.z == _light.z;
+        for (int i=0; i<4 && same; i++) {
+            for (int j=0; j<4 && same; j++) same = view[i][j] == _view[i][j];
+        }
+        _valid = true;
+        _view = view;
+        _light = light;
+        _all = !same;
+        _rects.clear();
+
+        int n = 0;
+        for (int i=0; i<tiles.ntiles(); i++) tiles.tile(i).active = _all;
+        if (!_all) {
+            const std::vector<std::pair<int, AABB> > &moved = scene.moved();
+            for (size_t k=0; k<moved.size(); k++) {
+                Rect r;
+                if (box_rect(moved[k].second, view, screen, r)) mark(tiles, r);
+                if (box_rect(scene.instance(moved[k].first).bounds, view, screen, r)) mark(tiles, r);
+            }
+        }
+        scene.clear_moved();
+        for (int i=0; i<tiles.ntiles(); i++) {
+            if (!tiles.tile(i).active) continue;
+            _rects.push_back(tiles.tile(i).rect);
+            n++;
+        }
+        return n;
+    }
+
+    bool all() const { return _all; }
+    const std::vector<Rect> &rects() const { return _rects; }
+
+    // true if r touches a tile being redrawn
+    bool overlaps(const Rect &r) const {
+        if (_all) return true;
+        for (size_t i=0; i<_rects.size(); i++) {
+            const Rect &d = _rects[i];
+            if (r.x0 < d.x1 && d.x0 < r.x1 && r.y0 < d.y1 && d.y0 < r.y1) return true;
+        }
+        return false;
+    }
+};
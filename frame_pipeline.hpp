@@ -0,0 +1,95 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+// Runs frames through three stages at once, each on its own thread: geometry of frame N+1,
+// rasterization of frame N and presentation of frame N-1. Frame f lives in slot f % slots from
+// the start of its geometry to the end of its presentation, so whatever a stage writes per frame
+// (transformed vertices, binned primitives, the image) needs one copy per slot. With 3 slots all
+// three stages overlap, with 2 the geometry of the next frame waits for the present before it.
+// Stages of one frame always run in order, and every stage sees the frames in order.
+class FramePipeline {
+public:
+    typedef std::function<bool(int frame, int slot)> Stage; // false stops the pipeline
+    typedef std::function<void(int frame, int slot)> Work;
+
+    explicit FramePipeline(int slots) : _slots(std::max(1, slots)) {}
+
+    int slots() const { return _slots; }
+
+    // Returns once every frame that went into geometry is rasterized. geometry() returning false
+    // means there are no more frames, present() returning false drops the presents of the frames
+    // still in flight. present() runs on the calling thread, which windowing systems tend to want
+    void run(Stage geometry, Work raster, Stage present) {
+        _geometry_done = _raster_done = _present_done = 0;
+        _end = -1;
+        _stop = false;
+
+        std::thread geometry_thread([&] {
+            for (int f = 0; ; f++) {
+                {
+                    std::unique_lock<std::mutex> guard(_lock);
+                    _changed.wait(guard, [&] { return _stop || f < _present_done + _slots; });
+                    if (_stop) {
+                        finish(f);
+                        return;
+                    }
+                }
+                bool more = geometry(f, f % _slots);
+                std::lock_guard<std::mutex> guard(_lock);
+                if (!more) {
+                    finish(f);
+                    return;
+                }
+                _geometry_done = f + 1;
+                _changed.notify_all();
+            }
+        });
+
+        std::thread raster_thread([&] {
+            for (int f = 0; wait_for(_geometry_done, f); f++) {
+                raster(f, f % _slots);
+                std::lock_guard<std::mutex> guard(_lock);
+                _raster_done = f + 1;
+                _changed.notify_all();
+            }
+        });
+
+        for (int f = 0; wait_for(_raster_done, f); f++) {
+            if (!_stop && !present(f, f % _slots)) {
+                std::lock_guard<std::mutex> guard(_lock);
+                _stop = true;
+            }
+            std::lock_guard<std::mutex> guard(_lock);
+            _present_done = f + 1;
+            _changed.notify_all();
+        }
+        geometry_thread.join();
+        raster_thread.join();
+    }
+
+private:
+    int _slots;
+    int _geometry_done, _raster_done, _present_done; // frames through each stage
+    int _end;   // frames that went into the pipeline, -1 while geometry is still going
+    bool _stop;
+    std::mutex _lock;
+    std::condition_variable _changed;
+
+    // called with _lock held
+    void finish(int frames) {
+        _end = frames;
+        _changed.notify_all();
+    }
+
+    // waits until the stage before has done frame f, false if it never will
+    bool wait_for(const int &done, int f) {
+        std::unique_lock<std::mutex> guard(_lock);
+        _changed.wait(guard, [&] { return f < done || (_end >= 0 && f >= _end); });
+        return f < done;
+    }
+};
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cfloat>
+#include <stdint.h>
+#include <algorithm>
+#include "geometry.hpp"
+#include "image.hpp"
+#include "tiler.hpp"
+#include "thread_pool.hpp"
+#include "rasterizer.hpp"
+#include "varyings.hpp"
+#include "texture.hpp"
+#include "our_gl.hpp"
+
+// Deferred shading for TexturedShader. The geometry pass only depth tests and writes what the
+// shading needs into a compact G-buffer, 10 bytes a pixel next to the depth: uv as two 16 bit
+// unorms, the normal octahedral encoded in two more 16 bit unorms, and the triangle's mip
+// level. Then the shading pass samples the texture and lights every covered pixel exactly once, so
+// its cost goes with the resolution and not with how many surfaces are stacked on a pixel.
+
+inline uint32_t pack_unorm16x2(float a, float b) {
+    a = std::min(1.f, std::max(0.f, a));
+    b = std::min(1.f, std::max(0.f, b));
+    return (uint32_t)(a * 65535.f + .5f) | (uint32_t)(b * 65535.f + .5f) << 16;
+}
+
+inline float unpack_unorm16(uint32_t bits) {
+    return (bits & 0xffff) * (1.f / 65535.f);
+}
+
+// unit vector folded onto the octahedron |x| + |y| + |z| = 1, the lower half flipped over the
+// upper one, so two numbers in [-1, 1] are enough
+inline uint32_t pack_octahedral(Vec3f n) {
+    float len = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    if (len == 0) return pack_unorm16x2(.5f, .5f);
+    float x = n.x / len, y = n.y / len;
+    if (n.z < 0) {
+        float fx = (1 - std::abs(y)) * (x < 0 ? -1 : 1);
+        y = (1 - std::abs(x)) * (y < 0 ? -1 : 1);
+        x = fx;
+    }
+    return pack_unorm16x2(x * .5f + .5f, y * .5f + .5f);
+}
+
+// same rows as Image, row 0 at the top. A pixel is covered when Image's depth says so
+struct GBuffer {
+    int width, height;
+    std::vector<uint32_t> uv;
+    std::vector<uint32_t> normal;
+    std::vector<uint16_t> lod; // mip level << 8 | trilinear weight of the next level
+
+    GBuffer() : width(0), height(0) {}
+
+    void init(int w, int h) {
+        width = w;
+        height = h;
+        uv.assign(w * h, 0);
+        normal.assign(w * h, 0);
+        lod.assign(w * h, 0);
+    }
+};
+
+// the geometry pass of a primitive: depth test and G-buffer write, nothing shaded
+inline void gbuffer_triangle(const Primitive &prim, TexturedShader &shader, GBuffer &g, Image &image, const Rect &clip) {
+    RasterTriangle t;
+    VaryingPlanes<TEXTURED_VARYINGS> planes;
+    if (!setup_primitive(prim, shader, clip, t, planes)) return;
+    if (raster_state.hiz && hiz_hidden(image.hiz, t)) return;
+
+    float ddx[TEXTURED_VARYINGS], ddy[TEXTURED_VARYINGS];
+    planes.derivatives(ddx, ddy);
+    shader.derivatives(ddx, ddy);
+    uint16_t lod = (uint16_t)(shader.sampler.level << 8 | std::min(shader.sampler.mix, 255u));
+    const Vec3f *pts = prim.pts;
+
+    rasterize_spans(t, [&](int y, int x0, int x1, const int64_t *wstart, bool inside) {
+        int64_t w[3] = { wstart[0], wstart[1], wstart[2] };
+        unsigned row = (image._height - y - 1) * image._width;
+        float start[TEXTURED_VARYINGS + 1], varying[TEXTURED_VARYINGS];
+        planes.start(wstart, start);
+        for (int x=x0; x<x1; x++, w[0] += t.A[0], w[1] += t.A[1], w[2] += t.A[2]) {
+            if (!inside && (w[0] | w[1] | w[2]) < 0) continue;
+            float z = pts[0][2]*(w[0] * t.inv_area) + pts[1][2]*(w[1] * t.inv_area) + pts[2][2]*(w[2] * t.inv_area);
+            if (!image.depth.update(row + x, z)) continue;
+            planes.at(start, (float)(x - x0), varying);
+            g.uv[row + x] = pack_unorm16x2(varying[0], varying[1]);
+            g.normal[row + x] = pack_octahedral(Vec3f(varying[2], varying[3], varying[4]));
+            g.lod[row + x] = lod;
+        }
+    }, HiZBlockTest(image.hiz, t, raster_state.hiz));
+}
+
+// normal of a G-buffer pixel, spelled out so the AVX2 version below can do exactly the same
+inline Vec3f gbuffer_normal(uint32_t bits) {
+    float x = unpack_unorm16(bits) * 2.f - 1.f, y = unpack_unorm16(bits >> 16) * 2.f - 1.f;
+    float z = (1.f - std::abs(x)) - std::abs(y);
+    if (z < 0) {
+        float fx = (1.f - std::abs(y)) * (x < 0 ? -1.f : 1.f);
+        y = (1.f - std::abs(x)) * (y < 0 ? -1.f : 1.f);
+        x = fx;
+    }
+    float inv = 1.f / std::sqrt(x*x + y*y + z*z);
+    return Vec3f(x * inv, y * inv, z * inv);
+}
+
+inline void shade_gbuffer_pixel(const GBuffer &g, Image &image, TextureSampler &sampler, Vec3f light_dir, unsigned idx) {
+    if (!image.depth.covered(idx)) return;
+    sampler.level = g.lod[idx] >> 8;
+    sampler.mix = g.lod[idx] & 0xff;
+    TGAColor c(sampler(unpack_unorm16(g.uv[idx]), unpack_unorm16(g.uv[idx] >> 16)), 4);
+    float intensity = std::min(1.0f, std::max(0.0f, gbuffer_normal(g.normal[idx]) * light_dir));
+    image.pixels[idx] = (int)(c.r * intensity) | (int)(c.g * intensity) << 8 | (int)(c.b * intensity) << 16;
+}
+
+#ifdef RASTER_SIMD_X86
+// 8 pixels on the same mip level, the trilinear weights can differ
+__attribute__((target("avx2")))
+inline void shade_gbuffer_avx2(const GBuffer &g, Image &image, const TextureSampler &sampler, Vec3f light_dir, unsigned idx) {
+    __m256i mix = _mm256_and_si256(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)&g.lod[idx])), _mm256_set1_epi32(0xff));
+    __m256i covered = depth_covered_avx2(image.depth, idx);
+    __m256i mask16 = _mm256_set1_epi32(0xffff);
+    __m256 unorm = _mm256_set1_ps(1.f / 65535.f);
+    __m256i uv = _mm256_loadu_si256((const __m256i*)&g.uv[idx]);
+    __m256 u = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(uv, mask16)), unorm);
+    __m256 v = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(uv, 16)), unorm);
+
+    __m256 one = _mm256_set1_ps(1.f), two = _mm256_set1_ps(2.f), zero = _mm256_setzero_ps();
+    __m256 absmask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256i nb = _mm256_loadu_si256((const __m256i*)&g.normal[idx]);
+    __m256 x = _mm256_sub_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(nb, mask16)), unorm), two), one);
+    __m256 y = _mm256_sub_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(nb, 16)), unorm), two), one);
+    __m256 ax = _mm256_and_ps(x, absmask), ay = _mm256_and_ps(y, absmask);
+    __m256 z = _mm256_sub_ps(_mm256_sub_ps(one, ax), ay);
+    __m256 fold = _mm256_cmp_ps(z, zero, _CMP_LT_OQ);
+    __m256 sx = _mm256_blendv_ps(one, _mm256_set1_ps(-1.f), _mm256_cmp_ps(x, zero, _CMP_LT_OQ));
+    __m256 sy = _mm256_blendv_ps(one, _mm256_set1_ps(-1.f), _mm256_cmp_ps(y, zero, _CMP_LT_OQ));
+    x = _mm256_blendv_ps(x, _mm256_mul_ps(_mm256_sub_ps(one, ay), sx), fold);
+    y = _mm256_blendv_ps(y, _mm256_mul_ps(_mm256_sub_ps(one, ax), sy), fold);
+    __m256 inv = _mm256_div_ps(one, _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z))));
+    x = _mm256_mul_ps(x, inv);
+    y = _mm256_mul_ps(y, inv);
+    z = _mm256_mul_ps(z, inv);
+    __m256 intensity = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(z, _mm256_set1_ps(light_dir.z)), _mm256_mul_ps(y, _mm256_set1_ps(light_dir.y))),
+                                     _mm256_mul_ps(x, _mm256_set1_ps(light_dir.x)));
+    intensity = _mm256_min_ps(one, _mm256_max_ps(zero, intensity));
+
+    __m256i tex = sample_avx2(sampler, u, v, covered, mix);
+    __m256i mask8 = _mm256_set1_epi32(0xff);
+    __m256 b = _mm256_cvtepi32_ps(_mm256_and_si256(tex, mask8));
+    __m256 gr = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(tex, 8), mask8));
+    __m256 r = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(tex, 16), mask8));
+    __m256i color = _mm256_or_si256(_mm256_cvttps_epi32(_mm256_mul_ps(r, intensity)),
+                    _mm256_or_si256(_mm256_slli_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(gr, intensity)), 8),
+                                    _mm256_slli_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(b, intensity)), 16)));
+    _mm256_maskstore_epi32((int*)(image.pixels + idx), covered, color);
+}
+#endif
+
+// the shading pass: texture times diffuse light for every covered pixel, tiles in parallel.
+// Runs of 8 pixels on the same mip level go through AVX2 when the cpu has it
+inline void shade_gbuffer(const GBuffer &g, Image &image, const Texture &texture, Vec3f light_dir, TileGrid &tiles, ThreadPool &pool) {
+    pool.parallel_for(tiles.ntiles(), [&](int i) {
+        if (!tiles.tile(i).active) return; // kept from the last frame
+        const Rect &r = tiles.tile(i).rect;
+        TextureSampler sampler(texture, texture.filter(), 0);
+        for (int y = r.y0; y < r.y1; y++) {
+            unsigned row = (image._height - y - 1) * image._width;
+            int x = r.x0;
+#ifdef RASTER_SIMD_X86
+            if (simd_level() == SIMD_AVX2) {
+                for (; x + 8 <= r.x1; x += 8) {
+                    const uint16_t *lod = &g.lod[row + x];
+                    bool same = true;
+                    for (int k=1; k<8 && same; k++) same = lod[k] >> 8 == lod[0] >> 8;
+                    if (same) {
+                        sampler.level = lod[0] >> 8;
+                        shade_gbuffer_avx2(g, image, sampler, light_dir, row + x);
+                    } else {
+                        for (int k=0; k<8; k++) shade_gbuffer_pixel(g, image, sampler, light_dir, row + x + k);
+                    }
+                }
+            }
+#endif
+            for (; x < r.x1; x++) {
+                shade_gbuffer_pixel(g, image, sampler, light_dir, row + x);
+            }
+        }
+    });
+}
@@ -4,6 +4,9 @@
 #include <vector>
 #include <cassert>
 #include <iostream>
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
 
 template <size_t DIM, typename T> struct vec {
     vec() { for (size_t i=DIM; i--; data_[i] = T()); }
@@ -170,7 +173,7 @@ public:
         for (int i = 0; i < 4; i++) {
             float sum = 0;
             for (int j = 0; j < 4; j++) {
-                sum += m[i][j] * a[i];
+                sum += m[i][j] * a[j];
             }
             retval[i] = sum;
         }
@@ -239,3 +242,139 @@ public:
 };
 
 /////////////////////////////////////////////////////////////////////////////////
+
+// Fixed size matrix, R rows by C columns, stored row major on the stack.
+// Same indexing as Matrix (m[i][j]) but no heap at all, and most of it is usable at compile time.
+template <size_t R, size_t C, typename T> struct mat {
+    T data_[R][C];
+
+    constexpr mat() : data_() {}
+
+    constexpr       T* operator[](const size_t i)       { assert(i<R); return data_[i]; }
+    constexpr const T* operator[](const size_t i) const { assert(i<R); return data_[i]; }
+
+    vec<C,T> row(const size_t i) const {
+        vec<C,T> ret;
+        for (size_t j=C; j--; ret[j]=data_[i][j]);
+        return ret;
+    }
+
+    vec<R,T> col(const size_t j) const {
+        vec<R,T> ret;
+        for (size_t i=R; i--; ret[i]=data_[i][j]);
+        return ret;
+    }
+
+    static constexpr mat identity() {
+        mat ret;
+        for (size_t i=0; i<R && i<C; i++) ret.data_[i][i] = T(1);
+        return ret;
+    }
+
+    constexpr mat<C,R,T> transpose() const {
+        mat<C,R,T> ret;
+        for (size_t i=0; i<R; i++)
+            for (size_t j=0; j<C; j++)
+                ret.data_[j][i] = data_[i][j];
+        return ret;
+    }
+
+    // Gauss-Jordan with partial pivoting. A singular matrix gives garbage, just like Matrix::inverse()
+    constexpr mat inverse() const {
+        static_assert(R==C, "only square matrices can be inverted");
+        mat a = *this;
+        mat ret = identity();
+        for (size_t c=0; c<C; c++) {
+            size_t pivot = c;
+            for (size_t r=c+1; r<R; r++) {
+                if ((a.data_[r][c] < 0 ? -a.data_[r][c] : a.data_[r][c]) > (a.data_[pivot][c] < 0 ? -a.data_[pivot][c] : a.data_[pivot][c])) pivot = r;
+            }
+            for (size_t j=0; j<C; j++) {
+                T tmp = a.data_[c][j];   a.data_[c][j] = a.data_[pivot][j];     a.data_[pivot][j] = tmp;
+                tmp = ret.data_[c][j]; ret.data_[c][j] = ret.data_[pivot][j]; ret.data_[pivot][j] = tmp;
+            }
+            T scale = a.data_[c][c];
+            for (size_t j=0; j<C; j++) {
+                a.data_[c][j] /= scale;
+                ret.data_[c][j] /= scale;
+            }
+            for (size_t r=0; r<R; r++) {
+                if (r == c) continue;
+                T coeff = a.data_[r][c];
+                for (size_t j=0; j<C; j++) {
+                    a.data_[r][j] -= a.data_[c][j] * coeff;
+                    ret.data_[r][j] -= ret.data_[c][j] * coeff;
+                }
+            }
+        }
+        return ret;
+    }
+};
+
+typedef mat<4,4,float> Mat4f;
+
+template<size_t R, size_t K, size_t C, typename T> constexpr mat<R,C,T> operator*(const mat<R,K,T>& lhs, const mat<K,C,T>& rhs) {
+    mat<R,C,T> ret;
+    for (size_t i=0; i<R; i++) {
+        for (size_t j=0; j<C; j++) {
+            T sum = T();
+            for (size_t k=0; k<K; k++) {
+                sum += lhs.data_[i][k] * rhs.data_[k][j];
+            }
+            ret.data_[i][j] = sum;
+        }
+    }
+    return ret;
+}
+
+template<size_t R, size_t C, typename T> vec<R,T> operator*(const mat<R,C,T>& lhs, const vec<C,T>& rhs) {
+    vec<R,T> ret;
+    for (size_t i=0; i<R; i++) {
+        T sum = T();
+        for (size_t j=0; j<C; j++) {
+            sum += lhs.data_[i][j] * rhs[j];
+        }
+        ret[i] = sum;
+    }
+    return ret;
+}
+
+// the hot one: every vertex goes through it. Adds up in the same order as the generic version
+inline Vec4f operator*(const Mat4f& lhs, const Vec4f& rhs) {
+#if defined(__SSE__)
+    __m128 r0 = _mm_loadu_ps(lhs.data_[0]);
+    __m128 r1 = _mm_loadu_ps(lhs.data_[1]);
+    __m128 r2 = _mm_loadu_ps(lhs.data_[2]);
+    __m128 r3 = _mm_loadu_ps(lhs.data_[3]);
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3); // now r_j holds column j
+    __m128 sum = _mm_mul_ps(r0, _mm_set1_ps(rhs.x));
+    sum = _mm_add_ps(sum, _mm_mul_ps(r1, _mm_set1_ps(rhs.y)));
+    sum = _mm_add_ps(sum, _mm_mul_ps(r2, _mm_set1_ps(rhs.z)));
+    sum = _mm_add_ps(sum, _mm_mul_ps(r3, _mm_set1_ps(rhs.w)));
+    float out[4];
+    _mm_storeu_ps(out, sum);
+    return Vec4f(out[0], out[1], out[2], out[3]);
+#else
+    vec<4,float> ret;
+    for (size_t i=0; i<4; i++) {
+        float sum = 0.f;
+        for (size_t j=0; j<4; j++) {
+            sum += lhs.data_[i][j] * rhs[j];
+        }
+        ret[i] = sum;
+    }
+    return ret;
+#endif
+}
+
+template <size_t R, size_t C, typename T> std::ostream& operator<<(std::ostream& out, const mat<R,C,T>& m) {
+    for (size_t i = 0; i < R; i++) {
+        for (size_t j = 0; j < C; j++) {
+            out << m[i][j] << "\t\t";
+        }
+        out << std::endl;
+    }
+    return out;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <vector>
+#include <cfloat>
+#include <algorithm>
+#include "tiler.hpp"
+#include "rasterizer.hpp"
+#include "depth.hpp"
+
+const int HIZ_BLOCK = RASTER_BLOCK; // the rasterizer asks about exactly the blocks it walks
+
+// Hierarchical depth on top of a depth buffer: for every 8x8 block of pixels (raster coordinates,
+// y up) the farthest and the nearest depth currently stored, as screen z whatever the format.
+// Larger z is closer, as in Image.
+// A triangle whose nearest point in a block is no closer than the block's farthest pixel
+// can't pass the depth test anywhere in it, so the whole block (or triangle) is skipped.
+//
+// The rasterizer calls touch() on every block it is about to draw into; the bounds of a
+// touched block are recomputed from the depth buffer the next time somebody asks for them.
+// Blocks never straddle a tile, so tiles on different threads never share hi-z data.
+class HiZ {
+    int _width, _height;
+    int _bw, _bh;             // blocks across and down
+    const DepthBuffer *_depth; // rows top to bottom like Image, i.e. flipped relative to raster y
+    int _samples;             // depths per pixel, the block bounds cover all of them
+    std::vector<float> _zmin, _zmax;
+    std::vector<unsigned char> _stale;
+
+    void refresh(int i) {
+        int bx = i % _bw, by = i / _bw;
+        int x0 = bx * HIZ_BLOCK, x1 = std::min(_width, x0 + HIZ_BLOCK);
+        int y0 = by * HIZ_BLOCK, y1 = std::min(_height, y0 + HIZ_BLOCK);
+        float lo = FLT_MAX, hi = -FLT_MAX;
+        for (int y = y0; y < y1; y++) {
+            _depth->bounds(((_height - y - 1) * _width + x0) * _samples, (x1 - x0) * _samples, lo, hi);
+        }
+        _zmin[i] = lo;
+        _zmax[i] = hi;
+        _stale[i] = 0;
+    }
+
+public:
+    HiZ() : _width(0), _height(0), _bw(0), _bh(0), _depth(NULL), _samples(1) {}
+
+    void init(int width, int height, const DepthBuffer *depth, int samples = 1) {
+        _width = width;
+        _height = height;
+        _bw = (width + HIZ_BLOCK - 1) / HIZ_BLOCK;
+        _bh = (height + HIZ_BLOCK - 1) / HIZ_BLOCK;
+        _depth = depth;
+        _samples = samples;
+        _zmin.resize(_bw * _bh);
+        _zmax.resize(_bw * _bh);
+        _stale.resize(_bw * _bh);
+        clear(depth->clear_value());
+    }
+
+    // the whole depth buffer was just set to depth
+    void clear(float depth) {
+        std::fill(_zmin.begin(), _zmin.end(), depth);
+        std::fill(_zmax.begin(), _zmax.end(), depth);
+        std::fill(_stale.begin(), _stale.end(), 0);
+    }
+
+    // pixels of block (bx, by) may be about to change
+    void touch(int bx, int by) {
+        _stale[by * _bw + bx] = 1;
+    }
+
+    // farthest depth stored in the block
+    float zmin(int bx, int by) {
+        int i = by * _bw + bx;
+        if (_stale[i]) refresh(i);
+        return _zmin[i];
+    }
+
+    // nearest depth stored in the block
+    float zmax(int bx, int by) {
+        int i = by * _bw + bx;
+        if (_stale[i]) refresh(i);
+        return _zmax[i];
+    }
+
+    // brings every touched block up to date, after that farthest() can be used from any thread
+    void update() {
+        for (size_t i=0; i<_stale.size(); i++) {
+            if (_stale[i]) refresh((int)i);
+        }
+    }
+
+    // like zmin(r) but read only, only right after update()
+    float farthest(const Rect &r) const {
+        float lo = FLT_MAX;
+        for (int by = r.y0 / HIZ_BLOCK; by <= (r.y1 - 1) / HIZ_BLOCK; by++) {
+            for (int bx = r.x0 / HIZ_BLOCK; bx <= (r.x1 - 1) / HIZ_BLOCK; bx++) {
+                lo = std::min(lo, _zmin[by * _bw + bx]);
+            }
+        }
+        return lo;
+    }
+
+    // farthest depth over all the blocks overlapping r
+    float zmin(const Rect &r) {
+        float lo = FLT_MAX;
+        for (int by = r.y0 / HIZ_BLOCK; by <= (r.y1 - 1) / HIZ_BLOCK; by++) {
+            for (int bx = r.x0 / HIZ_BLOCK; bx <= (r.x1 - 1) / HIZ_BLOCK; bx++) {
+                lo = std::min(lo, zmin(bx, by));
+            }
+        }
+        return lo;
+    }
+};
+
+// nearest depth the kernels can interpolate anywhere over t's bounding box, rather than its
+// nearest corner: on a sliver the top-left rule takes enough off the edge functions for the
+// pixels to come out closer than any corner, and a z-prepass stores exactly those
+inline float box_max_depth(const RasterTriangle &t) {
+    const Rect &b = t.box;
+    int64_t w[3];
+    for (int i=0; i<3; i++) w[i] = t.A[i]*b.x0 + t.B[i]*b.y0 + t.C[i];
+    return block_max_depth(t, b.x0, b.y0, b.x1, b.y1, w);
+}
+
+// true if the whole triangle is behind what's already drawn under its bounding box
+inline bool hiz_hidden(HiZ &hiz, const RasterTriangle &t) {
+    return box_max_depth(t) <= hiz.zmin(t.box);
+}
+
+// same, read only for whoever runs next to others, only right after HiZ::update()
+inline bool hiz_hidden_updated(const HiZ &hiz, const RasterTriangle &t) {
+    return box_max_depth(t) <= hiz.farthest(t.box);
+}
+
+// block callback for rasterize_spans(): skips the blocks hi-z says are hidden when test is set,
+// and marks the others as about to change (always, so the bounds stay right even while testing is off)
+struct HiZBlockTest {
+    HiZ &hiz;
+    const RasterTriangle &t;
+    bool test;
+
+    HiZBlockTest(HiZ &h, const RasterTriangle &tri, bool enabled) : hiz(h), t(tri), test(enabled) {}
+
+    bool operator()(int x0, int y0, int x1, int y1, const int64_t *w) const {
+        int bx = x0 / HIZ_BLOCK, by = y0 / HIZ_BLOCK;
+        if (test && block_max_depth(t, x0, y0, x1, y1, w) <= hiz.zmin(bx, by)) {
+            return false;
+        }
+        hiz.touch(bx, by);
+        return true;
+    }
+};
@@ -1,32 +1,163 @@
 #pragma once
 
 #include "geometry.hpp"
+#include "tgaimage.hpp"
+#include "hiz.hpp"
+#include "clear.hpp"
+#include "depth.hpp"
 #include <string.h>
 #include <cfloat>
+#include <algorithm>
+#include <vector>
+
+const int MSAA_SAMPLES = 4;
+const unsigned MSAA_FULL = (1 << MSAA_SAMPLES) - 1;
+
+// The colors of a multisampled Image. A pixel whose samples all show the same thing, be it
+// cleared, inside one triangle or covered whole by the last one drawn there, keeps its single
+// color in Image::pixels and nothing here. Only a pixel on an edge gets a slot with a color
+// per sample, out of its tile's pool, so the memory touched grows with the edges, not the
+// area. Pools belong to tiles, which keeps them thread safe the same way the pixels are
+struct MsaaSlot {
+    unsigned pixel;
+    uint32_t color[MSAA_SAMPLES];
+};
+
+class MsaaColor {
+    std::vector<std::vector<MsaaSlot> > _pools;
+    // per pixel: 0 never had a slot since the clear, otherwise its slot + 1 in the tile's pool,
+    // with the top bit set while the pixel is back to one color (the slot is reused if it splits again)
+    std::vector<uint16_t> _slot;
+
+public:
+    static const uint16_t SINGLE = 0x8000;
+
+    void init(size_t pixels, int tiles) {
+        _pools.assign(tiles, std::vector<MsaaSlot>());
+        _slot.assign(pixels, 0);
+    }
+
+    bool empty() const { return _slot.empty(); }
+    uint16_t *slots() { return _slot.data(); }
+
+    // the tile was cleared whole, its slots can go
+    void clear_pool(int tile) { _pools[tile].clear(); }
+
+    // the sample colors of pixel idx in tile, which had color on all samples unless it's split already
+    uint32_t *split(unsigned idx, int tile, uint32_t color) {
+        std::vector<MsaaSlot> &pool = _pools[tile];
+        uint16_t &s = _slot[idx];
+        if (s && !(s & SINGLE)) return pool[s - 1].color;
+        if (!s) {
+            pool.push_back(MsaaSlot());
+            pool.back().pixel = idx;
+            s = (uint16_t)pool.size();
+        }
+        s &= ~SINGLE;
+        MsaaSlot &slot = pool[s - 1];
+        for (int k=0; k<MSAA_SAMPLES; k++) slot.color[k] = color;
+        return slot.color;
+    }
+
+    // pixel idx shows one color again
+    void merge(unsigned idx) {
+        if (_slot[idx]) _slot[idx] |= SINGLE;
+    }
+
+    // every pixel of the tile that's still split gets the average of its samples
+    void resolve(int tile, unsigned *pixels) const {
+        const std::vector<MsaaSlot> &pool = _pools[tile];
+        for (size_t k=0; k<pool.size(); k++) {
+            if (_slot[pool[k].pixel] != k + 1) continue; // merged, or its pixel was cleared since
+            const uint32_t *c = pool[k].color;
+            uint32_t r = 2, g = 2, b = 2;
+            for (int s=0; s<MSAA_SAMPLES; s++) {
+                r += c[s] & 0xff;
+                g += c[s] >> 8 & 0xff;
+                b += c[s] >> 16 & 0xff;
+            }
+            pixels[pool[k].pixel] = r / MSAA_SAMPLES | (g / MSAA_SAMPLES) << 8 | (b / MSAA_SAMPLES) << 16;
+        }
+    }
+};
+
+// where a TILE_SIZE tile of an Image stands with the lazy clears
+enum TileClear {
+    TILE_CLEAR,   // holds the clear values
+    TILE_PENDING, // cleared as far as everybody's concerned, the memory still holds an old frame
+    TILE_DRAWN    // holds whatever was drawn into it
+};
 
 class Image {
 public:
     unsigned int _width, _height;
-    unsigned int *pixels;
-    float *zbuffer;
+    unsigned int *pixels; // NULL for a depth only image
+    int samples; // 1, or MSAA_SAMPLES with a depth per sample and msaa holding the split pixels
+    DepthBuffer depth; // samples per pixel one after the other
+    HiZ hiz; // per block bounds of depth, for the rasterizer's occlusion tests
+    MsaaColor msaa;
+    int _tiles_x, _tiles_y;
+    std::vector<unsigned char> _tiles; // TileClear of every tile, row by row from the bottom like TileGrid
+
+    // pixels and depth of r back to the clear values, around the caches with stream (fence after)
+    void fill(const Rect &r, bool stream) {
+        for (int y = r.y0; y < r.y1; y++) {
+            unsigned row = (_height - y - 1) * _width;
+            if (pixels && stream) {
+                stream_fill32(pixels + row + r.x0, 0, r.x1 - r.x0);
+            } else if (pixels) {
+                fill32(pixels + row + r.x0, 0, r.x1 - r.x0);
+            }
+            depth.fill((row + r.x0) * samples, (r.x1 - r.x0) * samples, stream);
+            if (msaa.empty()) continue;
+            if (stream) {
+                stream_fill16(msaa.slots() + row + r.x0, 0, r.x1 - r.x0);
+            } else {
+                fill16(msaa.slots() + row + r.x0, 0, r.x1 - r.x0);
+            }
+        }
+        if (msaa.empty()) return;
+        for (int ty = r.y0 / TILE_SIZE; ty <= (r.y1 - 1) / TILE_SIZE; ty++) {
+            for (int tx = r.x0 / TILE_SIZE; tx <= (r.x1 - 1) / TILE_SIZE; tx++) {
+                Rect t = tile_rect(ty * _tiles_x + tx);
+                if (r.x0 <= t.x0 && r.y0 <= t.y0 && t.x1 <= r.x1 && t.y1 <= r.y1) msaa.clear_pool(ty * _tiles_x + tx);
+            }
+        }
+    }
+
+    Rect tile_rect(int i) const {
+        int tx = i % _tiles_x, ty = i / _tiles_x;
+        return Rect(tx * TILE_SIZE, ty * TILE_SIZE, std::min<int>(_width, (tx + 1) * TILE_SIZE), std::min<int>(_height, (ty + 1) * TILE_SIZE));
+    }
+
+    // the tile of pixel (x, y) got a clear_lazy() and hasn't been prepared since: its memory is stale
+    bool pending(int x, int y) const {
+        return _tiles[(y / TILE_SIZE) * _tiles_x + x / TILE_SIZE] == TILE_PENDING;
+    }
 
 public:
     Image() {
 
     }
 
-    Image(unsigned int width , unsigned int height) {
+    // nsamples is 1 or MSAA_SAMPLES. Without color it's just the depth buffer and its hi-z,
+    // for the depth only passes (see depth_raster.hpp)
+    Image(unsigned int width , unsigned int height, DepthFormat depth_format = DEPTH_FLOAT, int nsamples = 1, bool color = true) {
         _width = width;
         _height = height;
-        pixels = new unsigned int[_width * _height];
-        zbuffer = new float[_width * _height];
+        samples = nsamples;
+        pixels = color ? new unsigned int[_width * _height] : NULL;
+        depth.init(_width * _height * samples, depth_format);
+        hiz.init(_width, _height, &depth, samples);
+        _tiles_x = (_width + TILE_SIZE - 1) / TILE_SIZE;
+        _tiles_y = (_height + TILE_SIZE - 1) / TILE_SIZE;
+        _tiles.resize(_tiles_x * _tiles_y);
+        if (samples > 1) msaa.init(_width * _height, _tiles_x * _tiles_y);
         clear();
     }
 
-    ~Image() {
-        delete pixels;
-        delete zbuffer;
-
+    virtual ~Image() {
+        delete[] pixels;
     }
 
     virtual void setPixel(unsigned int x, unsigned int y, Vec3i RGB, float zDepth){
@@ -40,18 +171,106 @@ public:
         unsigned int idx = y * _width + x; 
 
 
-        if (zDepth > zbuffer[idx]) {
+        if (depth.update(idx, zDepth)) {
             pixels[idx] = color;
-            zbuffer[idx] = zDepth;
         } 
     }
 
+    // MSAA: color for the samples of pixel (x, y) in mask (raster coordinates, y up), their depth is written already
+    void set_samples(int x, int y, unsigned mask, uint32_t color) {
+        unsigned idx = (_height - y - 1) * _width + x;
+        if (mask == MSAA_FULL) {
+            pixels[idx] = color;
+            msaa.merge(idx);
+            return;
+        }
+        uint32_t *c = msaa.split(idx, (y / TILE_SIZE) * _tiles_x + x / TILE_SIZE, pixels[idx]);
+        for (int s=0; s<MSAA_SAMPLES; s++) {
+            if (mask >> s & 1) c[s] = color;
+        }
+    }
+
+    // MSAA: the split pixels of tile i (as in TileGrid) get their final color. Pixels only ever
+    // hold the color of all their samples, so that's all a resolve has to do
+    void resolve(int i) {
+        if (!msaa.empty()) msaa.resolve(i, pixels);
+    }
+
+    // everything, right away, with non-temporal stores (see clear.hpp)
     virtual void clear() {
-        memset(pixels, 0, _width * _height * sizeof(unsigned int));
+        if (pixels) stream_fill32(pixels, 0, _width * _height);
+        depth.fill(0, _width * _height * samples, true);
+        if (!msaa.empty()) {
+            stream_fill16(msaa.slots(), 0, _width * _height);
+            for (size_t i=0; i<_tiles.size(); i++) msaa.clear_pool((int)i);
+        }
+        stream_fence();
+        hiz.clear(depth.clear_value());
+        std::fill(_tiles.begin(), _tiles.end(), (unsigned char)TILE_CLEAR);
+    }
+
+    // Everything, but only in name: tiles are really cleared by prepare() right before the
+    // first draw into them, or by finish_clears() if nothing got drawn there. A tile that stays
+    // empty frame after frame is never written again. The hi-z reads cleared right away
+    void clear_lazy() {
+        for (size_t i=0; i<_tiles.size(); i++) {
+            if (_tiles[i] == TILE_DRAWN) _tiles[i] = TILE_PENDING;
+        }
+        hiz.clear(depth.clear_value());
+    }
+
+    // about to draw into r (one tile in practice): does the clears clear_lazy() put off there.
+    // Whatever draws into an image between clear_lazy() and finish_clears() has to call it,
+    // the tiled renderer does it once per tile. Tiles never share an entry, so it's thread safe per tile
+    void prepare(const Rect &r) {
+        for (int ty = r.y0 / TILE_SIZE; ty <= (r.y1 - 1) / TILE_SIZE; ty++) {
+            for (int tx = r.x0 / TILE_SIZE; tx <= (r.x1 - 1) / TILE_SIZE; tx++) {
+                int i = ty * _tiles_x + tx;
+                if (_tiles[i] == TILE_PENDING) fill(tile_rect(i), false); // the rasterizer reads it right after
+                _tiles[i] = TILE_DRAWN;
+            }
+        }
+    }
+
+    // the frame is drawn, clear the tiles that were put off and never drawn into. Nobody reads
+    // them soon, so they're streamed, a run of neighbours in a tile row at a time
+    void finish_clears() {
+        bool any = false;
+        for (int ty = 0; ty < _tiles_y; ty++) {
+            for (int tx = 0; tx < _tiles_x; tx++) {
+                if (_tiles[ty * _tiles_x + tx] != TILE_PENDING) continue;
+                int end = tx;
+                while (end < _tiles_x && _tiles[ty * _tiles_x + end] == TILE_PENDING) _tiles[ty * _tiles_x + end++] = TILE_CLEAR;
+                Rect first = tile_rect(ty * _tiles_x + tx), last = tile_rect(ty * _tiles_x + end - 1);
+                fill(Rect(first.x0, first.y0, last.x1, last.y1), true);
+                any = true;
+                tx = end;
+            }
+        }
+        if (any) stream_fence();
+    }
+
+    // clears only r (raster coordinates, y up), the rest of the frame is kept
+    void clear(const Rect &r) {
+        prepare(r); // what's outside r but in its tiles has to be right too
+        fill(r, false);
+        for (int by = r.y0 / HIZ_BLOCK; by <= (r.y1 - 1) / HIZ_BLOCK; by++) {
+            for (int bx = r.x0 / HIZ_BLOCK; bx <= (r.x1 - 1) / HIZ_BLOCK; bx++) {
+                hiz.touch(bx, by);
+            }
+        }
+    }
 
-        //can't use memset for floats
-        for(int i = 0; i < (_width * _height); i++) {
-            zbuffer[i] = -FLT_MAX;
+    // dump the color buffer, row 0 is the top of the image just like in pixels
+    bool write_tga_file(const char *filename) {
+        if (!pixels) return false;
+        TGAImage out(_width, _height, TGAImage::RGB);
+        for (unsigned int y = 0; y < _height; y++) {
+            for (unsigned int x = 0; x < _width; x++) {
+                unsigned int color = pixels[y * _width + x];
+                out.set(x, y, TGAColor(color & 0xff, (color >> 8) & 0xff, (color >> 16) & 0xff, 255));
+            }
         }
+        return out.write_tga_file(filename);
     }
 };
\ No newline at end of file
@@ -1,15 +1,35 @@
 #include <vector>
 #include <cmath>
 #include <cstdlib>
+#include <cstdio>
+#include <cerrno>
 #include <limits>
+#include <string>
+#include <chrono>
+#include <algorithm>
 #include <time.h>
+#include <sys/stat.h>
+#ifndef NO_SDL
 #include <SDL2/SDL.h>
+#endif
 
 #include "tgaimage.hpp"
 #include "model.hpp"
 #include "geometry.hpp"
 #include "image.hpp"
 #include "our_gl.hpp"
+#include "tiler.hpp"
+#include "thread_pool.hpp"
+#include "pipeline.hpp"
+#include "scene.hpp"
+#include "gbuffer.hpp"
+#include "visibility.hpp"
+#include "frame_pipeline.hpp"
+#include "dirty.hpp"
+#include "msaa.hpp"
+#include "oit.hpp"
+#include "depth_raster.hpp"
+#include "shadow.hpp"
 
 Model *model = NULL;
 const int width  = 800;
@@ -23,118 +43,751 @@ Vec3f up(0, 1, 0);
 
 time_t prev;
 
-Matrix ModelView, Viewport, Projection;
+Mat4f ModelView, Viewport, Projection;
 
-// this shader thing isn't working yet, will get to it soon. For now, just do shading 'manually'
-struct GouraudShader : public IShader {
-    Vec3f varying_intensity; // written by vertex shader, read by fragment shader
+ThreadPool *pool = NULL;
+Scene scene;
 
-    virtual Vec4f vertex(int iface, int nthvert) {
-        Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert)); // read the vertex from .obj file
-        gl_Vertex = Viewport*Projection*ModelView*gl_Vertex;     // transform it to screen coordinates
-        varying_intensity[nthvert] = std::max(0.f, model->normal(iface, nthvert)*light_dir); // get diffuse lighting intensity
-        return gl_Vertex;
+// how a frame gets from primitives to pixels
+enum RenderMode {
+    RENDER_FORWARD, // every fragment that passes the depth test is shaded right away
+    RENDER_DEFERRED, // textured shader only: G-buffer first, then every visible pixel shaded once
+    RENDER_VISIBILITY // textured shader only: face ids and depth first, then every visible pixel shaded once
+};
+GBuffer gbuffer;
+VisibilityBuffer visibility;
+OitBuffer oit; // the translucent instances' fragments, empty when everything is opaque
+
+// what a frame drew, after culling
+struct FrameStats {
+    int instances, meshlets, primitives;
+    unsigned oit_added, oit_lost; // translucent fragments, and those the OIT buffer dropped or merged
+    int queries, queries_hidden;  // occlusion queries, and how many found their object hidden
+    FrameStats() : instances(0), meshlets(0), primitives(0), oit_added(0), oit_lost(0), queries(0), queries_hidden(0) {}
+};
+
+// everything a frame writes from its geometry to its present, one per frame in flight.
+// Drawing one frame at a time only ever uses the first
+struct FrameState {
+    Mat4f view;                  // world to homogeneous screen
+    Vec3f eye;                   // the camera, in the world
+    std::vector<DrawItem> items; // of the pass being drawn
+    VertexStage vertices;
+    PrimitiveAssembly primitives;
+    TileGrid *tiles;             // the primitives binned to screen tiles
+    FrameStats stats;
+
+    FrameState() : tiles(NULL) {}
+};
+const int MAX_FRAMES_IN_FLIGHT = 3;
+FrameState frames[MAX_FRAMES_IN_FLIGHT];
+DirtyTracker dirty; // what of the image has to be redrawn, drawing one frame at a time
+ShadowMap shadow; // the scene's depth from the light, empty without shadows. Only raster stages draw into it
+FrameState shadow_frames[MAX_FRAMES_IN_FLIGHT]; // the shadow pass of the frame in the same slot, its view is the light's
+Mat4f animated_base; // where --animate sways the last instance around
+const float ANIMATE_SWAY = .3f; // how far --animate takes it to either side
+AABB depth_bounds; // what the camera's depth range covers: the scene and wherever --animate takes it
+
+// the shaders draw() has been instantiated with
+enum ShaderKind {
+    SHADER_TEXTURED, // TexturedShader from our_gl.hpp, runs on the SIMD kernels
+    SHADER_GOURAUD   // GouraudShader below, plain white diffuse
+};
+
+// everything that can be set from the command line
+struct Options {
+    const char *model_path;
+    bool headless;      // render offscreen, never touch SDL
+    int frames;         // number of frames to render in headless mode
+    const char *outdir; // where to dump frame_XXXX.tga, NULL = don't write anything
+    bool orbit;         // move the camera around lookAt, one full turn over all the frames
+    int threads;        // rasterizer threads, 0 = one per core
+    SimdLevel simd;     // widest pixel kernel allowed, the cpu may support less
+    bool mesh_cache;    // load/save the model through a .trmesh file next to it
+    ShaderKind shader;  // which of the prebuilt pipelines draws the model
+    RenderMode mode;    // forward, deferred or visibility buffer, see RenderMode
+    bool z_prepass;     // forward rendering: depth only first, then only the visible fragments get shaded
+    bool lazy_clear;    // clear tiles when they're first drawn into, see Image::clear_lazy()
+    DepthFormat depth_format; // what the images' depth buffers store, see depth.hpp
+    int msaa_samples;   // MSAA_SAMPLES for multisampled images, forward rendering only
+    RasterState raster; // the rasterizer's switches, main() hands them to raster_state
+    Vec3f eye;          // where the camera starts
+    TextureFilter filter; // how the textured shader samples the diffuse texture
+    int instances;      // copies of the model in the scene, on a grid going away from the camera
+    bool bake;          // just write the model with its meshlets to a .trmesh next to it and quit
+    int frames_in_flight; // 1 draws a frame at a time, 2 or 3 overlap geometry, raster and present (see FramePipeline)
+    bool incremental;   // one frame at a time only: redraw just what changed since the last frame, see DirtyTracker
+    bool animate;       // one frame at a time only: move the last instance every frame
+    float alpha;        // opacity of every other instance from the second on (of the only one if there's one), 1 for all opaque
+    OitMode oit;        // how the translucent instances' fragments are kept, see oit.hpp
+    int oit_budget;     // OIT fragments per pixel: on average with the A-buffer, at most with the k-buffer
+    int shadow_size;    // texels of the shadow map along a side, 0 for no shadows
+
+    Options() : model_path("resources/models/african_head.obj"), headless(false), frames(1), outdir(NULL), orbit(false), threads(0), simd(SIMD_AVX2), mesh_cache(false), shader(SHADER_TEXTURED), mode(RENDER_FORWARD), z_prepass(false), lazy_clear(false), depth_format(DEPTH_FLOAT), msaa_samples(1), eye(eyePt), filter(FILTER_TRILINEAR), instances(1), bake(false), frames_in_flight(1), incremental(true), animate(false), alpha(1.f), oit(OIT_ABUFFER), oit_budget(4), shadow_size(0) {}
+};
+
+struct GouraudShader {
+    static const int VARYINGS = 1; // diffuse intensity
+    const DrawItem *item;
+
+    GouraudShader() : item(NULL) {}
+
+    void bind(const DrawItem &drawn) {
+        item = &drawn;
     }
 
-    virtual bool fragment(Vec3f bar, TGAColor &color) {
-        float intensity = varying_intensity*bar;   // interpolate intensity for the current pixel
-        color = TGAColor(255.0f * intensity, 255.0f * intensity, 255.0f * intensity, 255.0f * intensity) ; // well duh
+    Vec3f vertex(int iface, int nthvert, float *varying) {
+        uint32_t i = item->model->index(iface, nthvert);
+        varying[0] = std::min(1.f, std::max(0.f, item->model->normal(i)*light_dir)); // get diffuse lighting intensity
+        return item->screen[i]; // transformed to screen coordinates once per frame by the vertex stage
+    }
+
+    void derivatives(const float *, const float *) {} // nothing sampled, nothing to filter
+
+    bool fragment(const float *varying, TGAColor &color) {
+        float intensity = varying[0];              // interpolated for the current pixel
+        color = TGAColor(255.0f * intensity, 255.0f * intensity, 255.0f * intensity, 255) ; // well duh
         return false;                              // no, we do not discard this pixel
     }
 };
 
-void draw(TGAImage &texture, Image &image, IShader &shader) {
-    
-    for (int i=0; i<model->nfaces(); i++) {
-        Face f = model->face(i);
-        Vec3f screen_coords[3];
-        Vec3f face_tcs[3];
-        Vec3f face_norms[3];
-
-        for (int j=0; j<3; j++) {
-            Vec3f v = model->vert(i, j);
-            Vec4f gl_Vertex = Vec4f(v.x, v.y, v.z, 1.0f);
-
-            screen_coords[j] = m2v(Viewport * Projection * v2m(gl_Vertex.xyz()));
-            face_tcs[j] = model->texcoord(i, j);
-            face_norms[j] = model->normal(i, j);
+// rebuild the camera matrices from eyePt/lookAt/up
+void setup_camera(DepthFormat format) {
+    ModelView  = lookat(eyePt, lookAt, up);
+    float coeff = -1.0f / (eyePt - lookAt).norm();
+    // w is affine, so the corners of depth_bounds have its extremes
+    float near_w = FLT_MAX, far_w = -FLT_MAX;
+    for (int i=0; i<8; i++) {
+        float w = 1.f + coeff * (ModelView * Vec4f(depth_bounds.corner(i))).z;
+        near_w = std::min(near_w, w);
+        far_w = std::max(far_w, w);
+    }
+    near_w = std::max(near_w, CLIP_NEAR_W); // the rest gets clipped anyway
+    far_w = std::max(far_w, near_w * 2.f);  // the scene is all behind the eye, any range will do
+    Viewport   = depth_viewport(viewport(width/8, height/8, width*3/4, height*3/4, depth), coeff, format, near_w, far_w);
+    Projection = projection(coeff);
+}
+
+// camera position for frame i out of n when orbiting: same radius and height as the starting eye point
+Vec3f orbit_eye(const Vec3f &start, int i, int n) {
+    Vec3f offset = start - lookAt;
+    float radius = std::sqrt(offset.x*offset.x + offset.z*offset.z);
+    float angle = std::atan2(offset.x, offset.z) + 2.f * M_PI * i / n;
+    return Vec3f(lookAt.x + radius * std::sin(angle), start.y, lookAt.z + radius * std::cos(angle));
+}
+
+// the camera of the next frame, from eyePt/lookAt/up
+void begin_frame(FrameState &fs, DepthFormat format) {
+    setup_camera(format);
+    fs.view = Viewport * Projection * ModelView;
+    fs.eye = eyePt;
+    fs.stats = FrameStats();
+}
+
+// rasterizes the primitives binned in fs with shader, raster(prim, shader, tile rect) draws
+// one primitive into one tile
+template <typename Shader, typename RasterFn> void draw(FrameState &fs, Image &image, const Shader &shader, RasterFn raster) {
+    // rasterize the tiles in parallel, each one only writes to its own pixels and has its own shader
+    pool->parallel_for(fs.tiles->ntiles(), [&](int t) {
+        Tile &tile = fs.tiles->tile(t);
+        if (tile.tris.empty()) return;
+        image.prepare(tile.rect);
+        Shader tile_shader = shader;
+        int bound = -1;
+        for (size_t k=0; k<tile.tris.size(); k++) {
+            const Primitive &prim = fs.primitives[tile.tris[k]];
+            if (prim.item != bound) {
+                bound = prim.item;
+                tile_shader.bind(fs.items[bound]);
+            }
+            raster(prim, tile_shader, tile.rect);
         }
+    });
+}
 
-        triangle(screen_coords, face_tcs, face_norms, light_dir, image, texture, shader);
+template <typename Shader> void draw(FrameState &fs, Image &image, const Shader &shader) {
+    draw(fs, image, shader, [&](const Primitive &prim, Shader &tile_shader, const Rect &rect) {
+        float alpha = fs.items[prim.item].alpha;
+        if (alpha < 1.f) {
+            oit_triangle(prim, tile_shader, alpha, oit, image, rect);
+        } else if (image.samples > 1) {
+            msaa_triangle(prim, tile_shader, image, rect);
+        } else {
+            triangle(prim, tile_shader, image, rect);
+        }
+    });
+}
+
+// the opaque primitives binned in fs, depth only (see depth_raster.hpp)
+void draw_depth(FrameState &fs, Image &image, DepthOnly mode) {
+    pool->parallel_for(fs.tiles->ntiles(), [&](int t) {
+        Tile &tile = fs.tiles->tile(t);
+        if (tile.tris.empty()) return;
+        image.prepare(tile.rect);
+        for (size_t k=0; k<tile.tris.size(); k++) {
+            const Primitive &prim = fs.primitives[tile.tris[k]];
+            if (fs.items[prim.item].alpha < 1.f) continue;
+            depth_primitive(prim, image, tile.rect, mode, raster_state);
+        }
+    });
+}
+
+// the geometry of the given scene instances: vertex stage, primitive assembly (clusters tested
+// against hiz if there is one, culled as state says) and binning of what survived culling and clipping
+void prepare_instances(FrameState &fs, const std::vector<int> &ids, const Rect &screen, const HiZ *hiz, const RasterState &state = raster_state) {
+    fs.items.resize(ids.size());
+    for (size_t k=0; k<ids.size(); k++) {
+        const Instance &inst = scene.instance(ids[k]);
+        fs.items[k].model = inst.model;
+        fs.items[k].instance = ids[k];
+        fs.items[k].transform = fs.view * inst.transform;
+        Vec4f eye = inst.inverse * Vec4f(fs.eye);
+        fs.items[k].eye = Vec3f(eye.x, eye.y, eye.z);
+        fs.items[k].alpha = inst.alpha;
+    }
+
+    // every vertex transformed once, the shaders pick their corners out of the buffer by index
+    fs.vertices.run(fs.items, screen, *pool);
+    fs.primitives.run(fs.items, fs.vertices, screen, state, hiz, *pool);
+    fs.stats.instances += (int)ids.size();
+    fs.stats.meshlets += fs.primitives.nmeshlets();
+    fs.stats.primitives += fs.primitives.size();
+
+    fs.tiles->clear();
+    for (int i=0; i<fs.primitives.size(); i++) {
+        fs.tiles->bin(i, fs.primitives[i].pts);
     }
 }
 
-int main(int argc, char** argv) {
-    if (2==argc) {
-        model = new Model(argv[1]);
+// rasterizes what prepare_instances() left in fs with the prebuilt pipeline for opts.shader
+void raster_instances(FrameState &fs, Image &image, const Texture &texture, const Options &opts) {
+    if (opts.z_prepass) {
+        draw_depth(fs, image, DEPTH_ONLY_PREPASS);
+        image.hiz.update(); // the shading pass gets its triangles and blocks tested against all of it
+    }
+    switch (opts.shader) {
+        case SHADER_GOURAUD:
+            draw(fs, image, GouraudShader());
+            break;
+        case SHADER_TEXTURED:
+        default:
+            if (opts.mode == RENDER_DEFERRED) {
+                draw(fs, image, TexturedShader(texture, light_dir), [&](const Primitive &prim, TexturedShader &shader, const Rect &rect) {
+                    gbuffer_triangle(prim, shader, gbuffer, image, rect);
+                });
+            } else if (opts.mode == RENDER_VISIBILITY) {
+                draw(fs, image, VisibilityShader(visibility), [&](const Primitive &prim, VisibilityShader &shader, const Rect &rect) {
+                    visibility_triangle(prim, shader.instance_id | prim.face, visibility, image, rect);
+                });
+            } else {
+                draw(fs, image, TexturedShader(texture, light_dir));
+            }
+            break;
+    }
+}
+
+void draw_instances(FrameState &fs, Image &image, const Texture &texture, const Options &opts, const std::vector<int> &ids, const HiZ *hiz) {
+    if (ids.empty()) return;
+    prepare_instances(fs, ids, Rect(0, 0, image._width, image._height), hiz);
+    raster_instances(fs, image, texture, opts);
+}
+
+// drops the instances of ids whose box an occlusion query finds hidden in image, for what
+// the hi-z lets through but the exact depth doesn't. Queries run in parallel
+void query_instances(FrameState &fs, Image &image, std::vector<int> &ids) {
+    static std::vector<unsigned char> hidden;
+    hidden.assign(ids.size(), 0);
+    pool->parallel_for((int)ids.size(), [&](int k) {
+        hidden[k] = occlusion_query(scene.instance(ids[k]).bounds, fs.view, image, raster_state) == 0;
+    });
+    size_t n = 0;
+    for (size_t k=0; k<ids.size(); k++) {
+        if (!hidden[k]) ids[n++] = ids[k];
+    }
+    fs.stats.queries += (int)ids.size();
+    fs.stats.queries_hidden += (int)(ids.size() - n);
+    ids.resize(n);
+}
+
+// Two phase occlusion culling: first draw what was visible last frame and is still in the frustum,
+// which fills the hi-z, then test everything else against it (whole BVH subtrees at once)
+// and draw what passes. Whatever isn't hidden at the end is what the next frame starts with.
+void draw_scene(FrameState &fs, Image &image, const Texture &texture, const Options &opts) {
+    static std::vector<int> in_frustum, first, second;
+    Rect screen(0, 0, image._width, image._height);
+
+    scene.update();
+    if (!raster_state.frustum_cull) {
+        in_frustum.resize(scene.size());
+        for (int i=0; i<scene.size(); i++) in_frustum[i] = i;
+    } else {
+        scene.cull(fs.view, screen, NULL, in_frustum);
+    }
+    if (!dirty.all()) {
+        // a partial redraw: whatever is on the tiles being redrawn, no occlusion culling
+        in_frustum.erase(std::remove_if(in_frustum.begin(), in_frustum.end(), [&](int id) {
+            Rect r;
+            return !box_rect(scene.instance(id).bounds, fs.view, screen, r) || !dirty.overlaps(r);
+        }), in_frustum.end());
+    }
+    if (!raster_state.occlusion_cull || !dirty.all()) {
+        draw_instances(fs, image, texture, opts, in_frustum, NULL);
+        return;
+    }
+
+    first.clear();
+    for (size_t i=0; i<in_frustum.size(); i++) {
+        if (scene.was_visible(in_frustum[i])) first.push_back(in_frustum[i]);
+    }
+    draw_instances(fs, image, texture, opts, first, NULL);
+
+    image.hiz.update();
+    scene.cull(fs.view, screen, &image.hiz, second);
+    second.erase(std::remove_if(second.begin(), second.end(), [](int id) { return scene.was_visible(id); }), second.end());
+    if (raster_state.occlusion_queries) query_instances(fs, image, second);
+    draw_instances(fs, image, texture, opts, second, &image.hiz);
+
+    image.hiz.update();
+    first.insert(first.end(), second.begin(), second.end());
+    first.erase(std::remove_if(first.begin(), first.end(), [&](int id) {
+        return cull_box(scene.instance(id).bounds, fs.view, screen, false, &image.hiz) == VIS_OUTSIDE;
+    }), first.end());
+    if (raster_state.occlusion_queries) query_instances(fs, image, first);
+    scene.set_visible(first);
+}
+
+// the shadow pass that goes with fs, one of frames
+FrameState &shadow_frame(const FrameState &fs) {
+    return shadow_frames[&fs - frames];
+}
+
+// --shadows, the geometry of the shadow pass: the opaque instances seen from the light.
+// Both sides of the triangles are drawn, the models aren't closed
+void shadow_geometry(FrameState &sf) {
+    static std::vector<int> casters;
+    casters.clear();
+    AABB bounds;
+    for (int i=0; i<scene.size(); i++) {
+        if (scene.instance(i).alpha < 1.f) continue; // translucent instances don't cast shadows
+        casters.push_back(i);
+        bounds.expand(scene.instance(i).bounds);
+    }
+    sf.stats = FrameStats();
+    if (casters.empty()) {
+        sf.primitives.clear();
+        sf.tiles->clear();
+        return;
+    }
+    sf.view = shadow.fit(light_dir, bounds);
+    sf.eye = bounds.center() + light_dir; // meshlet cones only get tested with CULL_BACK
+    RasterState state = raster_state;
+    state.cull = CULL_NONE;
+    prepare_instances(sf, casters, Rect(0, 0, shadow.map()._width, shadow.map()._height), NULL, state);
+}
+
+// and its raster stage, depth only into the shadow map
+void shadow_raster(FrameState &sf) {
+    shadow.map().clear();
+    draw_depth(sf, shadow.map(), DEPTH_ONLY_WRITE);
+}
+
+// the clears that were put off, then the shading (or resolve) pass when the frame was deferred,
+// the shadows and the translucent fragments on top of it all
+void finish_frame(FrameState &fs, Image &image, const Texture &texture, const Options &opts) {
+    image.finish_clears();
+    if (image.samples > 1) {
+        resolve_msaa(image, *fs.tiles, *pool);
+    }
+    if (opts.mode == RENDER_DEFERRED && opts.shader == SHADER_TEXTURED) {
+        shade_gbuffer(gbuffer, image, texture, light_dir, *fs.tiles, *pool);
+    } else if (opts.mode == RENDER_VISIBILITY && opts.shader == SHADER_TEXTURED) {
+        resolve_visibility(visibility, image, scene, fs.view, texture, light_dir, *fs.tiles, *pool);
+    }
+    if (!shadow.empty()) {
+        apply_shadows(shadow, shadow_frame(fs).view, image, fs.view, *fs.tiles, *pool);
+    }
+    if (!oit.empty()) {
+        resolve_oit(oit, image, *fs.tiles, *pool);
+        fs.stats.oit_added = oit.added();
+        fs.stats.oit_lost = oit.lost();
+    }
+}
+
+// a frame, one stage after the other
+void draw(FrameState &fs, Image &image, const Texture &texture, const Options &opts) {
+    if (!shadow.empty()) {
+        shadow_geometry(shadow_frame(fs));
+        shadow_raster(shadow_frame(fs));
+    }
+    draw_scene(fs, image, texture, opts);
+    finish_frame(fs, image, texture, opts);
+}
+
+// the whole image back to empty, right away or as the tiles get drawn
+void clear_frame(Image &image, bool lazy) {
+    if (lazy) {
+        image.clear_lazy();
+    } else {
+        image.clear();
+    }
+}
+
+// a frame drawn over the one already in image: only the tiles that changed are cleared and
+// redrawn. Returns false when nothing did, image still shows the last frame then
+bool redraw(FrameState &fs, Image &image, const Texture &texture, const Options &opts) {
+    if (!shadow.empty() && !scene.moved().empty()) {
+        dirty.invalidate(); // its shadow moved too, which can be anywhere
+    }
+    if (!dirty.update(fs.view, light_dir, scene, Rect(0, 0, image._width, image._height), *fs.tiles)) {
+        return false;
+    }
+    if (dirty.all()) {
+        clear_frame(image, opts.lazy_clear);
+    } else {
+        for (size_t i=0; i<dirty.rects().size(); i++) image.clear(dirty.rects()[i]);
+    }
+    draw(fs, image, texture, opts);
+    return true;
+}
+
+// --animate: the last instance sways from side to side, the rest of the scene stays put
+void animate(int frame) {
+    scene.set_transform(scene.size() - 1, translation(Vec3f(ANIMATE_SWAY * std::sin(frame * .25f), 0, 0)) * animated_base);
+}
+
+// The geometry stage of a pipelined frame: frustum culling, vertices, primitives, binning.
+// The raster stage of the frame before is still running, so there's no hi-z of this frame's
+// own to test instances and meshlets against, and last frame's isn't conservative once the
+// camera moves: occlusion culling is left to the rasterizer's per triangle and block tests
+void geometry_stage(FrameState &fs, const Rect &screen) {
+    static std::vector<int> in_frustum;
+    scene.update();
+    if (!shadow.empty()) shadow_geometry(shadow_frame(fs));
+    if (!raster_state.frustum_cull) {
+        in_frustum.resize(scene.size());
+        for (int i=0; i<scene.size(); i++) in_frustum[i] = i;
     } else {
-        model = new Model("resources/models/african_head.obj");
+        scene.cull(fs.view, screen, NULL, in_frustum);
+    }
+    if (in_frustum.empty()) {
+        fs.primitives.clear();
+        fs.tiles->clear();
+        return;
+    }
+    prepare_instances(fs, in_frustum, screen, NULL);
+}
+
+// and its raster stage, into an image of its own
+void raster_stage(FrameState &fs, Image &image, const Texture &texture, const Options &opts) {
+    if (!shadow.empty()) shadow_raster(shadow_frame(fs));
+    clear_frame(image, opts.lazy_clear);
+    raster_instances(fs, image, texture, opts);
+    finish_frame(fs, image, texture, opts);
+}
+
+bool parse_args(int argc, char **argv, Options &opts) {
+    // what to say about an option, or a value of one, that isn't known
+    auto unknown = [&](const std::string &what) {
+        std::cerr << "unknown or incomplete option " << what << "\n";
+        std::cerr << "usage: " << argv[0] << " [model.obj] [--headless] [--frames N] [--out DIR] [--orbit] [--threads N] [--simd scalar|sse|avx2] [--mesh-cache] [--no-hiz] [--no-early-z] [--shader textured|gouraud] [--filter nearest|bilinear|trilinear] [--mode forward|deferred|visibility] [--cull back|front|none] [--no-frustum-cull] [--eye x,y,z] [--no-occlusion-cull] [--instances N] [--no-cone-cull] [--frames-in-flight 1|2|3] [--no-incremental] [--lazy-clear] [--depth float|reversed|d24s8|d16] [--msaa 1|4] [--alpha A] [--oit abuffer|kbuffer] [--oit-budget N] [--shadows N] [--z-prepass] [--occlusion-queries] [--animate] [--bake]\n";
+        return false;
+    };
+    for (int i=1; i<argc; i++) {
+        std::string arg(argv[i]);
+        if (arg == "--headless") {
+            opts.headless = true;
+        } else if (arg == "--frames" && i+1 < argc) {
+            opts.frames = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--out" && i+1 < argc) {
+            opts.outdir = argv[++i];
+        } else if (arg == "--orbit") {
+            opts.orbit = true;
+        } else if (arg == "--threads" && i+1 < argc) {
+            opts.threads = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--no-hiz") {
+            opts.raster.hiz = false;
+        } else if (arg == "--no-early-z") {
+            opts.raster.early_z = false;
+        } else if (arg == "--cull" && i+1 < argc) {
+            std::string face(argv[++i]);
+            if (face != "back" && face != "front" && face != "none") return unknown(arg + " " + face);
+            opts.raster.cull = face == "none" ? CULL_NONE : (face == "front" ? CULL_FRONT : CULL_BACK);
+        } else if (arg == "--eye" && i+1 < argc) {
+            if (sscanf(argv[++i], "%f,%f,%f", &opts.eye.x, &opts.eye.y, &opts.eye.z) != 3) {
+                std::cerr << "--eye wants x,y,z\n";
+                return false;
+            }
+        } else if (arg == "--no-frustum-cull") {
+            opts.raster.frustum_cull = false;
+        } else if (arg == "--no-cone-cull") {
+            opts.raster.cone_cull = false;
+        } else if (arg == "--bake") {
+            opts.bake = true;
+        } else if (arg == "--no-occlusion-cull") {
+            opts.raster.occlusion_cull = false;
+        } else if (arg == "--instances" && i+1 < argc) {
+            opts.instances = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--shader" && i+1 < argc) {
+            std::string shader(argv[++i]);
+            if (shader != "textured" && shader != "gouraud") return unknown(arg + " " + shader);
+            opts.shader = shader == "gouraud" ? SHADER_GOURAUD : SHADER_TEXTURED;
+        } else if (arg == "--filter" && i+1 < argc) {
+            std::string filter(argv[++i]);
+            if (filter != "nearest" && filter != "bilinear" && filter != "trilinear") return unknown(arg + " " + filter);
+            opts.filter = filter == "nearest" ? FILTER_NEAREST : (filter == "bilinear" ? FILTER_BILINEAR : FILTER_TRILINEAR);
+        } else if (arg == "--mode" && i+1 < argc) {
+            std::string mode(argv[++i]);
+            if (mode != "forward" && mode != "deferred" && mode != "visibility") return unknown(arg + " " + mode);
+            opts.mode = mode == "deferred" ? RENDER_DEFERRED : (mode == "visibility" ? RENDER_VISIBILITY : RENDER_FORWARD);
+        } else if (arg == "--frames-in-flight" && i+1 < argc) {
+            std::string n(argv[++i]);
+            if (n != "1" && n != "2" && n != "3") return unknown(arg + " " + n);
+            opts.frames_in_flight = atoi(n.c_str());
+        } else if (arg == "--depth" && i+1 < argc) {
+            std::string format(argv[++i]);
+            if (format != "float" && format != "reversed" && format != "d24s8" && format != "d16") return unknown(arg + " " + format);
+            opts.depth_format = format == "reversed" ? DEPTH_REVERSED_Z : (format == "d24s8" ? DEPTH_D24S8 : (format == "d16" ? DEPTH_D16 : DEPTH_FLOAT));
+        } else if (arg == "--msaa" && i+1 < argc) {
+            std::string samples(argv[++i]);
+            if (samples != "1" && samples != "4") return unknown(arg + " " + samples);
+            opts.msaa_samples = samples == "4" ? MSAA_SAMPLES : 1;
+        } else if (arg == "--alpha" && i+1 < argc) {
+            opts.alpha = std::min(1.f, std::max(0.f, (float)atof(argv[++i])));
+        } else if (arg == "--oit" && i+1 < argc) {
+            std::string oit(argv[++i]);
+            if (oit != "abuffer" && oit != "kbuffer") return unknown(arg + " " + oit);
+            opts.oit = oit == "kbuffer" ? OIT_KBUFFER : OIT_ABUFFER;
+        } else if (arg == "--oit-budget" && i+1 < argc) {
+            char rest; // anything after the number
+            if (sscanf(argv[++i], "%d%c", &opts.oit_budget, &rest) != 1) return unknown(arg + " " + argv[i]);
+        } else if (arg == "--shadows" && i+1 < argc) {
+            opts.shadow_size = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--z-prepass") {
+            opts.z_prepass = true;
+        } else if (arg == "--occlusion-queries") {
+            opts.raster.occlusion_queries = true;
+        } else if (arg == "--lazy-clear") {
+            opts.lazy_clear = true;
+        } else if (arg == "--no-incremental") {
+            opts.incremental = false;
+        } else if (arg == "--animate") {
+            opts.animate = true;
+        } else if (arg == "--mesh-cache") {
+            opts.mesh_cache = true;
+        } else if (arg == "--simd" && i+1 < argc) {
+            std::string level(argv[++i]);
+            if (level != "scalar" && level != "sse" && level != "avx2") return unknown(arg + " " + level);
+            opts.simd = level == "scalar" ? SIMD_SCALAR : (level == "sse" ? SIMD_SSE41 : SIMD_AVX2);
+        } else if (arg.compare(0, 2, "--") != 0) {
+            opts.model_path = argv[i];
+        } else {
+            return unknown(arg);
+        }
+    }
+    return true;
+}
+
+void print_stats(const FrameStats &stats) {
+    std::cout << "last frame: " << stats.instances << " of " << scene.size() << " instances, "
+              << stats.meshlets << " meshlets (of " << model->nmeshlets() << " per instance), " << stats.primitives << " primitives after culling and clipping" << std::endl;
+    if (!oit.empty()) {
+        std::cout << "translucent: " << oit_mode_name(oit.mode()) << " of " << oit.budget() << " fragments per pixel, "
+                  << stats.oit_added << " fragments, " << stats.oit_lost << (oit.mode() == OIT_KBUFFER ? " merged" : " dropped") << std::endl;
+    }
+    if (raster_state.occlusion_queries) {
+        std::cout << "occlusion queries: " << stats.queries << ", " << stats.queries_hidden << " found hidden" << std::endl;
+    }
+}
+
+bool write_frame(const Options &opts, Image &image, int frame) {
+    char filename[32];
+    snprintf(filename, sizeof(filename), "frame_%04d.tga", frame);
+    std::string path = std::string(opts.outdir) + "/" + filename;
+    return image.write_tga_file(path.c_str());
+}
+
+// renders opts.frames frames straight into images without any window, optionally dumping them as tga files.
+// With more than one frame in flight they go through the FramePipeline, one image per slot
+int run_headless(const Options &opts, Image **images, const Texture &texture) {
+    if (opts.outdir && mkdir(opts.outdir, 0755) != 0 && errno != EEXIST) {
+        std::cerr << "can't create output directory " << opts.outdir << "\n";
+        return 1;
     }
 
-    Image image(width, height);
+    typedef std::chrono::steady_clock clock;
+    const Vec3f start_eye = eyePt;
+    double total_ms = 0, min_ms = std::numeric_limits<double>::max(), max_ms = 0;
+    int partial = 0, skipped = 0; // frames only partly redrawn, or not at all
+    FrameStats last_drawn; // of the last frame that wasn't skipped
+    Image &first = *images[0];
+    Rect screen(0, 0, first._width, first._height);
+
+    if (opts.frames_in_flight > 1) {
+        // the time between two presents, the file writes are part of the present stage
+        FramePipeline pipeline(opts.frames_in_flight);
+        clock::time_point start = clock::now(), last = start;
+        bool written = true;
+        pipeline.run([&](int frame, int slot) {
+            if (frame >= opts.frames) return false;
+            if (opts.orbit) {
+                eyePt = orbit_eye(start_eye, frame, opts.frames);
+            }
+            begin_frame(frames[slot], opts.depth_format);
+            geometry_stage(frames[slot], screen);
+            return true;
+        }, [&](int, int slot) {
+            raster_stage(frames[slot], *images[slot], texture, opts);
+        }, [&](int frame, int slot) {
+            if (opts.outdir && !write_frame(opts, *images[slot], frame)) {
+                written = false;
+                return false;
+            }
+            clock::time_point now = clock::now();
+            double ms = std::chrono::duration<double, std::milli>(now - last).count();
+            last = now;
+            min_ms = std::min(min_ms, ms);
+            max_ms = std::max(max_ms, ms);
+            return true;
+        });
+        if (!written) return 1;
+        total_ms = std::chrono::duration<double, std::milli>(last - start).count();
+        last_drawn = frames[(opts.frames - 1) % opts.frames_in_flight].stats;
+    } else {
+        for (int frame=0; frame<opts.frames; frame++) {
+            if (opts.orbit) {
+                eyePt = orbit_eye(start_eye, frame, opts.frames);
+            }
+            if (opts.animate) {
+                animate(frame);
+            }
+            begin_frame(frames[0], opts.depth_format);
+            if (!opts.incremental) {
+                dirty.invalidate();
+            }
+
+            // a skipped frame draws nothing, it's left out of the times and the stats
+            clock::time_point t0 = clock::now();
+            bool drawn = redraw(frames[0], first, texture, opts);
+            double ms = std::chrono::duration<double, std::milli>(clock::now() - t0).count();
+            if (drawn) {
+                if (!dirty.all()) partial++;
+                total_ms += ms;
+                min_ms = std::min(min_ms, ms);
+                max_ms = std::max(max_ms, ms);
+                last_drawn = frames[0].stats;
+            } else {
+                skipped++;
+            }
+
+            // writing the file is not part of the frame time
+            if (opts.outdir && !write_frame(opts, first, frame)) {
+                return 1;
+            }
+        }
+    }
+
+    std::cout << "rendered " << opts.frames << " frames (" << first._width << "x" << first._height << ", "
+              << model->nfaces() << " faces, " << pool->size() << " threads, " << simd_level_name(simd_level()) << ", "
+              << opts.frames_in_flight << " in flight, " << depth_format_name(opts.depth_format) << " depth, " << opts.msaa_samples << "x msaa) in " << total_ms << " ms" << std::endl;
+    int drawn = opts.frames - skipped;
+    std::cout << "frame time avg " << total_ms / drawn << " ms, min " << min_ms << " ms, max " << max_ms
+              << " ms, " << 1000.0 * drawn / total_ms << " fps" << (skipped ? " over the frames drawn" : "") << std::endl;
+    if (opts.frames_in_flight == 1 && opts.incremental) {
+        std::cout << "redrawn " << opts.frames - partial - skipped << " frames fully, " << partial << " partly, skipped " << skipped << std::endl;
+    }
+    print_stats(last_drawn);
+    return 0;
+}
+
+#ifndef NO_SDL
+// false once the window was closed or escape pressed
+bool poll_window() {
+    bool running = true;
+    SDL_Event event;
+    while(SDL_PollEvent(&event)) {
+        const char * key;
+        switch (event.type) {
+            case SDL_QUIT:
+                running = false;
+                break;
+            case SDL_KEYDOWN:
+                key = SDL_GetKeyName(event.key.keysym.sym);
+                if (strcmp(key, "Escape") == 0) {
+                    running = false;
+                }
+                break;
+            default:
+            break;
+        }
+    }
+    return running;
+}
 
+int run_window(const Options &opts, Image **images, const Texture &texture) {
     // Initialize SDL
     SDL_Init(SDL_INIT_VIDEO);
     SDL_SetHint(SDL_HINT_VIDEO_X11_NET_WM_BYPASS_COMPOSITOR, "0");
     SDL_Window *window = SDL_CreateWindow("Tiny Rasterizer", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, width, height, SDL_WINDOW_OPENGL);
     SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
     SDL_Texture * sdl_texture = SDL_CreateTexture(renderer,
-            SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STREAMING, image._width, image._height);
+            SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STREAMING, images[0]->_width, images[0]->_height);
     SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
 
-
-    TGAImage texture;
-    texture.read_tga_file("resources/textures/african_head_diffuse.tga");
-    texture.flip_vertically();
-
     // draw loop
-    ModelView = lookat(eyePt, lookAt, up);
-    Viewport   = viewport(width/8, height/8, width*3/4, height*3/4, depth);
-    Projection = projection(-1.0f / (eyePt - lookAt).norm());
+    setup_camera(opts.depth_format);
 
     std::cout << ModelView  << std::endl;
     std::cout << Projection << std::endl;
     std::cout << Viewport   <<std::endl;
 
-    GouraudShader shader;
-
-    bool running = true;
-    SDL_Event event;
-    while(running) {
-        // Process events
-        while(SDL_PollEvent(&event)) {
-            const char * key;
-            switch (event.type) {
-                case SDL_QUIT:
-                    running = false;
-                    break;
-                case SDL_KEYDOWN:
-                    key = SDL_GetKeyName(event.key.keysym.sym);
-                    if (strcmp(key, "Escape") == 0) {
-                        running = false;
-                    }
-                    break;
-                default:
-                break;
-            }
-        }
-
-        // Clear screen
+    auto upload = [&](Image &image) {
         SDL_UpdateTexture(sdl_texture, NULL, image.pixels,  image._width * sizeof(unsigned int));
+    };
+    // shows what was uploaded last
+    auto present = [&]() {
         SDL_RenderClear(renderer);
-
-        // rotate the camera around a circle of radius 2
-        // time_t now = time(0);
-        // eyePt[0] = cos(now);
-        // eyePt[1] = 0;
-        // eyePt[2] = sin(now);
-        
-        // draw
-        draw(texture, image, shader);
         SDL_RenderCopy(renderer, sdl_texture, NULL, NULL);
-
-        // Show what was drawn
         SDL_RenderPresent(renderer);
+    };
+
+    if (opts.frames_in_flight > 1) {
+        // the window is only touched from this thread, in the present stage
+        Rect screen(0, 0, images[0]->_width, images[0]->_height);
+        FramePipeline pipeline(opts.frames_in_flight);
+        pipeline.run([&](int, int slot) {
+            begin_frame(frames[slot], opts.depth_format);
+            geometry_stage(frames[slot], screen);
+            return true;
+        }, [&](int, int slot) {
+            raster_stage(frames[slot], *images[slot], texture, opts);
+        }, [&](int, int slot) {
+            upload(*images[slot]);
+            present();
+            return poll_window();
+        });
+    } else {
+        for (int frame = 0; poll_window(); frame++) {
+            // rotate the camera around a circle of radius 2
+            // time_t now = time(0);
+            // eyePt[0] = cos(now);
+            // eyePt[1] = 0;
+            // eyePt[2] = sin(now);
+
+            if (opts.animate) {
+                animate(frame);
+            }
+            begin_frame(frames[0], opts.depth_format);
+            if (!opts.incremental) {
+                dirty.invalidate();
+            }
+            if (redraw(frames[0], *images[0], texture, opts)) {
+                upload(*images[0]);
+            } else {
+                // nothing changed, sleep until something happens (or a while passed) and show the same frame again
+                SDL_WaitEventTimeout(NULL, 100);
+            }
+            present();
+        }
     }
 
     // Release resources
@@ -142,7 +795,106 @@ int main(int argc, char** argv) {
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
+    return 0;
+}
+#endif
 
+int main(int argc, char** argv) {
+    Options opts;
+    if (!parse_args(argc, argv, opts)) {
+        return 1;
+    }
+    raster_state = opts.raster;
+    eyePt = opts.eye;
+    model = new Model(opts.model_path, opts.mesh_cache);
+    if (opts.bake) {
+        std::string out = trmesh_path(opts.model_path);
+        bool ok = model->save(out.c_str());
+        if (ok) std::cerr << "wrote " << out << " (" << model->nmeshlets() << " meshlets)" << std::endl;
+        delete model;
+        return ok ? 0 : 1;
+    }
+
+    // the first copy sits at the origin, the others in rows behind it
+    int cols = (int)std::ceil(std::sqrt((float)opts.instances));
+    for (int i=0; i<opts.instances; i++) {
+        Vec3f offset((i % cols - (cols - 1) / 2.f) * 2.5f, 0, -(i / cols) * 2.5f);
+        scene.add(model, translation(offset));
+    }
+    animated_base = scene.instance(scene.size() - 1).transform;
+    for (int i=0; i<scene.size(); i++) depth_bounds.expand(scene.instance(i).bounds);
+    if (opts.animate) {
+        const AABB &b = scene.instance(scene.size() - 1).bounds;
+        Vec3f sway(ANIMATE_SWAY, 0, 0);
+        depth_bounds.expand(AABB(b.lo - sway, b.hi + sway));
+    }
+    if (opts.msaa_samples > 1 && opts.mode != RENDER_FORWARD) {
+        std::cerr << "--msaa only works with --mode forward\n";
+        delete model;
+        return 1;
+    }
+    if (opts.z_prepass && (opts.mode != RENDER_FORWARD || opts.msaa_samples > 1)) {
+        std::cerr << "--z-prepass only works with --mode forward and without --msaa\n";
+        delete model;
+        return 1;
+    }
+    if (opts.shadow_size > 0) {
+        if (opts.msaa_samples > 1) {
+            std::cerr << "--shadows don't work with --msaa\n";
+            delete model;
+            return 1;
+        }
+        shadow.init(opts.shadow_size, opts.depth_format);
+        for (int i=0; i<MAX_FRAMES_IN_FLIGHT; i++) shadow_frames[i].tiles = new TileGrid(opts.shadow_size, opts.shadow_size);
+    }
+    if (opts.alpha < 1.f) {
+        if (opts.mode != RENDER_FORWARD || opts.msaa_samples > 1) {
+            std::cerr << "--alpha only works with --mode forward and without --msaa\n";
+            delete model;
+            return 1;
+        }
+        for (int i = scene.size() > 1 ? 1 : 0; i<scene.size(); i+=2) scene.set_alpha(i, opts.alpha);
+        if (!oit.init(width, height, opts.oit, opts.oit_budget)) {
+            delete model;
+            return 1;
+        }
+    }
+    if (opts.mode == RENDER_VISIBILITY && !visibility.init(width, height, scene.size(), model->nfaces())) {
+        delete model;
+        return 1;
+    }
+
+    Image *images[MAX_FRAMES_IN_FLIGHT];
+    for (int i=0; i<opts.frames_in_flight; i++) {
+        images[i] = new Image(width, height, opts.depth_format, opts.msaa_samples);
+        frames[i].tiles = new TileGrid(width, height);
+    }
+    pool = new ThreadPool(opts.threads);
+    set_simd_level(opts.simd);
+    if (opts.mode == RENDER_DEFERRED) gbuffer.init(width, height);
+
+    TGAImage diffuse;
+    diffuse.read_tga_file("resources/textures/african_head_diffuse.tga");
+    diffuse.flip_vertically();
+    Texture texture(diffuse);
+    texture.set_filter(opts.filter);
+
+    int ret;
+#ifndef NO_SDL
+    if (!opts.headless) {
+        ret = run_window(opts, images, texture);
+    } else
+#endif
+    {
+        ret = run_headless(opts, images, texture);
+    }
+
+    for (int i=0; i<opts.frames_in_flight; i++) {
+        delete images[i];
+        delete frames[i].tiles;
+        delete shadow_frames[i].tiles;
+    }
+    delete pool;
     delete model;
-    return 0;
+    return ret;
 }
@@ -0,0 +1,357 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "geometry.hpp"
+#include "meshlet.hpp"
+
+// Mesh loading: a fast .obj parser and the .trmesh binary cache.
+// Both produce the layout Model keeps: welded vertices in three attribute arrays plus a flat index buffer.
+// The cache also holds the meshlets, so building them is an offline step for cached meshes.
+
+// read only view of a whole file through mmap
+class MappedFile {
+    void *_data;
+    size_t _size;
+
+public:
+    MappedFile() : _data(NULL), _size(0) {}
+    ~MappedFile() { close(); }
+
+    bool open(const char *filename) {
+        close();
+        int fd = ::open(filename, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd); // the mapping keeps the file alive
+        if (data == MAP_FAILED) return false;
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        _data = data;
+        _size = st.st_size;
+        return true;
+    }
+
+    void close() {
+        if (_data) munmap(_data, _size);
+        _data = NULL;
+        _size = 0;
+    }
+
+    const char *data() const { return (const char *)_data; }
+    size_t size() const { return _size; }
+};
+
+namespace objparse {
+
+inline bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+inline void skip_space(const char *&p, const char *end) {
+    while (p < end && is_space(*p)) p++;
+}
+
+inline void skip_line(const char *&p, const char *end) {
+    while (p < end && *p != '\n') p++;
+    if (p < end) p++;
+}
+
+// plain decimal/scientific notation, no locale, no strtod. Good to a couple of ulps which is plenty for meshes
+inline float parse_float(const char *&p, const char *end) {
+    static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                                    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18 };
+    skip_space(p, end);
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    for (; p < end && is_digit(*p); p++) {
+        if (digits < 18) { mantissa = mantissa*10 + (*p - '0'); digits += mantissa != 0; }
+        else exponent++;
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && is_digit(*p); p++) {
+            if (digits < 18) { mantissa = mantissa*10 + (*p - '0'); digits += mantissa != 0; exponent--; }
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool eneg = false;
+        if (p < end && (*p == '-' || *p == '+')) eneg = *p++ == '-';
+        int e = 0;
+        for (; p < end && is_digit(*p); p++) {
+            if (e < 10000) e = e*10 + (*p - '0');
+        }
+        exponent += eneg ? -e : e;
+    }
+
+    double value = (double)mantissa;
+    if (exponent < 0) {
+        while (exponent < -18) { value /= 1e18; exponent += 18; }
+        value /= pow10[-exponent];
+    } else {
+        while (exponent > 18) { value *= 1e18; exponent -= 18; }
+        value *= pow10[exponent];
+    }
+    return (float)(negative ? -value : value);
+}
+
+// returns false if there is no number here
+inline bool parse_int(const char *&p, const char *end, long &value) {
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+    if (p >= end || !is_digit(*p)) return false;
+    long v = 0;
+    for (; p < end && is_digit(*p); p++) v = v*10 + (*p - '0');
+    value = negative ? -v : v;
+    return true;
+}
+
+// 1-based, or negative = relative to the end of what has been read so far. -1 means missing/invalid
+inline int resolve_index(long idx, size_t count) {
+    if (idx > 0) return idx <= (long)count ? (int)(idx - 1) : -1;
+    if (idx < 0) return -idx <= (long)count ? (int)((long)count + idx) : -1;
+    return -1;
+}
+
+} // namespace objparse
+
+// Parses a Wavefront .obj straight out of an mmap'ed file. Handles v, v/t, v//n and v/t/n corners,
+// negative (relative) indices, polygons (fan triangulated) and any amount of whitespace.
+// Corners are welded on the fly: vertices sharing a position are chained together and the chain
+// is searched for the same (texcoord, normal) pair, so no hashing and no per line allocations
+bool load_obj(const char *filename, std::vector<Vec3f> &verts, std::vector<Vec3f> &normals,
+              std::vector<Vec3f> &texcoords, std::vector<uint32_t> &indices) {
+    using namespace objparse;
+    MappedFile file;
+    if (!file.open(filename)) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    const char *p = file.data(), *end = p + file.size();
+
+    std::vector<Vec3f> obj_verts, obj_normals, obj_texcoords;
+    std::vector<int> first;          // per obj position, first welded vertex using it
+    std::vector<int> next;           // per welded vertex, next one with the same position
+    std::vector<int> tex_of, norm_of; // per welded vertex, which obj texcoord/normal it uses
+    std::vector<uint32_t> polygon;
+
+    verts.clear(); normals.clear(); texcoords.clear(); indices.clear();
+
+    while (p < end) {
+        skip_space(p, end);
+        if (p >= end) break;
+        if (p + 1 < end && p[0] == 'v' && is_space(p[1])) {
+            p += 2;
+            Vec3f v;
+            v.x = parse_float(p, end);
+            v.y = parse_float(p, end);
+            v.z = parse_float(p, end);
+            obj_verts.push_back(v);
+            first.push_back(-1);
+        } else if (p + 2 < end && p[0] == 'v' && (p[1] == 'n' || p[1] == 't') && is_space(p[2])) {
+            bool normal = p[1] == 'n';
+            p += 3;
+            Vec3f v;
+            v.x = parse_float(p, end);
+            skip_space(p, end);
+            if (p < end && *p != '\n') v.y = parse_float(p, end);
+            skip_space(p, end);
+            if (p < end && *p != '\n') v.z = parse_float(p, end);
+            (normal ? obj_normals : obj_texcoords).push_back(v);
+        } else if (p + 1 < end && p[0] == 'f' && is_space(p[1])) {
+            p += 2;
+            polygon.clear();
+            for (;;) {
+                skip_space(p, end);
+                long vi = 0, ti = 0, ni = 0;
+                if (!parse_int(p, end, vi)) break;
+                if (p < end && *p == '/') {
+                    p++;
+                    parse_int(p, end, ti); // may be empty for v//n
+                    if (p < end && *p == '/') {
+                        p++;
+                        parse_int(p, end, ni);
+                    }
+                }
+                int v = resolve_index(vi, obj_verts.size());
+                if (v < 0) {
+                    std::cerr << "bad vertex index " << vi << " in " << filename << "\n";
+                    return false;
+                }
+                int t = resolve_index(ti, obj_texcoords.size());
+                int n = resolve_index(ni, obj_normals.size());
+
+                int id = first[v];
+                while (id >= 0 && (tex_of[id] != t || norm_of[id] != n)) id = next[id];
+                if (id < 0) {
+                    id = (int)verts.size();
+                    verts.push_back(obj_verts[v]);
+                    texcoords.push_back(t >= 0 ? obj_texcoords[t] : Vec3f());
+                    normals.push_back(n >= 0 ? obj_normals[n] : Vec3f());
+                    tex_of.push_back(t);
+                    norm_of.push_back(n);
+                    next.push_back(first[v]);
+                    first[v] = id;
+                }
+                polygon.push_back(id);
+            }
+            for (size_t i = 2; i < polygon.size(); i++) {
+                indices.push_back(polygon[0]);
+                indices.push_back(polygon[i-1]);
+                indices.push_back(polygon[i]);
+            }
+        }
+        skip_line(p, end);
+    }
+    std::cerr << "# v# " << obj_verts.size() << " f# " << indices.size() / 3 << " (" << verts.size() << " unique vertices)" << std::endl;
+    return true;
+}
+
+// .trmesh: a header followed by the arrays exactly as they sit in memory (little endian):
+// positions, normals, texcoords, indices, then the meshlets, their vertex lists and local triangles.
+// Version 1 files had no meshlets, they are refused and rebuilt from the .obj
+struct TrMeshHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nverts;
+    uint32_t nindices;
+    uint32_t nmeshlets;
+    uint32_t nmeshlet_vertices;
+    uint32_t reserved;
+};
+
+const char TRMESH_MAGIC[8] = { 'T', 'R', 'M', 'E', 'S', 'H', '\0', '\0' };
+const uint32_t TRMESH_VERSION = 2;
+
+bool save_trmesh(const char *filename, const std::vector<Vec3f> &verts, const std::vector<Vec3f> &normals,
+                 const std::vector<Vec3f> &texcoords, const std::vector<uint32_t> &indices, const MeshletData &meshlets) {
+    static_assert(sizeof(Vec3f) == 3 * sizeof(float), "Vec3f must be tightly packed");
+    static_assert(sizeof(Meshlet) == 15 * sizeof(uint32_t), "Meshlet must be tightly packed");
+    std::ofstream out(filename, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    TrMeshHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRMESH_MAGIC, sizeof(header.magic));
+    header.version = TRMESH_VERSION;
+    header.nverts = (uint32_t)verts.size();
+    header.nindices = (uint32_t)indices.size();
+    header.nmeshlets = (uint32_t)meshlets.meshlets.size();
+    header.nmeshlet_vertices = (uint32_t)meshlets.vertices.size();
+    out.write((const char *)&header, sizeof(header));
+    if (!verts.empty()) {
+        out.write((const char *)&verts[0], verts.size() * sizeof(Vec3f));
+        out.write((const char *)&normals[0], normals.size() * sizeof(Vec3f));
+        out.write((const char *)&texcoords[0], texcoords.size() * sizeof(Vec3f));
+    }
+    if (!indices.empty()) {
+        out.write((const char *)&indices[0], indices.size() * sizeof(uint32_t));
+    }
+    if (!meshlets.meshlets.empty()) {
+        out.write((const char *)&meshlets.meshlets[0], meshlets.meshlets.size() * sizeof(Meshlet));
+        out.write((const char *)&meshlets.vertices[0], meshlets.vertices.size() * sizeof(uint32_t));
+        out.write((const char *)&meshlets.triangles[0], meshlets.triangles.size());
+    }
+    if (!out.good()) {
+        std::cerr << "can't write the mesh cache " << filename << "\n";
+        return false;
+    }
+    return true;
+}
+
+// every index of a .trmesh points inside what it indexes: faces at vertices, meshlets at their
+// vertex lists and faces, local triangles at their meshlet's vertices. A stale or broken file
+// would otherwise have the vertex stage and primitive assembly read out of bounds
+inline bool trmesh_in_range(const TrMeshHeader &header, const uint32_t *indices, const Meshlet *meshlets,
+                            const uint32_t *mverts, const uint8_t *tris) {
+    if (header.nindices % 3) return false;
+    for (uint32_t i=0; i<header.nindices; i++) {
+        if (indices[i] >= header.nverts) return false;
+    }
+    for (uint32_t i=0; i<header.nmeshlet_vertices; i++) {
+        if (mverts[i] >= header.nverts) return false;
+    }
+    for (uint32_t i=0; i<header.nmeshlets; i++) {
+        const Meshlet &m = meshlets[i];
+        if ((uint64_t)m.vertex_offset + m.vertex_count > header.nmeshlet_vertices) return false;
+        if ((uint64_t)m.triangle_offset + m.triangle_count > header.nindices / 3) return false;
+        for (uint32_t k = m.triangle_offset * 3; k < (m.triangle_offset + m.triangle_count) * 3; k++) {
+            if (tris[k] >= m.vertex_count) return false;
+        }
+    }
+    return true;
+}
+
+// one mmap, a header check and straight copies into the arrays, no parsing at all
+bool load_trmesh(const char *filename, std::vector<Vec3f> &verts, std::vector<Vec3f> &normals,
+                 std::vector<Vec3f> &texcoords, std::vector<uint32_t> &indices, MeshletData &meshlets) {
+    MappedFile file;
+    if (!file.open(filename)) return false;
+    if (file.size() < sizeof(TrMeshHeader)) return false;
+    TrMeshHeader header;
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, TRMESH_MAGIC, sizeof(TRMESH_MAGIC)) != 0 || header.version != TRMESH_VERSION) {
+        std::cerr << filename << " is not a version " << TRMESH_VERSION << " mesh cache\n";
+        return false;
+    }
+    size_t expected = sizeof(header) + 3 * (size_t)header.nverts * sizeof(Vec3f) + (size_t)header.nindices * (sizeof(uint32_t) + 1)
+                    + (size_t)header.nmeshlets * sizeof(Meshlet) + (size_t)header.nmeshlet_vertices * sizeof(uint32_t);
+    if (file.size() != expected) {
+        std::cerr << filename << " is truncated\n";
+        return false;
+    }
+    const Vec3f *attribs = (const Vec3f *)(file.data() + sizeof(header));
+    const uint32_t *idx = (const uint32_t *)(attribs + 3 * header.nverts);
+    const Meshlet *m = (const Meshlet *)(idx + header.nindices);
+    const uint32_t *mverts = (const uint32_t *)(m + header.nmeshlets);
+    const uint8_t *tris = (const uint8_t *)(mverts + header.nmeshlet_vertices);
+    if (!trmesh_in_range(header, idx, m, mverts, tris)) {
+        std::cerr << filename << " has indices out of range\n";
+        return false;
+    }
+    verts.assign(attribs, attribs + header.nverts);
+    normals.assign(attribs + header.nverts, attribs + 2 * header.nverts);
+    texcoords.assign(attribs + 2 * header.nverts, attribs + 3 * header.nverts);
+    indices.assign(idx, idx + header.nindices);
+    meshlets.meshlets.assign(m, m + header.nmeshlets);
+    meshlets.vertices.assign(mverts, mverts + header.nmeshlet_vertices);
+    meshlets.triangles.assign(tris, tris + header.nindices);
+    std::cerr << "# " << filename << ": " << header.nindices / 3 << " faces, " << header.nverts << " vertices from cache" << std::endl;
+    return true;
+}
+
+// the cache sits next to the model: foo.obj -> foo.trmesh
+inline std::string trmesh_path(const char *filename) {
+    std::string path(filename);
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of('/');
+    if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+        path.erase(dot);
+    }
+    return path + ".trmesh";
+}
+
+// true if a exists and was modified no earlier than b
+inline bool file_is_newer(const char *a, const char *b) {
+    struct stat sa, sb;
+    if (stat(a, &sa) != 0) return false;
+    if (stat(b, &sb) != 0) return true;
+    return sa.st_mtime >= sb.st_mtime;
+}
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <vector>
+#include <cfloat>
+#include <stdint.h>
+#include <algorithm>
+#include "geometry.hpp"
+#include "tiler.hpp"
+#include "rasterizer.hpp"
+#include "meshlet.hpp"
+
+// Mesh optimization run on freshly parsed meshes (a .trmesh already holds the result):
+// vertex cache order (Tipsify), overdraw order, vertex fetch order, and the numbers to
+// see whether it helped: ACMR and overdraw.
+
+const int VERTEX_CACHE_SIZE = 16; // FIFO entries of the post-transform cache we optimize for
+
+// average cache miss ratio (transformed vertices per triangle) of a FIFO cache of cache_size.
+// 0.5 is about the best a regular grid can do, 3 means no reuse at all
+inline float analyze_acmr(const uint32_t *indices, int nindices, int nverts, int cache_size = VERTEX_CACHE_SIZE) {
+    if (nindices < 3) return 0;
+    std::vector<int> loaded(nverts, -cache_size - 1); // when each vertex last entered the cache
+    int misses = 0;
+    for (int i=0; i<nindices; i++) {
+        uint32_t v = indices[i];
+        if (misses - loaded[v] > cache_size) {
+            loaded[v] = misses++;
+        }
+    }
+    return (float)misses / (nindices / 3);
+}
+
+// Average number of times a covered pixel gets shaded when the mesh is drawn in index order
+// with backface culling and early depth test, over six axis aligned orthographic views of
+// size x size pixels. 1 means every pixel is shaded exactly once, i.e. perfect front to back
+inline float analyze_overdraw(const std::vector<Vec3f> &verts, const uint32_t *indices, int nindices, int size = 256) {
+    AABB box;
+    for (size_t i=0; i<verts.size(); i++) box.expand(verts[i]);
+    if (box.empty()) return 0;
+    Vec3f extent = box.hi - box.lo;
+    float scale = (size - 1) / std::max(extent.x, std::max(extent.y, extent.z));
+    Vec3f center = box.center();
+
+    // right, up, towards the eye: right handed so counter clockwise stays the front
+    static const float views[6][3][3] = {
+        { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } }, { { -1, 0, 0 }, { 0, 1, 0 }, { 0, 0, -1 } },
+        { { 0, 0, -1 }, { 0, 1, 0 }, { 1, 0, 0 } }, { { 0, 0, 1 }, { 0, 1, 0 }, { -1, 0, 0 } },
+        { { 1, 0, 0 }, { 0, 0, -1 }, { 0, 1, 0 } }, { { 1, 0, 0 }, { 0, 0, 1 }, { 0, -1, 0 } },
+    };
+    std::vector<float> zbuffer(size * size);
+    long shaded = 0, covered = 0;
+    Rect clip(0, 0, size, size);
+    for (int v=0; v<6; v++) {
+        Vec3f r(views[v][0][0], views[v][0][1], views[v][0][2]);
+        Vec3f u(views[v][1][0], views[v][1][1], views[v][1][2]);
+        Vec3f f(views[v][2][0], views[v][2][1], views[v][2][2]);
+        std::fill(zbuffer.begin(), zbuffer.end(), -FLT_MAX);
+        for (int i=0; i+2<nindices; i+=3) {
+            Vec3f pts[3];
+            for (int j=0; j<3; j++) {
+                Vec3f p = verts[indices[i + j]] - center;
+                pts[j] = Vec3f(p * r * scale + size / 2.f, p * u * scale + size / 2.f, p * f);
+            }
+            if ((pts[1].x - pts[0].x) * (pts[2].y - pts[0].y) - (pts[2].x - pts[0].x) * (pts[1].y - pts[0].y) <= 0) continue;
+            RasterTriangle t;
+            if (!setup_triangle(pts, clip, t)) continue;
+            rasterize(t, [&](int x, int y, Vec3f bar) {
+                float z = pts[0].z * bar[0] + pts[1].z * bar[1] + pts[2].z * bar[2];
+                float &stored = zbuffer[y * size + x];
+                if (z > stored) {
+                    covered += stored == -FLT_MAX;
+                    stored = z;
+                    shaded++;
+                }
+            });
+        }
+    }
+    return covered ? (float)shaded / covered : 0;
+}
+
+// Tipsify (Sander, Nehab, Barczak 2007): fans around a vertex, then moves on to the neighbour that
+// will still be in the cache when its remaining faces are emitted, or to the most recent vertex
+// that still has faces (dead end). Returns the new face order, corners keep their winding.
+inline void optimize_vertex_cache(uint32_t *indices, int nindices, int nverts, int cache_size = VERTEX_CACHE_SIZE) {
+    int nfaces = nindices / 3;
+    if (nfaces == 0) return;
+
+    std::vector<int> live(nverts, 0), first(nverts + 1, 0), adjacent(nindices);
+    for (int i=0; i<nindices; i++) live[indices[i]]++;
+    for (int v=0; v<nverts; v++) first[v + 1] = first[v] + live[v];
+    std::vector<int> fill(first.begin(), first.end() - 1);
+    for (int i=0; i<nindices; i++) adjacent[fill[indices[i]]++] = i / 3;
+
+    std::vector<int> stamp(nverts, 0), dead_end, candidates;
+    std::vector<unsigned char> emitted(nfaces, 0);
+    std::vector<uint32_t> sorted;
+    sorted.reserve(nindices);
+    int time = cache_size + 1, cursor = 0, fanning = 0;
+    while (fanning >= 0) {
+        candidates.clear();
+        for (int k = first[fanning]; k < first[fanning + 1]; k++) {
+            int t = adjacent[k];
+            if (emitted[t]) continue;
+            emitted[t] = 1;
+            for (int j=0; j<3; j++) {
+                uint32_t v = indices[t*3 + j];
+                sorted.push_back(v);
+                dead_end.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if (time - stamp[v] > cache_size) stamp[v] = time++;
+            }
+        }
+
+        // the candidate whose faces will all still hit the cache, the oldest one of those
+        fanning = -1;
+        int best = -1;
+        for (size_t i=0; i<candidates.size(); i++) {
+            int v = candidates[i];
+            if (live[v] <= 0) continue;
+            int priority = 0;
+            if (time - stamp[v] + 2 * live[v] <= cache_size) priority = time - stamp[v];
+            if (priority > best) {
+                best = priority;
+                fanning = v;
+            }
+        }
+        if (fanning < 0) {
+            while (!dead_end.empty() && fanning < 0) {
+                int v = dead_end.back();
+                dead_end.pop_back();
+                if (live[v] > 0) fanning = v;
+            }
+            while (fanning < 0 && cursor < nverts) {
+                if (live[cursor] > 0) fanning = cursor;
+                cursor++;
+            }
+        }
+    }
+    std::copy(sorted.begin(), sorted.end(), indices);
+}
+
+// Tipsify on the faces of one meshlet, then its vertex list in order of first use
+inline void optimize_meshlet(MeshletData &data, std::vector<uint32_t> &indices, const Meshlet &m) {
+    uint8_t *tris = &data.triangles[m.triangle_offset * 3];
+    int n = m.triangle_count * 3;
+    std::vector<uint32_t> local(tris, tris + n);
+    optimize_vertex_cache(&local[0], n, m.vertex_count);
+
+    std::vector<int> remap(m.vertex_count, -1);
+    std::vector<uint32_t> verts(m.vertex_count);
+    uint32_t *mverts = &data.vertices[m.vertex_offset];
+    int next = 0;
+    for (int i=0; i<n; i++) {
+        if (remap[local[i]] < 0) {
+            remap[local[i]] = next;
+            verts[next++] = mverts[local[i]];
+        }
+        tris[i] = (uint8_t)remap[local[i]];
+    }
+    std::copy(verts.begin(), verts.end(), mverts);
+    for (int i=0; i<n; i++) indices[m.triangle_offset * 3 + i] = mverts[tris[i]];
+}
+
+// Overdraw order, after Sander et al.: the meshlets are the clusters, sorted so that the ones
+// facing out of the mesh come first. Seen from anywhere outside, those tend to be the nearest.
+inline void optimize_overdraw(MeshletData &data, std::vector<uint32_t> &indices, const std::vector<Vec3f> &verts) {
+    Vec3f centroid;
+    for (size_t i=0; i<verts.size(); i++) centroid = centroid + verts[i];
+    if (!verts.empty()) centroid = centroid * (1.f / verts.size());
+
+    int n = (int)data.meshlets.size();
+    std::vector<float> key(n);
+    std::vector<int> order(n);
+    for (int i=0; i<n; i++) {
+        const Meshlet &m = data.meshlets[i];
+        Vec3f normal, center;
+        for (uint32_t f = m.triangle_offset; f < m.triangle_offset + m.triangle_count; f++) {
+            const Vec3f &a = verts[indices[f*3]], &b = verts[indices[f*3 + 1]], &c = verts[indices[f*3 + 2]];
+            normal = normal + cross(b - a, c - a); // area weighted
+            center = center + (a + b + c) * (1.f / 3);
+        }
+        center = center * (1.f / m.triangle_count);
+        float len = normal.norm();
+        key[i] = len > 0 ? (center - centroid) * normal / len : 0;
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return key[a] > key[b]; });
+    reorder_meshlets(data, indices, order);
+}
+
+// Renumbers the vertices in order of first use by the index buffer, so the vertex stage and the
+// face assembly walk the attribute arrays mostly forward. Unused vertices are dropped
+inline void optimize_vertex_fetch(std::vector<Vec3f> &verts, std::vector<Vec3f> &normals, std::vector<Vec3f> &texcoords,
+                                  std::vector<uint32_t> &indices, MeshletData &meshlets) {
+    std::vector<int> remap(verts.size(), -1);
+    std::vector<Vec3f> v, n, t;
+    v.reserve(verts.size()); n.reserve(verts.size()); t.reserve(verts.size());
+    for (size_t i=0; i<indices.size(); i++) {
+        uint32_t old = indices[i];
+        if (remap[old] < 0) {
+            remap[old] = (int)v.size();
+            v.push_back(verts[old]);
+            n.push_back(normals[old]);
+            t.push_back(texcoords[old]);
+        }
+        indices[i] = remap[old];
+    }
+    for (size_t i=0; i<meshlets.vertices.size(); i++) meshlets.vertices[i] = remap[meshlets.vertices[i]];
+    verts.swap(v);
+    normals.swap(n);
+    texcoords.swap(t);
+}
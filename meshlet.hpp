@@ -0,0 +1,215 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cfloat>
+#include <stdint.h>
+#include <algorithm>
+#include "geometry.hpp"
+#include "bvh.hpp"
+
+// Meshlets: a mesh cut into small pieces of at most MESHLET_MAX_VERTICES vertices and
+// MESHLET_MAX_TRIANGLES triangles, grown greedily over shared vertices so they are compact.
+// Each one keeps its own vertex list and 8 bit triangle indices into it (what a mesh shader
+// would eat), a bounding sphere and a normal cone. The cone lets a whole meshlet be dropped
+// when every one of its triangles faces away from the eye.
+const int MESHLET_MAX_VERTICES = 64;
+const int MESHLET_MAX_TRIANGLES = 124;
+
+struct Meshlet {
+    uint32_t vertex_offset, vertex_count;     // its vertices are MeshletData::vertices[vertex_offset ..]
+    uint32_t triangle_offset, triangle_count; // its faces are the model's faces [triangle_offset ..]
+    Vec3f center;                             // bounding sphere
+    float radius;
+    Vec3f cone_apex, cone_axis;               // normal cone, see meshlet_backfacing()
+    float cone_cutoff;                        // > 1 when the normals spread too much for a cone
+};
+
+// all the meshlets of a mesh. The faces of a meshlet are contiguous in the model's index
+// buffer, and triangles holds 3 local indices per face at the same position
+struct MeshletData {
+    std::vector<Meshlet> meshlets;
+    std::vector<uint32_t> vertices;
+    std::vector<uint8_t> triangles;
+};
+
+// true if every triangle of m faces away from eye (same space as the mesh), i.e. the whole
+// meshlet would be thrown away by backface culling anyway
+inline bool meshlet_backfacing(const Meshlet &m, const Vec3f &eye) {
+    if (m.cone_cutoff > 1) return false;
+    Vec3f dir = m.cone_apex - eye;
+    float len = dir.norm();
+    return len > 0 && dir * m.cone_axis >= m.cone_cutoff * len;
+}
+
+// bounding sphere and normal cone of the faces of m, the cone apex is put far enough back
+// along the axis that the test stays right for an eye anywhere, not just far away
+inline void compute_meshlet_bounds(Meshlet &m, const std::vector<Vec3f> &verts, const uint32_t *indices) {
+    AABB box;
+    for (uint32_t f = m.triangle_offset; f < m.triangle_offset + m.triangle_count; f++) {
+        for (int j=0; j<3; j++) box.expand(verts[indices[f*3 + j]]);
+    }
+    m.center = box.center();
+    m.radius = 0;
+    std::vector<Vec3f> normals;
+    Vec3f axis;
+    for (uint32_t f = m.triangle_offset; f < m.triangle_offset + m.triangle_count; f++) {
+        const Vec3f &a = verts[indices[f*3]], &b = verts[indices[f*3 + 1]], &c = verts[indices[f*3 + 2]];
+        m.radius = std::max(m.radius, std::max((a - m.center).norm(), std::max((b - m.center).norm(), (c - m.center).norm())));
+        Vec3f n = cross(b - a, c - a);
+        if (n.norm() == 0) continue; // degenerate, never drawn anyway
+        n.normalize();
+        normals.push_back(n);
+        axis = axis + n;
+    }
+
+    m.cone_apex = m.center;
+    m.cone_axis = Vec3f(0, 0, 1);
+    m.cone_cutoff = 2;
+    if (normals.empty() || axis.norm() < 1e-6f) return;
+    axis.normalize();
+    float mindp = 1;
+    for (size_t i=0; i<normals.size(); i++) mindp = std::min(mindp, normals[i] * axis);
+    if (mindp <= 0.1f) return; // more than ~84 degrees off the axis, the cone would never cull
+
+    float maxt = 0;
+    size_t k = 0;
+    for (uint32_t f = m.triangle_offset; f < m.triangle_offset + m.triangle_count; f++) {
+        const Vec3f &a = verts[indices[f*3]], &b = verts[indices[f*3 + 1]], &c = verts[indices[f*3 + 2]];
+        if (cross(b - a, c - a).norm() == 0) continue;
+        const Vec3f &n = normals[k++];
+        maxt = std::max(maxt, ((m.center - a) * n) / (axis * n));
+    }
+    m.cone_apex = m.center - axis * maxt;
+    m.cone_axis = axis;
+    m.cone_cutoff = std::sqrt(1 - mindp * mindp);
+}
+
+// Splits the faces of a mesh into meshlets and reorders indices (3 per face) so that every
+// meshlet is a contiguous run of faces. A meshlet starts from the first face not taken yet and
+// grows by the neighbouring face adding the fewest new vertices (closest to the meshlet on ties)
+// until a limit is hit or nothing touches it anymore. Faces come out in growth order, which
+// walks across the surface like a strip, and vertices in order of first use, so both the
+// post-transform cache and the 8 bit local indices see mostly recent vertices.
+inline void build_meshlets(const std::vector<Vec3f> &verts, std::vector<uint32_t> &indices, MeshletData &out) {
+    int nfaces = (int)indices.size() / 3;
+    int nverts = (int)verts.size();
+    out.meshlets.clear();
+    out.vertices.clear();
+    out.triangles.clear();
+
+    // faces around every vertex
+    std::vector<int> first(nverts + 1, 0), adjacent(indices.size());
+    for (size_t i=0; i<indices.size(); i++) first[indices[i] + 1]++;
+    for (int v=0; v<nverts; v++) first[v + 1] += first[v];
+    std::vector<int> fill(first.begin(), first.end() - 1);
+    for (size_t i=0; i<indices.size(); i++) adjacent[fill[indices[i]]++] = (int)(i / 3);
+
+    std::vector<uint32_t> sorted;
+    sorted.reserve(indices.size());
+    std::vector<unsigned char> used(nfaces, 0);
+    std::vector<int> local(nverts, -1); // vertex -> index in the current meshlet
+    std::vector<int> candidates;
+    int seed = 0;
+
+    while (true) {
+        while (seed < nfaces && used[seed]) seed++;
+        if (seed == nfaces) break;
+
+        Meshlet m;
+        m.vertex_offset = (uint32_t)out.vertices.size();
+        m.vertex_count = 0;
+        m.triangle_offset = (uint32_t)(sorted.size() / 3);
+        m.triangle_count = 0;
+        Vec3f sum; // of the meshlet's vertices, for the distance tie break
+        candidates.clear();
+        int next = seed;
+
+        while (next >= 0) {
+            used[next] = 1;
+            for (int j=0; j<3; j++) {
+                uint32_t v = indices[next*3 + j];
+                if (local[v] < 0) {
+                    local[v] = (int)m.vertex_count++;
+                    out.vertices.push_back(v);
+                    sum = sum + verts[v];
+                    for (int k = first[v]; k < first[v + 1]; k++) {
+                        if (!used[adjacent[k]]) candidates.push_back(adjacent[k]);
+                    }
+                }
+                sorted.push_back(v);
+                out.triangles.push_back((uint8_t)local[v]);
+            }
+            m.triangle_count++;
+            if ((int)m.triangle_count == MESHLET_MAX_TRIANGLES) break;
+
+            // pick the next face, dropping the candidates taken in the meantime
+            next = -1;
+            int best_new = 4;
+            float best_dist = FLT_MAX;
+            Vec3f center = sum * (1.f / m.vertex_count);
+            size_t kept = 0;
+            for (size_t i=0; i<candidates.size(); i++) {
+                int f = candidates[i];
+                if (used[f]) continue;
+                candidates[kept++] = f;
+                int fresh = (local[indices[f*3]] < 0) + (local[indices[f*3 + 1]] < 0) + (local[indices[f*3 + 2]] < 0);
+                if ((int)m.vertex_count + fresh > MESHLET_MAX_VERTICES || fresh > best_new) continue;
+                Vec3f c = (verts[indices[f*3]] + verts[indices[f*3 + 1]] + verts[indices[f*3 + 2]]) * (1.f / 3);
+                float dist = (c - center) * (c - center);
+                if (fresh < best_new || dist < best_dist) {
+                    next = f;
+                    best_new = fresh;
+                    best_dist = dist;
+                }
+            }
+            candidates.resize(kept);
+        }
+
+        for (uint32_t i = m.vertex_offset; i < m.vertex_offset + m.vertex_count; i++) local[out.vertices[i]] = -1;
+        out.meshlets.push_back(m);
+    }
+
+    indices.swap(sorted);
+    for (size_t i=0; i<out.meshlets.size(); i++) {
+        compute_meshlet_bounds(out.meshlets[i], verts, &indices[0]);
+    }
+}
+
+// box around the vertices of every meshlet
+inline void meshlet_boxes(const MeshletData &data, const std::vector<Vec3f> &verts, std::vector<AABB> &boxes) {
+    boxes.resize(data.meshlets.size());
+    for (size_t i=0; i<data.meshlets.size(); i++) {
+        const Meshlet &m = data.meshlets[i];
+        boxes[i] = AABB();
+        for (uint32_t v = m.vertex_offset; v < m.vertex_offset + m.vertex_count; v++) {
+            boxes[i].expand(verts[data.vertices[v]]);
+        }
+    }
+}
+
+// puts the meshlets (and their faces and vertex lists) in the given order
+inline void reorder_meshlets(MeshletData &data, std::vector<uint32_t> &indices, const std::vector<int> &order) {
+    MeshletData sorted;
+    std::vector<uint32_t> sorted_indices;
+    sorted.meshlets.reserve(data.meshlets.size());
+    sorted.vertices.reserve(data.vertices.size());
+    sorted.triangles.reserve(data.triangles.size());
+    sorted_indices.reserve(indices.size());
+    for (size_t i=0; i<order.size(); i++) {
+        Meshlet m = data.meshlets[order[i]];
+        sorted.vertices.insert(sorted.vertices.end(), data.vertices.begin() + m.vertex_offset,
+                               data.vertices.begin() + m.vertex_offset + m.vertex_count);
+        sorted.triangles.insert(sorted.triangles.end(), data.triangles.begin() + m.triangle_offset * 3,
+                                data.triangles.begin() + (m.triangle_offset + m.triangle_count) * 3);
+        sorted_indices.insert(sorted_indices.end(), indices.begin() + m.triangle_offset * 3,
+                              indices.begin() + (m.triangle_offset + m.triangle_count) * 3);
+        m.vertex_offset = (uint32_t)(sorted.vertices.size() - m.vertex_count);
+        m.triangle_offset = (uint32_t)(sorted_indices.size() / 3 - m.triangle_count);
+        sorted.meshlets.push_back(m);
+    }
+    std::swap(data.meshlets, sorted.meshlets);
+    std::swap(data.vertices, sorted.vertices);
+    std::swap(data.triangles, sorted.triangles);
+    indices.swap(sorted_indices);
+}
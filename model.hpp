@@ -3,119 +3,204 @@
 #include <vector>
 #include <iostream>
 #include <string>
-#include <fstream>
-#include <sstream>
-#include <vector>
+#include <algorithm>
+#include <stdint.h>
 #include "geometry.hpp"
-
-class Face {
-public:
-    std::vector<int> vertIndices;
-    std::vector<int> normIndices;
-    std::vector<int> texIndices;
-};
-
+#include "mesh_io.hpp"
+#include "bvh.hpp"
+#include "mesh_opt.hpp"
+
+// Mesh storage is structure of arrays: positions, normals and texcoords live in their own
+// contiguous arrays, one entry per unique (position, texcoord, normal) combination of the .obj file,
+// and faces are a single flat index buffer with 3 indices per triangle. Loading lives in mesh_io.hpp.
+// Every accessor hands out references or pointers into those arrays, nothing gets copied.
+// Faces are grouped into meshlets (see meshlet.hpp), each a contiguous range of the index buffer,
+// with a BVH over them (see bvh.hpp), so the renderer can cull big parts of a mesh at once.
+// Freshly parsed meshes go through mesh_opt.hpp first: faces in vertex cache and overdraw
+// order, vertices in fetch order.
 class Model {
 private:
-	std::vector<Vec3f> _verts;
+    std::vector<Vec3f> _verts;
     std::vector<Vec3f> _normals;
     std::vector<Vec3f> _texcoords;
-    std::vector<Face> _faces;
+    std::vector<uint32_t> _indices;
+    MeshletData _meshlets;
+    BVH _bvh; // over the meshlets, one per leaf
+
+    void optimize();
+    void setup_meshlets();
 
 public:
-	Model(const char *filename);
-	~Model();
-	int nverts();
-	int nfaces();
-	Vec3f vert(int i);
-    Vec3f vert(int iface, int nthvert);
-    Vec3f normal(int i);
-    Vec3f normal(int iface, int nthvert);
-    Vec3f texcoord(int i);
-    Vec3f texcoord(int iface, int nthvert);
-	Face face(int idx);
+    Model(const char *filename, bool use_cache = false);
+    ~Model();
+    int nverts() const;
+    int nfaces() const;
+    const Vec3f &vert(int i) const;
+    const Vec3f &vert(int iface, int nthvert) const;
+    const Vec3f &normal(int i) const;
+    const Vec3f &normal(int iface, int nthvert) const;
+    const Vec3f &texcoord(int i) const;
+    const Vec3f &texcoord(int iface, int nthvert) const;
+    uint32_t index(int iface, int nthvert) const;
+    const uint32_t *face(int idx) const; // the 3 vertex indices of a face
+
+    // raw arrays, nverts() entries each for the attributes and 3*nfaces() for the indices
+    const Vec3f *verts() const;
+    const Vec3f *normals() const;
+    const Vec3f *texcoords() const;
+    const uint32_t *indices() const;
+
+    int nmeshlets() const;
+    const Meshlet &meshlet(int i) const;
+    const uint32_t *meshlet_vertices() const;  // model vertex of every meshlet vertex
+    const uint8_t *meshlet_triangles() const;  // 3 per face, index into its meshlet's vertices
+
+    // bounding box of the whole mesh and the hierarchy of meshlets, in model space
+    AABB bounds() const;
+    const BVH &bvh() const;
+
+    // writes the mesh with its meshlets as a .trmesh
+    bool save(const char *filename) const;
 };
 
-Model::Model(const char *filename) : _verts(), _faces() {
-    std::ifstream in;
-    in.open (filename, std::ifstream::in);
-    if (in.fail()) return;
-    std::string line;
-    while (!in.eof()) {
-        std::getline(in, line);
-        std::istringstream iss(line.c_str());
-        char trash;
-        if (!line.compare(0, 2, "v ")) {
-            iss >> trash;
-            Vec3f v;
-            for (int i=0;i<3;i++) iss >> v[i];
-            _verts.push_back(v);
-        } else if (!line.compare(0, 2, "f ")) {
-            Face face;
-            face.vertIndices.resize(3);
-            face.normIndices.resize(3);
-            face.texIndices.resize(3);
-
-            sscanf(line.c_str(), "f %d/%d/%d %d/%d/%d %d/%d/%d", &face.vertIndices[0], &face.texIndices[0], &face.normIndices[0],
-                                                                 &face.vertIndices[1], &face.texIndices[1], &face.normIndices[1],
-                                                                 &face.vertIndices[2], &face.texIndices[2], &face.normIndices[2]);
-            for (size_t i = 0; i < 3; ++i) {
-                face.vertIndices[i]--;
-                face.texIndices[i]--;
-                face.normIndices[i]--;
-            }
-            _faces.push_back(face);
-        } else if (!line.compare(0, 4, "vn  ")) {
-            Vec3f v;
-            sscanf(line.c_str(), "vn  %f %f %f", &v[0], &v[1], &v[2]);
-            // iss >> trash;
-            // Vec3f v;
-            // for (int i=0;i<3;i++) iss >> v[i];
-            _normals.push_back(v);
-        } else if (!line.compare(0, 4, "vt  ")) {
-            Vec3f v;
-            sscanf(line.c_str(), "vt  %f %f %f", &v[0], &v[1], &v[2]);
-            _texcoords.push_back(v);
-        } 
+// filename is an .obj or a .trmesh. With use_cache an .obj is loaded from its .trmesh
+// next to it when that one is up to date, and the cache gets (re)written otherwise
+Model::Model(const char *filename, bool use_cache) : _verts(), _normals(), _texcoords(), _indices() {
+    std::string path(filename);
+    if (path.size() > 7 && path.compare(path.size() - 7, 7, ".trmesh") == 0) {
+        load_trmesh(filename, _verts, _normals, _texcoords, _indices, _meshlets);
+        setup_meshlets();
+        return;
+    }
+
+    std::string cache = trmesh_path(filename);
+    if (use_cache && file_is_newer(cache.c_str(), filename) &&
+        load_trmesh(cache.c_str(), _verts, _normals, _texcoords, _indices, _meshlets)) {
+        setup_meshlets();
+        return;
+    }
+    if (!load_obj(filename, _verts, _normals, _texcoords, _indices)) {
+        return;
+    }
+    optimize();
+    setup_meshlets();
+    if (use_cache) {
+        save(cache.c_str());
     }
-    std::cerr << "# v# " << _verts.size() << " f# "  << _faces.size() << std::endl;
 }
 
 Model::~Model() {
 }
 
-int Model::nverts() {
+// Faces get Tipsify order before they are cut into meshlets, so meshlets are seeded along the
+// cache friendly path, then every meshlet is reordered on its own (growing them shuffles faces),
+// the meshlets are sorted for overdraw and finally the vertices for fetching
+void Model::optimize() {
+    if (_indices.empty()) return;
+    int n = (int)_indices.size();
+    float acmr = analyze_acmr(&_indices[0], n, nverts());
+    float overdraw = analyze_overdraw(_verts, &_indices[0], n);
+
+    optimize_vertex_cache(&_indices[0], n, nverts());
+    build_meshlets(_verts, _indices, _meshlets);
+    for (size_t i=0; i<_meshlets.meshlets.size(); i++) optimize_meshlet(_meshlets, _indices, _meshlets.meshlets[i]);
+    optimize_overdraw(_meshlets, _indices, _verts);
+    optimize_vertex_fetch(_verts, _normals, _texcoords, _indices, _meshlets);
+
+    std::cerr << "# ACMR " << acmr << " -> " << analyze_acmr(&_indices[0], n, nverts())
+              << ", overdraw " << overdraw << " -> " << analyze_overdraw(_verts, &_indices[0], n) << std::endl;
+}
+
+// builds the meshlets unless they are there already, then the BVH over them
+void Model::setup_meshlets() {
+    if (_meshlets.meshlets.empty() && !_indices.empty()) {
+        build_meshlets(_verts, _indices, _meshlets);
+    }
+    std::vector<AABB> boxes;
+    meshlet_boxes(_meshlets, _verts, boxes);
+    _bvh.build(boxes, 1);
+}
+
+bool Model::save(const char *filename) const {
+    return save_trmesh(filename, _verts, _normals, _texcoords, _indices, _meshlets);
+}
+
+int Model::nverts() const {
     return (int)_verts.size();
 }
 
-int Model::nfaces() {
-    return (int)_faces.size();
+int Model::nfaces() const {
+    return (int)(_indices.size() / 3);
 }
 
-Face Model::face(int idx) {
-    return _faces[idx];
+const uint32_t *Model::face(int idx) const {
+    return &_indices[idx * 3];
 }
 
-Vec3f Model::vert(int i) {
+uint32_t Model::index(int iface, int nthvert) const {
+    return _indices[iface * 3 + nthvert];
+}
+
+const Vec3f &Model::vert(int i) const {
     return _verts[i];
 }
 
-Vec3f Model::vert(int iface, int nthvert) {
-    return vert(face(iface).vertIndices[nthvert]);
+const Vec3f &Model::vert(int iface, int nthvert) const {
+    return _verts[index(iface, nthvert)];
 }
 
-Vec3f Model::normal(int i) {
+const Vec3f &Model::normal(int i) const {
     return _normals[i];
 }
 
-Vec3f Model::normal(int iface, int nthvert) {
-    return normal(face(iface).normIndices[nthvert]);
+const Vec3f &Model::normal(int iface, int nthvert) const {
+    return _normals[index(iface, nthvert)];
 }
 
-Vec3f Model::texcoord(int i) {
+const Vec3f &Model::texcoord(int i) const {
     return _texcoords[i];
 }
 
-Vec3f Model::texcoord(int iface, int nthvert) {
-    return texcoord(face(iface).texIndices[nthvert]);
-}
\ No newline at end of file
+const Vec3f &Model::texcoord(int iface, int nthvert) const {
+    return _texcoords[index(iface, nthvert)];
+}
+
+const Vec3f *Model::verts() const {
+    return _verts.empty() ? NULL : &_verts[0];
+}
+
+const Vec3f *Model::normals() const {
+    return _normals.empty() ? NULL : &_normals[0];
+}
+
+const Vec3f *Model::texcoords() const {
+    return _texcoords.empty() ? NULL : &_texcoords[0];
+}
+
+const uint32_t *Model::indices() const {
+    return _indices.empty() ? NULL : &_indices[0];
+}
+
+int Model::nmeshlets() const {
+    return (int)_meshlets.meshlets.size();
+}
+
+const Meshlet &Model::meshlet(int i) const {
+    return _meshlets.meshlets[i];
+}
+
+const uint32_t *Model::meshlet_vertices() const {
+    return _meshlets.vertices.empty() ? NULL : &_meshlets.vertices[0];
+}
+
+const uint8_t *Model::meshlet_triangles() const {
+    return _meshlets.triangles.empty() ? NULL : &_meshlets.triangles[0];
+}
+
+AABB Model::bounds() const {
+    return _bvh.empty() ? AABB() : _bvh.root().box;
+}
+
+const BVH &Model::bvh() const {
+    return _bvh;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include "geometry.hpp"
+#include "image.hpp"
+#include "tiler.hpp"
+#include "thread_pool.hpp"
+#include "rasterizer.hpp"
+#include "hiz.hpp"
+#include "varyings.hpp"
+#include "pipeline.hpp"
+#include "our_gl.hpp"
+
+// 4x multisampling for the forward renderer. Coverage and depth are found at 4 points of every
+// pixel, the shader runs once per pixel and triangle, at the pixel center, and its color goes
+// to the samples that were covered and passed the depth test. Centroid sampling like on a GPU:
+// if the center itself is outside the triangle, the varyings are taken at a covered sample,
+// extrapolated ones can be way out of range on a thin sliver. The samples are tested with the
+// same integer edge functions as the centers, just moved, so the top-left rule holds for them
+// too. How colors are kept per pixel and resolved is in Image, see MsaaColor.
+
+// where the samples are, in 1/SUBPIXEL_ONE pixels from the pixel center: the rotated grid
+// most hardware uses, every sample on its own row and column
+const int MSAA_OFFSETS[MSAA_SAMPLES][2] = { { -2, -6 }, { 6, -2 }, { -6, 2 }, { 2, 6 } };
+const int MSAA_MARGIN = 6; // farthest a sample is from its center along x or y
+
+// a primitive with shader bound to its DrawItem, into the samples of the pixels inside clip.
+// Hidden triangles are dropped by the hi-z as usual. Blocks aren't: the block test is about
+// pixel centers, which can be hidden while a sample next to them isn't
+template <typename Shader> void msaa_triangle(const Primitive &prim, Shader &shader, Image &image, const Rect &clip) {
+    const int N = Shader::VARYINGS;
+    RasterTriangle t;
+    VaryingPlanes<N> planes;
+    if (!setup_primitive(prim, shader, clip, t, planes, MSAA_MARGIN)) return;
+    if (raster_state.hiz && hiz_hidden(image.hiz, t)) return;
+    float ddx[N], ddy[N];
+    planes.derivatives(ddx, ddy);
+    shader.derivatives(ddx, ddy);
+
+    // how far each sample is from the center in every edge function, and the triangle pushed out
+    // by the most any sample gets, which is what the span walk looks at
+    int64_t offset[MSAA_SAMPLES][3], slack[3];
+    RasterTriangle outer = t;
+    for (int i=0; i<3; i++) {
+        slack[i] = 0;
+        for (int s=0; s<MSAA_SAMPLES; s++) {
+            offset[s][i] = (t.A[i] * MSAA_OFFSETS[s][0] + t.B[i] * MSAA_OFFSETS[s][1]) / SUBPIXEL_ONE;
+            slack[i] = std::max(slack[i], offset[s][i]);
+        }
+        outer.C[i] += slack[i];
+    }
+
+    rasterize_spans(outer, [&](int y, int x0, int x1, const int64_t *wouter, bool) {
+        int64_t w[3] = { wouter[0] - slack[0], wouter[1] - slack[1], wouter[2] - slack[2] };
+        unsigned row = (image._height - y - 1) * image._width;
+        float start[Shader::VARYINGS + 1], pixel[Shader::VARYINGS];
+        planes.start(w, start);
+        for (int x=x0; x<x1; x++, w[0] += t.A[0], w[1] += t.A[1], w[2] += t.A[2]) {
+            unsigned mask = 0;
+            float z[MSAA_SAMPLES];
+            for (int s=0; s<MSAA_SAMPLES; s++) {
+                int64_t ws[3] = { w[0] + offset[s][0], w[1] + offset[s][1], w[2] + offset[s][2] };
+                if ((ws[0] | ws[1] | ws[2]) < 0) continue;
+                mask |= 1 << s;
+                z[s] = interpolate_depth(t, ws);
+            }
+            if (!mask) continue;
+            size_t first = (size_t)(row + x) * MSAA_SAMPLES;
+            if (raster_state.early_z) {
+                for (int s=0; s<MSAA_SAMPLES; s++) {
+                    if ((mask >> s & 1) && !image.depth.test(first + s, z[s])) mask &= ~(1u << s);
+                }
+                if (!mask) continue;
+            }
+            if ((w[0] | w[1] | w[2]) >= 0) {
+                planes.at(start, (float)(x - x0), pixel);
+            } else {
+                int s = __builtin_ctz(mask);
+                int64_t ws[3] = { w[0] + offset[s][0], w[1] + offset[s][1], w[2] + offset[s][2] };
+                float centroid[Shader::VARYINGS + 1];
+                planes.start(ws, centroid);
+                planes.at(centroid, 0.f, pixel);
+            }
+            TGAColor color;
+            if (shader.fragment(pixel, color)) continue;
+            unsigned pass = 0;
+            for (int s=0; s<MSAA_SAMPLES; s++) {
+                if ((mask >> s & 1) && image.depth.update(first + s, z[s])) pass |= 1 << s;
+            }
+            if (pass) image.set_samples(x, y, pass, color.r | color.g << 8 | color.b << 16);
+        }
+    }, HiZBlockTest(image.hiz, outer, false));
+}
+
+// every tile drawn this frame gets its split pixels resolved, in parallel
+inline void resolve_msaa(Image &image, TileGrid &tiles, ThreadPool &pool) {
+    pool.parallel_for(tiles.ntiles(), [&](int i) {
+        if (tiles.tile(i).active) image.resolve(i);
+    });
+}
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include "geometry.hpp"
+#include "image.hpp"
+#include "tiler.hpp"
+#include "thread_pool.hpp"
+#include "rasterizer.hpp"
+#include "hiz.hpp"
+#include "varyings.hpp"
+#include "pipeline.hpp"
+#include "our_gl.hpp"
+
+// Order independent transparency. Translucent triangles don't touch the image while they're
+// drawn: every fragment of theirs that's in front of the opaque depth so far is kept aside with
+// its depth and color (alpha in the top byte), and once the frame is drawn a resolve pass sorts
+// every pixel's fragments and blends them back to front over the opaque color. The resolve
+// tests them against the final depth again, so opaque and translucent triangles can come in
+// any order and nothing has to be sorted on the CPU. Two ways to keep the fragments, both
+// with a budget fixed up front, of fragments per pixel:
+//  - the A-buffer: per pixel linked lists out of one arena shared by the whole image. A pixel
+//    takes as many fragments as it gets and lists are exact, but once the arena runs out the
+//    rest of the frame's fragments are dropped.
+//  - the k-buffer: the budget is per pixel, the nearest fragments sorted in place. A pixel that
+//    gets more merges the two farthest into one, which is only right if nothing else lands
+//    between them later, but the memory is known and every fragment counts.
+enum OitMode {
+    OIT_ABUFFER,
+    OIT_KBUFFER
+};
+
+inline const char *oit_mode_name(OitMode mode) {
+    return mode == OIT_KBUFFER ? "k-buffer" : "a-buffer";
+}
+
+const int OIT_MAX_LIST = 32;   // fragments of a pixel the A-buffer resolve blends, the nearest ones
+const int OIT_MAX_K = 16;      // most the k-buffer keeps per pixel
+const uint32_t OIT_END = 0xffffffff;
+
+struct OitFragment {
+    float z;
+    uint32_t color; // r | g << 8 | b << 16 | a << 24, not premultiplied
+};
+
+// front over back as a single fragment at front's depth
+inline OitFragment oit_over(const OitFragment &front, const OitFragment &back) {
+    float fa = (front.color >> 24) / 255.f, ba = (back.color >> 24) / 255.f * (1.f - fa);
+    float a = fa + ba;
+    OitFragment out;
+    out.z = front.z;
+    out.color = (uint32_t)(a * 255.f + .5f) << 24;
+    if (a <= 0.f) return out;
+    for (int shift=0; shift<24; shift+=8) {
+        float c = ((front.color >> shift & 0xff) * fa + (back.color >> shift & 0xff) * ba) / a;
+        out.color |= std::min(255u, (uint32_t)(c + .5f)) << shift;
+    }
+    return out;
+}
+
+// f into list, nearest (largest z) first, which holds n of at most cap. When it's full the
+// farthest of them is either dropped or, with merge, blended under the one in front of it.
+// Returns the new n
+inline int oit_insert(OitFragment *list, int n, int cap, const OitFragment &f, bool merge) {
+    int i = n;
+    while (i > 0 && list[i-1].z < f.z) i--;
+    if (n < cap) {
+        for (int k=n; k>i; k--) list[k] = list[k-1];
+        list[i] = f;
+        return n + 1;
+    }
+    if (i == cap) {
+        if (merge) list[cap-1] = oit_over(list[cap-1], f);
+        return n;
+    }
+    OitFragment last = list[cap-1];
+    for (int k=cap-1; k>i; k--) list[k] = list[k-1];
+    list[i] = f;
+    if (merge) list[cap-1] = oit_over(list[cap-1], last);
+    return n;
+}
+
+// fragments a tile added this frame, and the ones dropped or merged. A cache line each, so the
+// threads drawing neighbouring tiles don't fight over one
+struct OitTileCount {
+    uint32_t added, lost;
+    char pad[56];
+    OitTileCount() : added(0), lost(0) {}
+};
+
+class OitBuffer {
+    OitMode _mode;
+    int _budget; // fragments per pixel: the A-buffer's arena is budget times the pixels, the k-buffer's k
+    std::vector<OitFragment> _fragments; // the arena, or k per pixel
+    std::vector<uint32_t> _next;         // A-buffer: the fragment after each one in its list, OIT_END at the end
+    std::unique_ptr<std::atomic<uint32_t>[]> _heads; // A-buffer: per pixel the last fragment added, OIT_END for none
+    std::vector<unsigned char> _count;   // k-buffer: fragments per pixel
+    std::atomic<uint32_t> _used;         // A-buffer: slots taken this frame, goes past the end once it's full
+    std::vector<OitTileCount> _counts;   // per tile of the image, summed up by finish()
+    uint32_t _added, _lost;              // of the last frame finish()ed
+
+public:
+    OitBuffer() : _mode(OIT_ABUFFER), _budget(0), _used(0), _added(0), _lost(0) {}
+
+    // for an image of width x height pixels, in TILE_SIZE tiles like TileGrid's
+    bool init(int width, int height, OitMode mode, int budget) {
+        size_t pixels = (size_t)width * height;
+        int tiles = ((width + TILE_SIZE - 1) / TILE_SIZE) * ((height + TILE_SIZE - 1) / TILE_SIZE);
+        if (budget < 1 || (mode == OIT_KBUFFER && budget > OIT_MAX_K)) {
+            std::cerr << "the oit budget is 1 fragment per pixel or more, " << OIT_MAX_K << " at most with the k-buffer\n";
+            return false;
+        }
+        // the A-buffer's slots have to fit below OIT_END, and either way it has to fit in memory
+        if ((size_t)budget >= OIT_END / std::max<size_t>(pixels, 1)) {
+            std::cerr << "oit budget too large for the image\n";
+            return false;
+        }
+        _mode = mode;
+        _budget = budget;
+        _fragments.assign(pixels * budget, OitFragment());
+        _counts.assign(tiles, OitTileCount());
+        if (mode == OIT_ABUFFER) {
+            _next.assign(_fragments.size(), OIT_END);
+            _heads.reset(new std::atomic<uint32_t>[pixels]);
+            for (size_t i=0; i<pixels; i++) _heads[i].store(OIT_END, std::memory_order_relaxed);
+        } else {
+            _count.assign(pixels, 0);
+        }
+        return true;
+    }
+
+    bool empty() const { return _fragments.empty(); }
+    OitMode mode() const { return _mode; }
+    int budget() const { return _budget; }
+
+    // A fragment for pixel idx, in tile. The A-buffer takes the next arena slot with an atomic
+    // add and pushes it on the pixel's list with an exchange, so it never waits. The k-buffer
+    // sorts into the pixel's own entries. Either way it's safe as long as no two threads draw
+    // the same tile, which is also what keeps the tile's counts right
+    void add(int tile, unsigned idx, float z, uint32_t color) {
+        OitTileCount &count = _counts[tile];
+        count.added++;
+        OitFragment f;
+        f.z = z;
+        f.color = color;
+        if (_mode == OIT_KBUFFER) {
+            if (_count[idx] == _budget) count.lost++;
+            _count[idx] = (unsigned char)oit_insert(&_fragments[(size_t)idx * _budget], _count[idx], _budget, f, true);
+            return;
+        }
+        uint32_t slot = _used.fetch_add(1, std::memory_order_relaxed);
+        if (slot >= _fragments.size()) {
+            count.lost++;
+            return;
+        }
+        _fragments[slot] = f;
+        _next[slot] = _heads[idx].exchange(slot, std::memory_order_relaxed);
+    }
+
+    // blends the fragments of tile r (raster coordinates, y up) over image's pixels, leaving out
+    // the ones behind its depth, and empties those pixels for the next frame. The A-buffer only
+    // blends the OIT_MAX_LIST nearest of a pixel, the rest count as lost. Thread safe per tile
+    void resolve(int tile, const Rect &r, Image &image) {
+        OitFragment list[OIT_MAX_LIST];
+        for (int y = r.y0; y < r.y1; y++) {
+            unsigned row = (image._height - y - 1) * image._width;
+            for (unsigned idx = row + r.x0; idx < row + r.x1; idx++) {
+                const OitFragment *f = list;
+                int n = 0;
+                if (_mode == OIT_KBUFFER) {
+                    f = &_fragments[(size_t)idx * _budget];
+                    n = _count[idx];
+                    _count[idx] = 0;
+                } else {
+                    uint32_t k = _heads[idx].load(std::memory_order_relaxed);
+                    if (k == OIT_END) continue;
+                    _heads[idx].store(OIT_END, std::memory_order_relaxed);
+                    int m = 0;
+                    for (; k != OIT_END; k = _next[k], m++) n = oit_insert(list, n, OIT_MAX_LIST, _fragments[k], false);
+                    _counts[tile].lost += m - n;
+                }
+                if (!n) continue;
+                uint32_t dst = image.pixels[idx];
+                for (int k=n-1; k>=0; k--) {
+                    if (!image.depth.test(idx, f[k].z)) continue; // an opaque triangle drawn after it got in front
+                    uint32_t src = f[k].color, a = src >> 24, out = 0;
+                    for (int shift=0; shift<24; shift+=8) {
+                        out |= (((src >> shift & 0xff) * a + (dst >> shift & 0xff) * (255 - a) + 127) / 255) << shift;
+                    }
+                    dst = out;
+                }
+                image.pixels[idx] = dst;
+            }
+        }
+    }
+
+    // fragments the last frame added, and how many of them the A-buffer had no room for or
+    // couldn't blend, or the k-buffer had to merge
+    uint32_t added() const { return _added; }
+    uint32_t lost() const { return _lost; }
+
+    // after every pixel that got fragments was resolved: the tiles' counts add up to the
+    // frame's, and the arena starts over
+    void finish() {
+        _added = _lost = 0;
+        for (size_t i=0; i<_counts.size(); i++) {
+            _added += _counts[i].added;
+            _lost += _counts[i].lost;
+            _counts[i] = OitTileCount();
+        }
+        _used.store(0);
+    }
+};
+
+// a primitive with shader bound to its DrawItem, as a translucent surface of opacity alpha
+// (times the shader's own): its fragments that pass the depth test go to oit, the depth and
+// the image are left alone
+template <typename Shader> void oit_triangle(const Primitive &prim, Shader &shader, float alpha, OitBuffer &oit, Image &image, const Rect &clip) {
+    const int N = Shader::VARYINGS;
+    RasterTriangle t;
+    VaryingPlanes<N> planes;
+    if (!setup_primitive(prim, shader, clip, t, planes)) return;
+    if (raster_state.hiz && hiz_hidden(image.hiz, t)) return;
+    float ddx[N], ddy[N];
+    planes.derivatives(ddx, ddy);
+    shader.derivatives(ddx, ddy);
+    int tile = (clip.y0 / TILE_SIZE) * image._tiles_x + clip.x0 / TILE_SIZE; // clip is one, laid out like TileGrid's
+    rasterize_spans(t, [&](int y, int x0, int x1, const int64_t *wstart, bool inside) {
+        int64_t w[3] = { wstart[0], wstart[1], wstart[2] };
+        unsigned row = (image._height - y - 1) * image._width;
+        float start[Shader::VARYINGS + 1], varying[Shader::VARYINGS];
+        planes.start(wstart, start);
+        for (int x=x0; x<x1; x++, w[0] += t.A[0], w[1] += t.A[1], w[2] += t.A[2]) {
+            if (!inside && (w[0] | w[1] | w[2]) < 0) continue;
+            float z = interpolate_depth(t, w);
+            if (!image.depth.test(row + x, z)) continue;
+            planes.at(start, (float)(x - x0), varying);
+            TGAColor color;
+            if (shader.fragment(varying, color)) continue;
+            uint32_t a = (uint32_t)(color.a * alpha + .5f);
+            if (a) oit.add(tile, row + x, z, color.r | color.g << 8 | color.b << 16 | a << 24);
+        }
+    }, HiZBlockTest(image.hiz, t, raster_state.hiz));
+}
+
+// every tile drawn this frame gets its translucent fragments blended in, in parallel. The
+// frame's counts are in oit.added() and oit.lost() after
+inline void resolve_oit(OitBuffer &oit, Image &image, TileGrid &tiles, ThreadPool &pool) {
+    pool.parallel_for(tiles.ntiles(), [&](int i) {
+        if (tiles.tile(i).active) oit.resolve(i, tiles.tile(i).rect, image);
+    });
+    oit.finish();
+}
@@ -3,24 +3,69 @@
 #include "geometry.hpp"
 #include <limits>
 #include "tgaimage.hpp"
+#include "texture.hpp"
 #include "image.hpp"
+#include "tiler.hpp"
+#include "rasterizer.hpp"
+#include "varyings.hpp"
+#include "raster_simd.hpp"
+#include "pipeline.hpp"
+
+// what's switched on for every triangle drawn, see RasterState
+RasterState raster_state;
+
+// Shaders are plain classes, no virtual functions. Anything with
+//     static const int VARYINGS = N;                          // floats per corner to interpolate, at least 1
+//     void bind(const DrawItem &item);                        // the model (and its transformed vertices) drawn next
+//     Vec3f vertex(int iface, int nthvert, float *varying);   // fills the corner's varyings, returns its screen position
+//     void derivatives(const float *ddx, const float *ddy);   // change of the varyings per pixel along x and y, once per triangle
+//     bool fragment(const float *varying, TGAColor &color);   // true means discard the pixel
+// can be handed to triangle(), which is a template on the shader type, so the calls get inlined
+// into the pixel loop. fragment() gets the varyings perspective correct, see varyings.hpp.
+// Shaders keep per triangle state at most, so every thread shades with its own copy.
+
+// the renderer's default look: texture times diffuse light, straight out of the model's arrays.
+// It has its own triangle() overload below that runs the SIMD kernels of raster_simd.hpp
+struct TexturedShader {
+    static const int VARYINGS = TEXTURED_VARYINGS; // u, v, normal
+    const Vec3f *screen, *uv, *normals; // per vertex: post-transform positions and the model's attributes
+    const uint32_t *indices;           // 3 per face
+    const Texture *texture;
+    TextureSampler sampler;            // with the mip level(s) of the current triangle
+    Vec3f light_dir;
+
+    TexturedShader(const Texture &tex, Vec3f light)
+        : screen(NULL), uv(NULL), normals(NULL), indices(NULL), texture(&tex), light_dir(light) {}
+
+    void bind(const DrawItem &item) {
+        screen = item.screen;
+        uv = item.model->texcoords();
+        normals = item.model->normals();
+        indices = item.model->indices();
+    }
 
-struct IShader {
-    virtual Vec4f vertex(int iface, int nthvert) = 0;
-    virtual bool fragment(Vec3f bar, TGAColor &color) = 0;
-};
-
-static void clamp(float &input, const float min, const float max) {
-    if (min > max) {
-        return;
+    Vec3f vertex(int iface, int nthvert, float *varying) {
+        uint32_t i = indices[iface*3 + nthvert];
+        varying[0] = uv[i].x;
+        varying[1] = uv[i].y;
+        varying[2] = normals[i].x;
+        varying[3] = normals[i].y;
+        varying[4] = normals[i].z;
+        return screen[i];
     }
-    if (input < min) {
-        input = min;
+
+    // the mip level comes from how fast uv moves across the screen
+    void derivatives(const float *ddx, const float *ddy) {
+        sampler = TextureSampler(*texture, texture->filter(), texture->lod(ddx[0], ddx[1], ddy[0], ddy[1]));
     }
-    else if (input > max) {
-        input = max;
+
+    bool fragment(const float *varying, TGAColor &color) {
+        TGAColor sample_color(sampler(varying[0], varying[1]), 4);
+        float intensity = std::min(1.0f, std::max(0.0f, Vec3f(varying[2], varying[3], varying[4]) * light_dir));
+        color = TGAColor(sample_color.r * intensity, sample_color.g * intensity, sample_color.b * intensity, 255);
+        return false;
     }
-}
+};
 
 void line(Vec2i p0, Vec2i p1, TGAImage &image, TGAColor color) {
     bool steep = false;
@@ -58,134 +103,129 @@ Vec3f barycentric(Vec3f A, Vec3f B, Vec3f C, Vec3f P) {
 }
 
 void triangle(Vec3f *pts, Vec3f* tcs, Image &image, TGAImage &texture) {
-    Vec2f bboxmin( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max());
-    Vec2f bboxmax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
-    Vec2f clamp(image._width - 1, image._height - 1);
-    for (int i=0; i<3; i++) {
-        for (int j=0; j<2; j++) {
-            bboxmin[j] = std::max(0.f,      std::min(bboxmin[j], pts[i][j]));
-            bboxmax[j] = std::min(clamp[j], std::max(bboxmax[j], pts[i][j]));
-        }
-    }
+    RasterTriangle t;
+    if (!setup_triangle(pts, Rect(0, 0, image._width, image._height), t)) return;
 
-    Vec3f P;
     int texheight = texture.get_height();
     int texwidth = texture.get_width();
-    for (P.x=bboxmin.x; P.x<=bboxmax.x; P.x++) {
-        for (P.y=bboxmin.y; P.y<=bboxmax.y; P.y++) {
-            Vec3f bc_screen  = barycentric(pts[0], pts[1], pts[2], P);
-            if (bc_screen.x<0 || bc_screen.y<0 || bc_screen.z<0) continue;
-
-            Vec3f one = tcs[0] * bc_screen[0];
-            Vec3f two = tcs[1] * bc_screen[1];
-            Vec3f three = tcs[2] * bc_screen[2];
-            Vec3f total = one + two + three;
-            int tex_x = (int) (texwidth * total[0]);
-            int tex_y = (int) (texheight * total[1]);
-            TGAColor sample_color = texture.get(tex_x, tex_y);
-
-            P.z = 0;
-            for (int i=0; i<3; i++) 
-                P.z += pts[i][2]*bc_screen[i];
-
-            Vec3i fill_color(sample_color.r, sample_color.g, sample_color.b);
-
-            image.setPixel(P.x, image._height - P.y - 1, fill_color, P.z);
-        }
-    }
+    rasterize(t, [&](int x, int y, Vec3f bc_screen) {
+        Vec3f total = tcs[0] * bc_screen[0] + tcs[1] * bc_screen[1] + tcs[2] * bc_screen[2];
+        int tex_x = (int) (texwidth * total[0]);
+        int tex_y = (int) (texheight * total[1]);
+        TGAColor sample_color = texture.get(tex_x, tex_y);
+
+        float z = pts[0][2]*bc_screen[0] + pts[1][2]*bc_screen[1] + pts[2][2]*bc_screen[2];
+
+        Vec3i fill_color(sample_color.r, sample_color.g, sample_color.b);
+
+        image.setPixel(x, image._height - y - 1, fill_color, z);
+    });
 }
 
-void triangle(Vec3f *screen_coords, Vec3f* tcs, Vec3f* face_norms, Vec3f light_dir, Image &image, TGAImage &texture, IShader& shader) {
-    Vec2f bboxmin( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max());
-    Vec2f bboxmax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
-    Vec2f clampVec(image._width - 1, image._height - 1);
-    for (int i=0; i<3; i++) {
-        for (int j=0; j<2; j++) {
-            bboxmin[j] = std::max(0.f,      std::min(bboxmin[j], screen_coords[i][j]));
-            bboxmax[j] = std::min(clampVec[j], std::max(bboxmax[j], screen_coords[i][j]));
-        }
+// shades every covered pixel of t with shader.fragment(), depth tested against image
+template <typename Shader> void rasterize_shader(const RasterTriangle &t, const Vec3f *pts, const VaryingPlanes<Shader::VARYINGS> &planes,
+                                                 Shader &shader, Image &image, const RasterState &state) {
+    const int N = Shader::VARYINGS;
+    if (state.hiz && hiz_hidden(image.hiz, t)) {
+        return;
     }
-
-    Vec3f P;
-    int texheight = texture.get_height();
-    int texwidth = texture.get_width();
-    for (P.x=bboxmin.x; P.x<=bboxmax.x; P.x++) {
-        for (P.y=bboxmin.y; P.y<=bboxmax.y; P.y++) {
-            Vec3f bc_screen  = barycentric(screen_coords[0], screen_coords[1], screen_coords[2], P);
-            if (bc_screen.x<0 || bc_screen.y<0 || bc_screen.z<0) continue;
-
-            Vec3f one = tcs[0] * bc_screen[0];
-            Vec3f two = tcs[1] * bc_screen[1];
-            Vec3f three = tcs[2] * bc_screen[2];
-            Vec3f total = one + two + three;
-            int tex_x = (int) (texwidth * total[0]);
-            int tex_y = (int) (texheight * total[1]);
-            TGAColor sample_color = texture.get(tex_x, tex_y);
-
-            total = face_norms[0] * bc_screen[0] + face_norms[1] * bc_screen[1] + face_norms[2] * bc_screen[2];
-            float intensity = total * light_dir;
-            clamp(intensity, 0.0f, 1.0f);
-
-            P.z = 0;
-            for (int i=0; i<3; i++) 
-                P.z += screen_coords[i][2]*bc_screen[i];
-
-            Vec3i fill_color(sample_color.r, sample_color.g, sample_color.b);
-
-            image.setPixel(P.x, image._height - P.y - 1, fill_color * intensity, P.z);
+    float ddx[N], ddy[N];
+    planes.derivatives(ddx, ddy);
+    shader.derivatives(ddx, ddy);
+    rasterize_spans(t, [&](int y, int x0, int x1, const int64_t *wstart, bool inside) {
+        int64_t w[3] = { wstart[0], wstart[1], wstart[2] };
+        unsigned row = (image._height - y - 1) * image._width;
+        float start[Shader::VARYINGS + 1], varying[Shader::VARYINGS];
+        planes.start(wstart, start);
+        for (int x=x0; x<x1; x++, w[0] += t.A[0], w[1] += t.A[1], w[2] += t.A[2]) {
+            if (!inside && (w[0] | w[1] | w[2]) < 0) continue;
+            Vec3f bar(w[0] * t.inv_area, w[1] * t.inv_area, w[2] * t.inv_area);
+            float z = pts[0][2]*bar[0] + pts[1][2]*bar[1] + pts[2][2]*bar[2];
+            if (state.early_z && !image.depth.test(row + x, z)) continue;
+            planes.at(start, (float)(x - x0), varying);
+            TGAColor color;
+            if (!shader.fragment(varying, color)) {
+                image.setPixel(x, image._height - y - 1, Vec3i(color.r, color.g, color.b), z);
+            }
         }
-    }
+    }, HiZBlockTest(image.hiz, t, state.hiz));
 }
 
-void triangle(Vec3f *pts, Vec3f* tcs, IShader &shader, Image &image, TGAImage &texture) {
-    // compute bounding box of triangle
-    Vec2f bboxmin( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max());
-    Vec2f bboxmax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
-    Vec2f clamp(image._width - 1, image._height - 1);
-    for (int i=0; i<3; i++) {
-        for (int j=0; j<2; j++) {
-            bboxmin[j] = std::max(0.f,      std::min(bboxmin[j], pts[i][j]));
-            bboxmax[j] = std::min(clamp[j], std::max(bboxmax[j], pts[i][j]));
-        }
+// same result as the generic version with TexturedShader::fragment(), but 4 or 8 pixels at a time
+inline void rasterize_shader(const RasterTriangle &t, const Vec3f *pts, const VaryingPlanes<TEXTURED_VARYINGS> &planes,
+                             TexturedShader &shader, Image &image, const RasterState &state) {
+    float ddx[TEXTURED_VARYINGS], ddy[TEXTURED_VARYINGS];
+    planes.derivatives(ddx, ddy);
+    shader.derivatives(ddx, ddy);
+    TexturedSetup setup(t, pts, planes, shader.light_dir, shader.sampler);
+    setup.early_z = state.early_z;
+    rasterize_textured(setup, image, state);
+}
+
+// face iface through shader: vertex() for the three corners, then fragment() for every pixel.
+// Only pixels inside clip are touched, which lets the tiled renderer hand every tile to a different thread.
+// Hidden triangles and blocks are dropped by the hierarchical z before any fragment work.
+// Without the corners' w the varyings are interpolated in screen space
+template <typename Shader> void triangle(int iface, Shader &shader, Image &image, const Rect &clip) {
+    const int N = Shader::VARYINGS;
+    Vec3f pts[3];
+    float varying[3][N];
+    for (int j=0; j<3; j++) {
+        pts[j] = shader.vertex(iface, j, varying[j]);
     }
+    RasterTriangle t;
+    if (!setup_triangle(pts, clip, t)) return;
+    const float rhw[3] = { 1, 1, 1 };
+    VaryingPlanes<N> planes;
+    planes.setup(t, varying, rhw);
+    rasterize_shader(t, pts, planes, shader, image, raster_state);
+}
 
-    Vec3f P;
-    int texheight = texture.get_height();
-    int texwidth = texture.get_width();
-    for (P.x=bboxmin.x; P.x<=bboxmax.x; P.x++) {
-        for (P.y=bboxmin.y; P.y<=bboxmax.y; P.y++) {
-            Vec3f bc_screen  = barycentric(pts[0], pts[1], pts[2], P);
-            if (bc_screen.x<0 || bc_screen.y<0 || bc_screen.z<0) continue;
-
-            Vec3f one = tcs[0] * bc_screen[0];
-            Vec3f two = tcs[1] * bc_screen[1];
-            Vec3f three = tcs[2] * bc_screen[2];
-            Vec3f total = one + two + three;
-            int tex_x = (int) (texwidth * total[0]);
-            int tex_y = (int) (texheight * total[1]);
-            TGAColor sample_color = texture.get(tex_x, tex_y);
-
-            P.z = 0;
-            for (int i=0; i<3; i++) 
-                P.z += pts[i][2]*bc_screen[i];
-
-            Vec3i fill_color(sample_color.r, sample_color.g, sample_color.b);
-
-            image.setPixel(P.x, image._height - P.y - 1, fill_color, P.z);
+template <typename Shader> void triangle(int iface, Shader &shader, Image &image) {
+    triangle(iface, shader, image, Rect(0, 0, image._width, image._height));
+}
+
+// a primitive from PrimitiveAssembly, with shader bound to its DrawItem: the shader sets up the
+// varyings of the face corners, the positions and 1/w come from the primitive. The corners of a
+// piece of a clipped face get the face's varyings blended with their barycentric coordinates,
+// which is right since those were found in homogeneous space, before the divide.
+// Returns false if nothing of it is inside clip. margin goes to setup_triangle()
+template <typename Shader> bool setup_primitive(const Primitive &prim, Shader &shader, const Rect &clip,
+                                                RasterTriangle &t, VaryingPlanes<Shader::VARYINGS> &planes, int margin = 0) {
+    const int N = Shader::VARYINGS;
+    float varying[3][N], piece[3][N];
+    for (int j=0; j<3; j++) {
+        shader.vertex(prim.face, j, varying[j]);
+    }
+    if (!setup_triangle(prim.pts, clip, t, margin)) return false;
+    if (prim.clipped) {
+        for (int j=0; j<3; j++) {
+            for (int k=0; k<N; k++) {
+                piece[j][k] = varying[0][k] * prim.bar[j][0] + varying[1][k] * prim.bar[j][1] + varying[2][k] * prim.bar[j][2];
+            }
         }
     }
+    planes.setup(t, prim.clipped ? piece : varying, prim.rhw);
+    return true;
+}
+
+template <typename Shader> void triangle(const Primitive &prim, Shader &shader, Image &image, const Rect &clip) {
+    RasterTriangle t;
+    VaryingPlanes<Shader::VARYINGS> planes;
+    if (!setup_primitive(prim, shader, clip, t, planes)) return;
+    rasterize_shader(t, prim.pts, planes, shader, image, raster_state);
 }
 
 Vec3f world2screen(Vec3f v, const int width, const int height) {
     return Vec3f(int((v.x+1.)*width/2.+.5), int((v.y+1.)*height/2.+.5), v.z);
 }
 
-Vec3f m2v(Matrix m) {
+Vec3f m2v(const mat<4,1,float> &m) {
     return Vec3f(m[0][0]/m[3][0], m[1][0]/m[3][0], m[2][0]/m[3][0]);
 }
 
-Matrix v2m(Vec3f v) {
-    Matrix m(4, 1);
+mat<4,1,float> v2m(Vec3f v) {
+    mat<4,1,float> m;
     m[0][0] = v.x;
     m[1][0] = v.y;
     m[2][0] = v.z;
@@ -193,8 +233,8 @@ Matrix v2m(Vec3f v) {
     return m;
 }
 
-Matrix viewport(int x, int y, int w, int h, const int depth) {
-    Matrix m = Matrix::identity(4);
+Mat4f viewport(int x, int y, int w, int h, const int depth) {
+    Mat4f m = Mat4f::identity();
     m[0][3] = x+w/2.f;
     m[1][3] = y+h/2.f;
     m[2][3] = depth/2.f;
@@ -205,12 +245,32 @@ Matrix viewport(int x, int y, int w, int h, const int depth) {
     return m;
 }
 
-Matrix lookat(Vec3f eye, Vec3f center, Vec3f up) {
+// viewport for the depth formats that store reversed depth (see depth.hpp): the same x and y,
+// with z/w going linearly in 1/w from the format's largest value at w = near_w down to just
+// over the clear value at w = far_w. Both are the projection's w, whatever's in between
+// gets the format's whole range: closer than near_w clamps to it and farther than far_w is
+// hidden. Takes the coeff given to projection(), whose w is 1 + coeff * z of a point with w = 1
+Mat4f depth_viewport(const Mat4f &viewport, float coeff, DepthFormat format, float near_w, float far_w) {
+    Mat4f m = viewport;
+    if (format == DEPTH_FLOAT) return m;
+    // the far end lands a little over 0 so it still passes against the clear value: half way
+    // into the first step for the unorms, which round down
+    float lo = format == DEPTH_REVERSED_Z ? 1e-5f : 1.5f;
+    float a = (depth_scale(format) - lo) * near_w * far_w / (far_w - near_w); // z/w = a / w + b
+    float b = lo - a / far_w;
+    m[2][0] = 0;
+    m[2][1] = 0;
+    m[2][2] = -a * coeff;
+    m[2][3] = a + b; // times the incoming w, 1 + coeff * z
+    return m;
+}
+
+Mat4f lookat(Vec3f eye, Vec3f center, Vec3f up) {
     Vec3f z = (eye-center).normalize();
     Vec3f x = cross(up,z).normalize();
     Vec3f y = cross(z,x).normalize();
-    Matrix Minv = Matrix::identity(4);
-    Matrix Tr   = Matrix::identity(4);
+    Mat4f Minv = Mat4f::identity();
+    Mat4f Tr   = Mat4f::identity();
     for (int i=0; i<3; i++) {
         Minv[0][i] = x[i];
         Minv[1][i] = y[i];
@@ -220,8 +280,14 @@ Matrix lookat(Vec3f eye, Vec3f center, Vec3f up) {
     return Minv*Tr;
 }
 
-Matrix projection(float coeff) {
-    Matrix m = Matrix::identity(4);
+Mat4f translation(Vec3f v) {
+    Mat4f m = Mat4f::identity();
+    for (int i=0; i<3; i++) m[i][3] = v[i];
+    return m;
+}
+
+Mat4f projection(float coeff) {
+    Mat4f m = Mat4f::identity();
     m[3][2] = coeff;
     return m;
 }
\ No newline at end of file
@@ -0,0 +1,356 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+#include <stdint.h>
+#include "geometry.hpp"
+#include "model.hpp"
+#include "tiler.hpp"
+#include "rasterizer.hpp"
+#include "hiz.hpp"
+#include "bvh.hpp"
+#include "thread_pool.hpp"
+
+// Geometry front end of the renderer: vertex processing and primitive assembly.
+// Everything here works on homogeneous screen coordinates, i.e. Viewport*Projection*ModelView*v
+// before the divide by w. The viewport is affine, so the clip planes are still planes there and
+// the image itself is simply 0 <= x/w < width, 0 <= y/w < height.
+
+// outcode bits, one per plane a vertex is on the wrong side of
+enum ClipPlane {
+    CLIP_LEFT         = 1 << 0, // the image, used for culling only: the rasterizer clips to it for free
+    CLIP_RIGHT        = 1 << 1,
+    CLIP_BOTTOM       = 1 << 2,
+    CLIP_TOP          = 1 << 3,
+    CLIP_NEAR         = 1 << 4, // w too small: at, behind or right in front of the eye
+    CLIP_GUARD_LEFT   = 1 << 5, // the guard band, past it coordinates get too big for the rasterizer
+    CLIP_GUARD_RIGHT  = 1 << 6,
+    CLIP_GUARD_BOTTOM = 1 << 7,
+    CLIP_GUARD_TOP    = 1 << 8
+};
+
+// the planes triangles really get cut along, everything else is left to the rasterizer
+const int CLIP_MASK = CLIP_NEAR | CLIP_GUARD_LEFT | CLIP_GUARD_RIGHT | CLIP_GUARD_BOTTOM | CLIP_GUARD_TOP;
+const float CLIP_NEAR_W = 1e-2f;      // the projection has w = 1 at the focus and 0 at the eye
+const float CLIP_GUARD_BAND = 8192.f; // pixels past the image edges, well inside RASTER_MAX_COORD
+
+// signed distance of v to plane (one ClipPlane bit), >= 0 is inside
+inline float clip_distance(const Vec4f &v, int plane, const Rect &r) {
+    switch (plane) {
+        case CLIP_LEFT:         return v.x - r.x0 * v.w;
+        case CLIP_RIGHT:        return r.x1 * v.w - v.x;
+        case CLIP_BOTTOM:       return v.y - r.y0 * v.w;
+        case CLIP_TOP:          return r.y1 * v.w - v.y;
+        case CLIP_NEAR:         return v.w - CLIP_NEAR_W;
+        case CLIP_GUARD_LEFT:   return v.x - (r.x0 - CLIP_GUARD_BAND) * v.w;
+        case CLIP_GUARD_RIGHT:  return (r.x1 + CLIP_GUARD_BAND) * v.w - v.x;
+        case CLIP_GUARD_BOTTOM: return v.y - (r.y0 - CLIP_GUARD_BAND) * v.w;
+        case CLIP_GUARD_TOP:    return (r.y1 + CLIP_GUARD_BAND) * v.w - v.y;
+    }
+    return 0;
+}
+
+inline int outcode(const Vec4f &v, const Rect &r) {
+    int code = 0;
+    for (int plane = 1; plane <= CLIP_GUARD_TOP; plane <<= 1) {
+        if (clip_distance(v, plane, r) < 0) code |= plane;
+    }
+    return code;
+}
+
+// Culling test for a box (bounds of an object, cluster or BVH node) under transform: outside if
+// all corners are beyond one plane of the image, or, with a hi-z, if even the box's nearest
+// corner is behind everything already drawn under its screen rectangle. Boxes reaching behind
+// the near plane can't be projected and are never considered occluded.
+// inside says the parent box was already entirely inside the image
+inline Visibility cull_box(const AABB &box, const Mat4f &transform, const Rect &screen, bool inside, const HiZ *hiz) {
+    if (inside && !hiz) return VIS_INSIDE;
+    int all = ~0, any = 0;
+    float xmin = FLT_MAX, ymin = FLT_MAX, xmax = -FLT_MAX, ymax = -FLT_MAX, nearest = -FLT_MAX;
+    for (int i=0; i<8; i++) {
+        Vec4f p = transform * Vec4f(box.corner(i));
+        int code = outcode(p, screen);
+        all &= code;
+        any |= code;
+        if (code & CLIP_NEAR) continue;
+        float x = p.x / p.w, y = p.y / p.w;
+        xmin = std::min(xmin, x); xmax = std::max(xmax, x);
+        ymin = std::min(ymin, y); ymax = std::max(ymax, y);
+        nearest = std::max(nearest, p.z / p.w);
+    }
+    if (all) return VIS_OUTSIDE;
+    if (hiz && !(any & CLIP_NEAR)) {
+        Rect r(std::max<float>(screen.x0, std::floor(xmin)), std::max<float>(screen.y0, std::floor(ymin)),
+               std::min<float>(screen.x1, std::ceil(xmax) + 1), std::min<float>(screen.y1, std::ceil(ymax) + 1));
+        if (!r.empty() && nearest < hiz->farthest(r)) return VIS_OUTSIDE;
+    }
+    return any ? VIS_PARTIAL : VIS_INSIDE;
+}
+
+// the pixels a box (under transform) can cover, with a pixel of margin like cull_box(). All of
+// screen if the box reaches behind the near plane, false if it's entirely outside
+inline bool box_rect(const AABB &box, const Mat4f &transform, const Rect &screen, Rect &out) {
+    int all = ~0;
+    bool behind = false;
+    float xmin = FLT_MAX, ymin = FLT_MAX, xmax = -FLT_MAX, ymax = -FLT_MAX;
+    for (int i=0; i<8; i++) {
+        Vec4f p = transform * Vec4f(box.corner(i));
+        int code = outcode(p, screen);
+        all &= code;
+        if (code & CLIP_NEAR) {
+            behind = true;
+            continue;
+        }
+        float x = p.x / p.w, y = p.y / p.w;
+        xmin = std::min(xmin, x); xmax = std::max(xmax, x);
+        ymin = std::min(ymin, y); ymax = std::max(ymax, y);
+    }
+    if (all) return false;
+    if (behind) {
+        out = screen;
+        return true;
+    }
+    out = Rect(std::max<float>(screen.x0, std::floor(xmin)), std::max<float>(screen.y0, std::floor(ymin)),
+               std::min<float>(screen.x1, std::ceil(xmax) + 1), std::min<float>(screen.y1, std::ceil(ymax) + 1));
+    return !out.empty();
+}
+
+// one model drawn with one transform, what a draw call is in GL
+struct DrawItem {
+    const Model *model;
+    int instance;        // in the scene it was made from, for the visibility buffer's ids
+    Mat4f transform;     // model to homogeneous screen
+    int first_vertex;    // where its vertices start in the VertexStage buffers, set by VertexStage::run
+    const Vec3f *screen; // its post-transform positions, set by VertexStage::run
+    Vec3f eye;           // the eye in model space, for the meshlets' normal cones
+    float alpha;         // of the instance, below 1 its fragments go to the OIT buffer
+};
+
+// Transforms every vertex of a model exactly once per frame into a post-transform buffer,
+// spread over the thread pool. Faces then pick their corners out of it by index, so a vertex
+// shared by six faces costs one transform instead of six. The buffer is reused across frames.
+class VertexStage {
+    static const int CHUNK = 1024;
+    std::vector<Vec4f> _clip;     // before the divide
+    std::vector<Vec3f> _screen;   // after it, meaningless for vertices with CLIP_NEAR set
+    std::vector<uint16_t> _outcode;
+    std::vector<std::pair<int, int> > _work; // (item, first vertex of the chunk)
+
+public:
+    // the vertices of all the items go one after the other into the same buffers
+    void run(std::vector<DrawItem> &items, const Rect &screen, ThreadPool &pool) {
+        int total = 0;
+        _work.clear();
+        for (size_t k=0; k<items.size(); k++) {
+            items[k].first_vertex = total;
+            for (int v = 0; v < items[k].model->nverts(); v += CHUNK) {
+                _work.push_back(std::make_pair((int)k, v));
+            }
+            total += items[k].model->nverts();
+        }
+        _clip.resize(total);
+        _screen.resize(total);
+        _outcode.resize(total);
+        for (size_t k=0; k<items.size(); k++) {
+            items[k].screen = total ? &_screen[items[k].first_vertex] : NULL;
+        }
+
+        pool.parallel_for((int)_work.size(), [&](int c) {
+            const DrawItem &item = items[_work[c].first];
+            const Vec3f *in = item.model->verts();
+            int end = std::min(item.model->nverts(), _work[c].second + CHUNK);
+            for (int v = _work[c].second; v < end; v++) {
+                int i = item.first_vertex + v;
+                Vec4f r = item.transform * Vec4f(in[v]);
+                _clip[i] = r;
+                _outcode[i] = (uint16_t)::outcode(r, screen);
+                _screen[i] = r.w != 0 ? Vec3f(r.x / r.w, r.y / r.w, r.z / r.w) : Vec3f();
+            }
+        });
+    }
+
+    const Vec4f &clip(int i) const { return _clip[i]; }
+    const Vec3f &screen(int i) const { return _screen[i]; }
+    int outcode(int i) const { return _outcode[i]; }
+};
+
+// what the rasterizer gets: a face, or a piece of one left over by clipping
+struct Primitive {
+    int item; // the DrawItem it belongs to
+    int face; // in that item's model
+    bool clipped;
+    Vec3f pts[3]; // screen coordinates
+    float rhw[3]; // 1/w of the corners, for perspective correct varyings
+    Vec3f bar[3]; // for clipped pieces, where each corner sits on the face in barycentric coordinates
+};
+
+// twice the signed area on screen, > 0 for counter clockwise
+inline float signed_area(const Vec3f &a, const Vec3f &b, const Vec3f &c) {
+    return (b.x - a.x) * (c.y - a.y) - (c.x - a.x) * (b.y - a.y);
+}
+
+inline bool culled_face(float area, CullFace cull) {
+    return (cull == CULL_BACK && area < 0) || (cull == CULL_FRONT && area > 0);
+}
+
+// Sutherland-Hodgman in homogeneous coordinates against the planes in mask, then a fan
+// of the polygon that's left. A triangle cut by one plane gives at most two pieces
+inline void clip_face(int item, int face, const Vec4f *clip, int mask, const Rect &screen, CullFace cull, std::vector<Primitive> &out) {
+    const int MAX_VERTS = 3 + 5; // every plane adds at most one vertex
+    Vec4f pos[2][MAX_VERTS];
+    Vec3f bar[2][MAX_VERTS];
+    int n = 3, cur = 0;
+    for (int i=0; i<3; i++) {
+        pos[0][i] = clip[i];
+        bar[0][i] = Vec3f(i == 0, i == 1, i == 2);
+    }
+    for (int plane = CLIP_NEAR; plane <= CLIP_GUARD_TOP && n >= 3; plane <<= 1) {
+        if (!(mask & plane)) continue;
+        int m = 0;
+        for (int i=0; i<n; i++) {
+            int j = (i + 1) % n;
+            float di = clip_distance(pos[cur][i], plane, screen), dj = clip_distance(pos[cur][j], plane, screen);
+            if (di >= 0) {
+                pos[!cur][m] = pos[cur][i];
+                bar[!cur][m++] = bar[cur][i];
+            }
+            if ((di >= 0) != (dj >= 0)) {
+                float t = di / (di - dj);
+                pos[!cur][m] = pos[cur][i] + (pos[cur][j] - pos[cur][i]) * t;
+                bar[!cur][m++] = bar[cur][i] + (bar[cur][j] - bar[cur][i]) * t;
+            }
+        }
+        n = m;
+        cur = !cur;
+    }
+
+    Vec3f pts[MAX_VERTS];
+    float rhw[MAX_VERTS];
+    for (int i=0; i<n; i++) {
+        const Vec4f &p = pos[cur][i];
+        pts[i] = Vec3f(p.x / p.w, p.y / p.w, p.z / p.w);
+        rhw[i] = 1.f / p.w;
+    }
+    for (int i=2; i<n; i++) {
+        if (culled_face(signed_area(pts[0], pts[i-1], pts[i]), cull)) continue;
+        Primitive prim;
+        prim.item = item;
+        prim.face = face;
+        prim.clipped = true;
+        prim.pts[0] = pts[0]; prim.pts[1] = pts[i-1]; prim.pts[2] = pts[i];
+        prim.bar[0] = bar[cur][0]; prim.bar[1] = bar[cur][i-1]; prim.bar[2] = bar[cur][i];
+        prim.rhw[0] = rhw[0]; prim.rhw[1] = rhw[i-1]; prim.rhw[2] = rhw[i];
+        out.push_back(prim);
+    }
+}
+
+// Primitive assembly: builds the primitives of the draw items from the post-transform buffer
+// and their meshlets. Whole meshlets are frustum culled through the models' BVHs (and against
+// the hi-z when one is given) and backface culled by their normal cones, before any per face work.
+// Faces entirely outside the image (or behind the eye) are then culled with the vertex outcodes,
+// back (or front) faces by their winding, and faces crossing the near plane or the guard band
+// are clipped. Batches of meshlets are spread over the pool, the output keeps item and face order.
+class PrimitiveAssembly {
+    static const int BATCH = 8; // meshlets per task, about a thousand faces
+    struct Work {
+        int item, first, end; // meshlets [first, end) of an item
+    };
+    std::vector<std::vector<int> > _visible; // per item, the meshlets that survived culling
+    std::vector<Work> _work;
+    std::vector<std::vector<Primitive> > _chunks;
+    std::vector<Primitive> _prims;
+    int _nmeshlets;
+
+public:
+    PrimitiveAssembly() : _nmeshlets(0) {}
+
+    void run(const std::vector<DrawItem> &items, const VertexStage &vertices, const Rect &screen, const RasterState &state,
+             const HiZ *hiz, ThreadPool &pool) {
+        int nitems = (int)items.size();
+        _visible.resize(nitems);
+        pool.parallel_for(nitems, [&](int k) {
+            const DrawItem &item = items[k];
+            std::vector<int> &visible = _visible[k];
+            visible.clear();
+            bool cone = state.cone_cull && state.cull == CULL_BACK;
+            auto add = [&](int m) {
+                if (!cone || !meshlet_backfacing(item.model->meshlet(m), item.eye)) visible.push_back(m);
+            };
+            if (!state.frustum_cull) {
+                for (int m = 0; m < item.model->nmeshlets(); m++) add(m);
+                return;
+            }
+            const std::vector<int> &order = item.model->bvh().order();
+            item.model->bvh().traverse([&](const AABB &box, bool inside) {
+                return cull_box(box, item.transform, screen, inside, hiz);
+            }, [&](int first, int count) {
+                for (int i = first; i < first + count; i++) add(order[i]);
+            });
+            // back to the model's meshlet order, which is sorted for little overdraw
+            std::sort(visible.begin(), visible.end());
+        });
+
+        _work.clear();
+        _nmeshlets = 0;
+        for (int k=0; k<nitems; k++) {
+            int n = (int)_visible[k].size();
+            for (int m = 0; m < n; m += BATCH) {
+                Work w = { k, m, std::min(n, m + BATCH) };
+                _work.push_back(w);
+            }
+            _nmeshlets += n;
+        }
+
+        int nchunks = (int)_work.size();
+        _chunks.resize(nchunks);
+        pool.parallel_for(nchunks, [&](int c) {
+            const Work &w = _work[c];
+            const DrawItem &item = items[w.item];
+            const uint32_t *mverts = item.model->meshlet_vertices();
+            const uint8_t *mtris = item.model->meshlet_triangles();
+            int base = item.first_vertex;
+            std::vector<Primitive> &out = _chunks[c];
+            out.clear();
+            for (int i = w.first; i < w.end; i++) {
+                const Meshlet &m = item.model->meshlet(_visible[w.item][i]);
+                const uint32_t *local = mverts + m.vertex_offset;
+                for (int f = m.triangle_offset; f < (int)(m.triangle_offset + m.triangle_count); f++) {
+                    int idx[3] = { base + (int)local[mtris[f*3]], base + (int)local[mtris[f*3 + 1]], base + (int)local[mtris[f*3 + 2]] };
+                    int oc0 = vertices.outcode(idx[0]), oc1 = vertices.outcode(idx[1]), oc2 = vertices.outcode(idx[2]);
+                    int all = oc0 & oc1 & oc2, any = oc0 | oc1 | oc2;
+                    if (all & CLIP_MASK) continue; // nothing left after clipping
+                    if (state.frustum_cull && all) continue;
+
+                    if (any & CLIP_MASK) {
+                        Vec4f clip[3] = { vertices.clip(idx[0]), vertices.clip(idx[1]), vertices.clip(idx[2]) };
+                        clip_face(w.item, f, clip, any & CLIP_MASK, screen, state.cull, out);
+                        continue;
+                    }
+                    Primitive prim;
+                    prim.item = w.item;
+                    prim.face = f;
+                    prim.clipped = false;
+                    for (int j=0; j<3; j++) {
+                        prim.pts[j] = vertices.screen(idx[j]);
+                        prim.rhw[j] = 1.f / vertices.clip(idx[j]).w;
+                    }
+                    if (culled_face(signed_area(prim.pts[0], prim.pts[1], prim.pts[2]), state.cull)) continue;
+                    out.push_back(prim);
+                }
+            }
+        });
+
+        _prims.clear();
+        for (int c=0; c<nchunks; c++) {
+            _prims.insert(_prims.end(), _chunks[c].begin(), _chunks[c].end());
+        }
+    }
+
+    int nmeshlets() const { return _nmeshlets; } // that survived culling in the last run
+    void clear() { _prims.clear(); }
+    int size() const { return (int)_prims.size(); }
+    const Primitive &operator[](int i) const { return _prims[i]; }
+};
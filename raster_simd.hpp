@@ -0,0 +1,479 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "geometry.hpp"
+#include "tgaimage.hpp"
+#include "texture.hpp"
+#include "image.hpp"
+#include "rasterizer.hpp"
+#include "varyings.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RASTER_SIMD_X86 1
+#endif
+
+// SIMD versions of the textured + diffuse shading done by triangle().
+// The kernels take a span from rasterize_spans() and do coverage, depth and perspective correct uv/normal interpolation,
+// the z-test, the texture fetch and the masked color write for 4 (SSE4.1) or 8 (AVX2) pixels at a time.
+// They are compiled with per-function target attributes and picked at runtime from CPUID,
+// so the binary still runs on anything; the scalar path stays as the fallback.
+// The math is done in the same order as the scalar code, so all paths produce the same image.
+
+enum SimdLevel {
+    SIMD_SCALAR = 0,
+    SIMD_SSE41  = 1,
+    SIMD_AVX2   = 2
+};
+
+inline SimdLevel detect_simd() {
+#ifdef RASTER_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return SIMD_SSE41;
+#endif
+    return SIMD_SCALAR;
+}
+
+inline SimdLevel &simd_level_ref() {
+    static SimdLevel level = detect_simd();
+    return level;
+}
+
+inline SimdLevel simd_level() {
+    return simd_level_ref();
+}
+
+// lets you force a slower path, asking for more than the cpu has gets you what the cpu has
+inline void set_simd_level(SimdLevel level) {
+    simd_level_ref() = std::min(level, detect_simd());
+}
+
+inline const char *simd_level_name(SimdLevel level) {
+    return level == SIMD_AVX2 ? "avx2" : (level == SIMD_SSE41 ? "sse4.1" : "scalar");
+}
+
+const int TEXTURED_VARYINGS = 5; // u, v, normal
+
+// per triangle constants for the textured gouraud kernels
+struct TexturedSetup {
+    const RasterTriangle *t;
+    const Vec3f *pts;
+    const VaryingPlanes<TEXTURED_VARYINGS> *planes; // uv and normal, perspective correct
+    Vec3f light_dir;
+    TextureSampler sampler; // texture, filter and mip level(s) for this triangle
+    bool early_z; // scalar path only, the SIMD kernels always test depth before touching the texture
+
+    TexturedSetup(const RasterTriangle &tri, const Vec3f *screen_coords, const VaryingPlanes<TEXTURED_VARYINGS> &varyings, Vec3f light, const TextureSampler &tex)
+        : t(&tri), pts(screen_coords), planes(&varyings), light_dir(light), sampler(tex), early_z(true) {}
+};
+
+// the reference scalar shading of one pixel, step pixels right of where the varyings' row was started
+inline void textured_pixel(const TexturedSetup &s, Image &image, int x, int y, Vec3f bc_screen, const float *row, float step) {
+    float z = s.pts[0][2]*bc_screen[0] + s.pts[1][2]*bc_screen[1] + s.pts[2][2]*bc_screen[2];
+    if (s.early_z && !image.depth.test((image._height - y - 1) * image._width + x, z)) {
+        return; // would lose the depth test anyway, don't bother shading
+    }
+
+    float varying[TEXTURED_VARYINGS];
+    s.planes->at(row, step, varying);
+    TGAColor sample_color(s.sampler(varying[0], varying[1]), 4);
+
+    float intensity = Vec3f(varying[2], varying[3], varying[4]) * s.light_dir;
+    intensity = std::min(1.0f, std::max(0.0f, intensity));
+
+    Vec3i fill_color(sample_color.r, sample_color.g, sample_color.b);
+
+    image.setPixel(x, image._height - y - 1, fill_color * intensity, z);
+}
+
+// pixels [x0, x1) of a span whose varyings row starts at xrow
+inline void textured_run_scalar(const TexturedSetup &s, Image &image, int y, int x0, int x1, const int64_t *wstart, bool inside,
+                                const float *row, int xrow) {
+    const RasterTriangle &t = *s.t;
+    int64_t w[3] = { wstart[0], wstart[1], wstart[2] };
+    for (int x=x0; x<x1; x++) {
+        if (inside || (w[0] | w[1] | w[2]) >= 0) {
+            textured_pixel(s, image, x, y, Vec3f(w[0] * t.inv_area, w[1] * t.inv_area, w[2] * t.inv_area), row, (float)(x - xrow));
+        }
+        w[0] += t.A[0]; w[1] += t.A[1]; w[2] += t.A[2];
+    }
+}
+
+inline void textured_span_scalar(const TexturedSetup &s, Image &image, int y, int x0, int x1, const int64_t *wstart, bool inside) {
+    float row[TEXTURED_VARYINGS + 1];
+    s.planes->start(wstart, row);
+    textured_run_scalar(s, image, y, x0, x1, wstart, inside, row, x0);
+}
+
+#ifdef RASTER_SIMD_X86
+
+// The depth test and write of the kernels, for every DepthFormat (see depth.hpp). The unorm
+// formats convert z like depth_unorm() and compare integers, 24 bits fit a signed compare
+
+// the n halves from p, 0 after them. Pixels past the span can belong to another thread's tile
+inline __m128i load_halves(const uint16_t *p, int n) {
+    if (n >= 8) return _mm_loadu_si128((const __m128i*)p);
+    uint16_t tmp[8] = { 0 };
+    memcpy(tmp, p, n * sizeof(uint16_t));
+    return _mm_loadu_si128((const __m128i*)tmp);
+}
+
+inline void store_halves(uint16_t *p, __m128i v, int n) {
+    if (n >= 8) {
+        _mm_storeu_si128((__m128i*)p, v);
+        return;
+    }
+    uint16_t tmp[8];
+    _mm_storeu_si128((__m128i*)tmp, v);
+    memcpy(p, tmp, n * sizeof(uint16_t));
+}
+
+__attribute__((target("sse4.1")))
+inline __m128i depth_unorm_sse41(__m128 z, float scale) {
+    return _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(z, _mm_setzero_ps()), _mm_set1_ps(scale)));
+}
+
+// lanes of cover where z passes at the 4 pixels from idx
+__attribute__((target("sse4.1")))
+inline __m128i depth_pass_sse41(const DepthBuffer &d, unsigned idx, __m128 z, __m128i cover) {
+    switch (d.format()) {
+        case DEPTH_D24S8: {
+            __m128i old = _mm_srli_epi32(_mm_loadu_si128((const __m128i*)(d.words() + idx)), 8);
+            return _mm_and_si128(cover, _mm_cmpgt_epi32(depth_unorm_sse41(z, d.scale()), old));
+        }
+        case DEPTH_D16: {
+            __m128i old = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(d.halves() + idx)));
+            return _mm_and_si128(cover, _mm_cmpgt_epi32(depth_unorm_sse41(z, d.scale()), old));
+        }
+        default:
+            return _mm_and_si128(cover, _mm_castps_si128(_mm_cmpgt_ps(z, _mm_loadu_ps(d.floats() + idx))));
+    }
+}
+
+// z stored where pass is set. The tile owns all 4 pixels, so they're read and written back whole
+__attribute__((target("sse4.1")))
+inline void depth_store_sse41(DepthBuffer &d, unsigned idx, __m128 z, __m128i pass) {
+    switch (d.format()) {
+        case DEPTH_D24S8: {
+            __m128i *p = (__m128i*)(d.words() + idx);
+            __m128i old = _mm_loadu_si128(p);
+            __m128i v = _mm_or_si128(_mm_slli_epi32(depth_unorm_sse41(z, d.scale()), 8), _mm_and_si128(old, _mm_set1_epi32(0xff)));
+            _mm_storeu_si128(p, _mm_blendv_epi8(old, v, pass));
+            break;
+        }
+        case DEPTH_D16: {
+            __m128i *p = (__m128i*)(d.halves() + idx);
+            __m128i v = _mm_packus_epi32(depth_unorm_sse41(z, d.scale()), _mm_setzero_si128());
+            _mm_storel_epi64(p, _mm_blendv_epi8(_mm_loadl_epi64(p), v, _mm_packs_epi32(pass, pass)));
+            break;
+        }
+        default: {
+            float *p = d.floats() + idx;
+            _mm_storeu_ps(p, _mm_blendv_ps(_mm_loadu_ps(p), z, _mm_castsi128_ps(pass)));
+            break;
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+inline __m256i depth_unorm_avx2(__m256 z, float scale) {
+    return _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(z, _mm256_setzero_ps()), _mm256_set1_ps(scale)));
+}
+
+// lanes of cover where z passes at the 8 pixels from idx, of which the first n are in the span
+__attribute__((target("avx2")))
+inline __m256i depth_pass_avx2(const DepthBuffer &d, unsigned idx, int n, __m256 z, __m256i cover) {
+    switch (d.format()) {
+        case DEPTH_D24S8: {
+            __m256i old = _mm256_srli_epi32(_mm256_maskload_epi32((const int*)(d.words() + idx), cover), 8);
+            return _mm256_and_si256(cover, _mm256_cmpgt_epi32(depth_unorm_avx2(z, d.scale()), old));
+        }
+        case DEPTH_D16: {
+            __m256i old = _mm256_cvtepu16_epi32(load_halves(d.halves() + idx, n));
+            return _mm256_and_si256(cover, _mm256_cmpgt_epi32(depth_unorm_avx2(z, d.scale()), old));
+        }
+        default: {
+            __m256 old = _mm256_maskload_ps(d.floats() + idx, cover);
+            return _mm256_and_si256(cover, _mm256_castps_si256(_mm256_cmp_ps(z, old, _CMP_GT_OQ)));
+        }
+    }
+}
+
+// z stored where pass is set, nothing past the first n pixels is touched
+__attribute__((target("avx2")))
+inline void depth_store_avx2(DepthBuffer &d, unsigned idx, int n, __m256 z, __m256i pass) {
+    switch (d.format()) {
+        case DEPTH_D24S8: {
+            int *p = (int*)(d.words() + idx);
+            __m256i old = _mm256_maskload_epi32(p, pass);
+            __m256i v = _mm256_or_si256(_mm256_slli_epi32(depth_unorm_avx2(z, d.scale()), 8), _mm256_and_si256(old, _mm256_set1_epi32(0xff)));
+            _mm256_maskstore_epi32(p, pass, v);
+            break;
+        }
+        case DEPTH_D16: {
+            __m256i q = depth_unorm_avx2(z, d.scale());
+            __m128i v = _mm_packus_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+            __m128i mask = _mm_packs_epi32(_mm256_castsi256_si128(pass), _mm256_extracti128_si256(pass, 1));
+            uint16_t *p = d.halves() + idx;
+            store_halves(p, _mm_blendv_epi8(load_halves(p, n), v, mask), n);
+            break;
+        }
+        default:
+            _mm256_maskstore_ps(d.floats() + idx, pass, z);
+            break;
+    }
+}
+
+// lanes of the 8 pixels from idx that got drawn on since the clear, see DepthBuffer::covered()
+__attribute__((target("avx2")))
+inline __m256i depth_covered_avx2(const DepthBuffer &d, unsigned idx) {
+    __m256i stored;
+    switch (d.format()) {
+        case DEPTH_D24S8:
+            stored = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i*)(d.words() + idx)), 8);
+            break;
+        case DEPTH_D16:
+            stored = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(d.halves() + idx)));
+            break;
+        default:
+            return _mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(d.floats() + idx), _mm256_set1_ps(d.clear_value()), _CMP_NEQ_OQ));
+    }
+    return _mm256_xor_si256(_mm256_cmpeq_epi32(stored, _mm256_setzero_si256()), _mm256_set1_epi32(-1));
+}
+
+__attribute__((target("sse4.1")))
+inline void textured_quad_sse41(const TexturedSetup &s, Image &image, int y, int x, const int64_t *w, const float *row, int xrow) {
+    const RasterTriangle &t = *s.t;
+    const __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i w0 = _mm_add_epi32(_mm_set1_epi32((int)w[0]), _mm_mullo_epi32(_mm_set1_epi32((int)t.A[0]), lane));
+    __m128i w1 = _mm_add_epi32(_mm_set1_epi32((int)w[1]), _mm_mullo_epi32(_mm_set1_epi32((int)t.A[1]), lane));
+    __m128i w2 = _mm_add_epi32(_mm_set1_epi32((int)w[2]), _mm_mullo_epi32(_mm_set1_epi32((int)t.A[2]), lane));
+    __m128i cover = _mm_cmpgt_epi32(_mm_or_si128(w0, _mm_or_si128(w1, w2)), _mm_set1_epi32(-1));
+    if (_mm_testz_si128(cover, cover)) return;
+
+    __m128 inv = _mm_set1_ps(t.inv_area);
+    __m128 b0 = _mm_mul_ps(_mm_cvtepi32_ps(w0), inv);
+    __m128 b1 = _mm_mul_ps(_mm_cvtepi32_ps(w1), inv);
+    __m128 b2 = _mm_mul_ps(_mm_cvtepi32_ps(w2), inv);
+
+#define LERP3(a, b, c) _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a), b0), _mm_mul_ps(_mm_set1_ps(b), b1)), _mm_mul_ps(_mm_set1_ps(c), b2))
+    __m128 z = LERP3(s.pts[0].z, s.pts[1].z, s.pts[2].z);
+    unsigned idx = (image._height - y - 1) * image._width + x;
+    __m128i pass = depth_pass_sse41(image.depth, idx, z, cover);
+    int passmask = _mm_movemask_ps(_mm_castsi128_ps(pass));
+    if (!passmask) return;
+
+#undef LERP3
+
+    // VaryingPlanes::at() for the 4 pixels
+    const VaryingPlanes<TEXTURED_VARYINGS> &p = *s.planes;
+    __m128 step = _mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(x - xrow), lane));
+    __m128 rq = _mm_div_ps(_mm_set1_ps(1.f), _mm_add_ps(_mm_set1_ps(row[TEXTURED_VARYINGS]), _mm_mul_ps(step, _mm_set1_ps(p.dx[TEXTURED_VARYINGS]))));
+#define VARYING(k) _mm_mul_ps(_mm_add_ps(_mm_set1_ps(row[k]), _mm_mul_ps(step, _mm_set1_ps(p.dx[k]))), rq)
+    __m128 u = VARYING(0), v = VARYING(1);
+    __m128 nx = VARYING(2), ny = VARYING(3), nz = VARYING(4);
+#undef VARYING
+    __m128 intensity = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nz, _mm_set1_ps(s.light_dir.z)), _mm_mul_ps(ny, _mm_set1_ps(s.light_dir.y))),
+                                  _mm_mul_ps(nx, _mm_set1_ps(s.light_dir.x)));
+    intensity = _mm_min_ps(_mm_set1_ps(1.f), _mm_max_ps(_mm_setzero_ps(), intensity));
+
+    // no gather before AVX2, sample the texture one pixel at a time
+    float us[4], vs[4];
+    unsigned texel[4];
+    _mm_storeu_ps(us, u);
+    _mm_storeu_ps(vs, v);
+    for (int i=0; i<4; i++) {
+        texel[i] = (passmask >> i & 1) ? s.sampler(us[i], vs[i]) : 0;
+    }
+    __m128i tex = _mm_loadu_si128((const __m128i*)texel);
+    __m128i mask8 = _mm_set1_epi32(0xff);
+    __m128 b = _mm_cvtepi32_ps(_mm_and_si128(tex, mask8));
+    __m128 g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(tex, 8), mask8));
+    __m128 r = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(tex, 16), mask8));
+    __m128i color = _mm_or_si128(_mm_cvttps_epi32(_mm_mul_ps(r, intensity)),
+                    _mm_or_si128(_mm_slli_epi32(_mm_cvttps_epi32(_mm_mul_ps(g, intensity)), 8),
+                                 _mm_slli_epi32(_mm_cvttps_epi32(_mm_mul_ps(b, intensity)), 16)));
+
+    // the tile owns these pixels, so a read-blend-write of the whole quad is safe
+    __m128i old = _mm_loadu_si128((const __m128i*)(image.pixels + idx));
+    _mm_storeu_si128((__m128i*)(image.pixels + idx), _mm_blendv_epi8(old, color, pass));
+    depth_store_sse41(image.depth, idx, z, pass);
+}
+
+inline void textured_span_sse41(const TexturedSetup &s, Image &image, int y, int x0, int x1, const int64_t *wstart, bool inside) {
+    const RasterTriangle &t = *s.t;
+    int64_t w[3] = { wstart[0], wstart[1], wstart[2] };
+    float row[TEXTURED_VARYINGS + 1];
+    s.planes->start(wstart, row);
+    int x = x0;
+    for (; x + 4 <= x1; x += 4) {
+        textured_quad_sse41(s, image, y, x, w, row, x0);
+        w[0] += 4*t.A[0]; w[1] += 4*t.A[1]; w[2] += 4*t.A[2];
+    }
+    if (x < x1) {
+        textured_run_scalar(s, image, y, x, x1, w, inside, row, x0);
+    }
+}
+
+// the AVX2 side of texture.hpp: same math as Texture::nearest() and bilinear() and lerp_texel(),
+// 8 pixels at a time with gathers. Lanes outside mask read nothing and come back 0
+
+__attribute__((target("avx2")))
+inline __m256i lerp_texel_avx2(__m256i a, __m256i b, __m256i f) {
+    __m256i m = _mm256_set1_epi32(0xff00ff);
+    __m256i nf = _mm256_sub_epi32(_mm256_set1_epi32(256), f);
+    __m256i rb = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(a, m), nf), _mm256_mullo_epi32(_mm256_and_si256(b, m), f));
+    __m256i ag = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(a, 8), m), nf),
+                                  _mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(b, 8), m), f));
+    return _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(rb, 8), m), _mm256_and_si256(ag, _mm256_set1_epi32((int)0xff00ff00)));
+}
+
+// texels (x, y) of a level, x and y already clamped to it
+__attribute__((target("avx2")))
+inline __m256i fetch_avx2(const Texture &tex, const TextureLevel &l, __m256i x, __m256i y, __m256i mask) {
+    __m256i one = _mm256_set1_epi32(1), two = _mm256_set1_epi32(2), four = _mm256_set1_epi32(4);
+    __m256i tile = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(y, TEXTURE_TILE_SHIFT), _mm256_set1_epi32(l.tiles_x)),
+                                    _mm256_srli_epi32(x, TEXTURE_TILE_SHIFT));
+    __m256i morton = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(x, one), _mm256_slli_epi32(_mm256_and_si256(y, one), 1)),
+                     _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(x, two), 1), _mm256_slli_epi32(_mm256_and_si256(y, two), 2)),
+                                     _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(x, four), 2), _mm256_slli_epi32(_mm256_and_si256(y, four), 3))));
+    __m256i idx = _mm256_add_epi32(_mm256_slli_epi32(tile, 6), morton);
+    return _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int*)(tex.texels() + l.offset), idx, mask, 4);
+}
+
+__attribute__((target("avx2")))
+inline __m256i clamp_avx2(__m256i x, int hi) {
+    return _mm256_min_epi32(_mm256_max_epi32(x, _mm256_setzero_si256()), _mm256_set1_epi32(hi));
+}
+
+__attribute__((target("avx2")))
+inline __m256i bilinear_avx2(const Texture &tex, int level, __m256 u, __m256 v, __m256i mask) {
+    const TextureLevel &l = tex.level(level);
+    __m256 half = _mm256_set1_ps(.5f), scale = _mm256_set1_ps(256.f);
+    __m256 fx = _mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps((float)l.width), u), half);
+    __m256 fy = _mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps((float)l.height), v), half);
+    __m256 x0f = _mm256_floor_ps(fx), y0f = _mm256_floor_ps(fy);
+    __m256i wx = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(fx, x0f), scale));
+    __m256i wy = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(fy, y0f), scale));
+    __m256i x0 = _mm256_cvttps_epi32(x0f), y0 = _mm256_cvttps_epi32(y0f);
+    __m256i one = _mm256_set1_epi32(1);
+    __m256i x1 = clamp_avx2(_mm256_add_epi32(x0, one), l.width - 1), y1 = clamp_avx2(_mm256_add_epi32(y0, one), l.height - 1);
+    x0 = clamp_avx2(x0, l.width - 1);
+    y0 = clamp_avx2(y0, l.height - 1);
+    __m256i top = lerp_texel_avx2(fetch_avx2(tex, l, x0, y0, mask), fetch_avx2(tex, l, x1, y0, mask), wx);
+    __m256i bottom = lerp_texel_avx2(fetch_avx2(tex, l, x0, y1, mask), fetch_avx2(tex, l, x1, y1, mask), wx);
+    return lerp_texel_avx2(top, bottom, wy);
+}
+
+__attribute__((target("avx2")))
+inline __m256i sample_avx2(const TextureSampler &s, __m256 u, __m256 v, __m256i mask) {
+    if (!s.texture || s.texture->empty()) return _mm256_setzero_si256();
+    const Texture &tex = *s.texture;
+    if (s.filter == FILTER_NEAREST) {
+        const TextureLevel &l = tex.level(0);
+        __m256i x = clamp_avx2(_mm256_cvttps_epi32(_mm256_mul_ps(_mm256_set1_ps((float)l.width), u)), l.width - 1);
+        __m256i y = clamp_avx2(_mm256_cvttps_epi32(_mm256_mul_ps(_mm256_set1_ps((float)l.height), v)), l.height - 1);
+        return fetch_avx2(tex, l, x, y, mask);
+    }
+    __m256i c = bilinear_avx2(tex, s.level, u, v, mask);
+    if (s.filter == FILTER_TRILINEAR && s.mix) {
+        c = lerp_texel_avx2(c, bilinear_avx2(tex, s.level + 1, u, v, mask), _mm256_set1_epi32(s.mix));
+    }
+    return c;
+}
+
+// the same with a trilinear weight per lane instead of s.mix, all lanes on the same level(s)
+__attribute__((target("avx2")))
+inline __m256i sample_avx2(const TextureSampler &s, __m256 u, __m256 v, __m256i mask, __m256i mix) {
+    if (s.filter != FILTER_TRILINEAR || !s.texture || s.texture->empty()) return sample_avx2(s, u, v, mask);
+    __m256i c = bilinear_avx2(*s.texture, s.level, u, v, mask);
+    if (s.level + 1 < s.texture->nlevels() && !_mm256_testz_si256(mix, mix)) {
+        c = lerp_texel_avx2(c, bilinear_avx2(*s.texture, s.level + 1, u, v, mask), mix);
+    }
+    return c;
+}
+
+__attribute__((target("avx2")))
+inline void textured_span_avx2(const TexturedSetup &s, Image &image, int y, int x0, int x1, const int64_t *w) {
+    const RasterTriangle &t = *s.t;
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i active = _mm256_cmpgt_epi32(_mm256_set1_epi32(x1 - x0), lane);
+    __m256i w0 = _mm256_add_epi32(_mm256_set1_epi32((int)w[0]), _mm256_mullo_epi32(_mm256_set1_epi32((int)t.A[0]), lane));
+    __m256i w1 = _mm256_add_epi32(_mm256_set1_epi32((int)w[1]), _mm256_mullo_epi32(_mm256_set1_epi32((int)t.A[1]), lane));
+    __m256i w2 = _mm256_add_epi32(_mm256_set1_epi32((int)w[2]), _mm256_mullo_epi32(_mm256_set1_epi32((int)t.A[2]), lane));
+    __m256i cover = _mm256_andnot_si256(_mm256_srai_epi32(_mm256_or_si256(w0, _mm256_or_si256(w1, w2)), 31), active);
+    if (_mm256_testz_si256(cover, cover)) return;
+
+    __m256 inv = _mm256_set1_ps(t.inv_area);
+    __m256 b0 = _mm256_mul_ps(_mm256_cvtepi32_ps(w0), inv);
+    __m256 b1 = _mm256_mul_ps(_mm256_cvtepi32_ps(w1), inv);
+    __m256 b2 = _mm256_mul_ps(_mm256_cvtepi32_ps(w2), inv);
+
+#define LERP3(a, b, c) _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(a), b0), _mm256_mul_ps(_mm256_set1_ps(b), b1)), _mm256_mul_ps(_mm256_set1_ps(c), b2))
+    __m256 z = LERP3(s.pts[0].z, s.pts[1].z, s.pts[2].z);
+    unsigned idx = (image._height - y - 1) * image._width + x0;
+    __m256i pass = depth_pass_avx2(image.depth, idx, x1 - x0, z, cover);
+    if (_mm256_testz_si256(pass, pass)) return;
+
+#undef LERP3
+
+    // VaryingPlanes::at() for the 8 pixels, the span is the row's start
+    const VaryingPlanes<TEXTURED_VARYINGS> &p = *s.planes;
+    float row[TEXTURED_VARYINGS + 1];
+    p.start(w, row);
+    __m256 step = _mm256_cvtepi32_ps(lane);
+    __m256 rq = _mm256_div_ps(_mm256_set1_ps(1.f), _mm256_add_ps(_mm256_set1_ps(row[TEXTURED_VARYINGS]), _mm256_mul_ps(step, _mm256_set1_ps(p.dx[TEXTURED_VARYINGS]))));
+#define VARYING(k) _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(row[k]), _mm256_mul_ps(step, _mm256_set1_ps(p.dx[k]))), rq)
+    __m256 u = VARYING(0), v = VARYING(1);
+    __m256 nx = VARYING(2), ny = VARYING(3), nz = VARYING(4);
+#undef VARYING
+    __m256 intensity = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nz, _mm256_set1_ps(s.light_dir.z)), _mm256_mul_ps(ny, _mm256_set1_ps(s.light_dir.y))),
+                                     _mm256_mul_ps(nx, _mm256_set1_ps(s.light_dir.x)));
+    intensity = _mm256_min_ps(_mm256_set1_ps(1.f), _mm256_max_ps(_mm256_setzero_ps(), intensity));
+
+    __m256i tex = sample_avx2(s.sampler, u, v, pass);
+
+    __m256i mask8 = _mm256_set1_epi32(0xff);
+    __m256 b = _mm256_cvtepi32_ps(_mm256_and_si256(tex, mask8));
+    __m256 g = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(tex, 8), mask8));
+    __m256 r = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(tex, 16), mask8));
+    __m256i color = _mm256_or_si256(_mm256_cvttps_epi32(_mm256_mul_ps(r, intensity)),
+                    _mm256_or_si256(_mm256_slli_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(g, intensity)), 8),
+                                    _mm256_slli_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(b, intensity)), 16)));
+
+    _mm256_maskstore_epi32((int*)(image.pixels + idx), pass, color);
+    depth_store_avx2(image.depth, idx, x1 - x0, z, pass);
+}
+
+#endif // RASTER_SIMD_X86
+
+// textured + diffuse shading of one triangle with the best kernel the cpu supports.
+// With state.hiz the triangle, then every block it covers, is first checked against image.hiz
+inline void rasterize_textured(const TexturedSetup &s, Image &image, const RasterState &state) {
+    const RasterTriangle &t = *s.t;
+    if (state.hiz && hiz_hidden(image.hiz, t)) {
+        return;
+    }
+    HiZBlockTest block(image.hiz, t, state.hiz);
+
+#ifdef RASTER_SIMD_X86
+    SimdLevel level = simd_level();
+    if (level != SIMD_SCALAR && fits_int32(t)) {
+        if (level == SIMD_AVX2) {
+            rasterize_spans(t, [&](int y, int x0, int x1, const int64_t *w, bool) {
+                textured_span_avx2(s, image, y, x0, x1, w);
+            }, block);
+        } else {
+            rasterize_spans(t, [&](int y, int x0, int x1, const int64_t *w, bool inside) {
+                textured_span_sse41(s, image, y, x0, x1, w, inside);
+            }, block);
+        }
+        return;
+    }
+#endif
+    rasterize_spans(t, [&](int y, int x0, int x1, const int64_t *w, bool inside) {
+        textured_span_scalar(s, image, y, x0, x1, w, inside);
+    }, block);
+}
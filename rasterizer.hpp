@@ -0,0 +1,198 @@
+#pragma once
+
+#include <cmath>
+#include <cstdlib>
+#include <stdint.h>
+#include <algorithm>
+#include "geometry.hpp"
+#include "tiler.hpp"
+
+// Rasterizer core.
+// Vertices are snapped to 1/16th of a pixel and every edge becomes an integer edge function
+// w_i(x, y) = A[i]*x + B[i]*y + C[i], evaluated at the center of pixel (x, y). Inside means all three are >= 0.
+// Pixel centers lying exactly on an edge belong to the triangle only if it is a top or left edge,
+// so two triangles sharing an edge never both touch (or both miss) a pixel on it.
+const int SUBPIXEL_BITS = 4;
+const int SUBPIXEL_ONE  = 1 << SUBPIXEL_BITS;
+const int RASTER_BLOCK  = 8; // coverage is first decided for 8x8 blocks, then per pixel
+
+// past this the screen coordinates are garbage anyway (no clipping yet), and the fixed point math would overflow
+const float RASTER_MAX_COORD = 1 << 20;
+
+struct RasterTriangle {
+    int64_t A[3], B[3], C[3]; // edge i is the one opposite vertex i, so w_i/area is the barycentric weight of vertex i
+    int64_t area;             // twice the signed area, in 1/256th of a pixel
+    float inv_area;
+    float z[3];               // vertex depths, for the occlusion tests
+    Rect box;                 // pixels whose center may be covered, clipped
+};
+
+// which side of a triangle gets thrown away, counter clockwise on screen (y up) is the front
+enum CullFace {
+    CULL_NONE,
+    CULL_BACK,
+    CULL_FRONT
+};
+
+// switches for the optional parts of the pipeline, a bit like glEnable()
+struct RasterState {
+    bool hiz;          // reject triangles and 8x8 blocks that the hierarchical z says are hidden
+    bool early_z;      // depth test before shading a fragment instead of after
+    CullFace cull;     // backface culling in primitive assembly
+    bool frustum_cull; // drop whole objects, meshlets and triangles entirely outside the image
+    bool occlusion_cull; // drop objects and meshlets the hi-z of what's already drawn says are hidden
+    bool cone_cull;    // with CULL_BACK, drop meshlets whose normal cone faces away from the eye
+    bool occlusion_queries; // with occlusion_cull, objects the hi-z can't drop get their box rasterized against the depth
+
+    RasterState() : hiz(true), early_z(true), cull(CULL_BACK), frustum_cull(true), occlusion_cull(true), cone_cull(true), occlusion_queries(false) {}
+};
+
+static inline int64_t floor_div(int64_t a, int64_t b) {
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+// returns false if the triangle is degenerate or has no pixel center inside clip. With a margin
+// (in 1/SUBPIXEL_ONE pixels) the box also gets the pixels whose center is that close to the
+// triangle's bounds, for when coverage is sampled off the centers
+bool setup_triangle(const Vec3f *pts, const Rect &clip, RasterTriangle &t, int margin = 0) {
+    int64_t X[3], Y[3];
+    for (int i=0; i<3; i++) {
+        if (!(std::abs(pts[i].x) < RASTER_MAX_COORD && std::abs(pts[i].y) < RASTER_MAX_COORD)) return false; // catches NaNs too
+        X[i] = (int64_t)std::lround(pts[i].x * SUBPIXEL_ONE);
+        t.z[i] = pts[i].z;
+        Y[i] = (int64_t)std::lround(pts[i].y * SUBPIXEL_ONE);
+    }
+    t.area = (X[1]-X[0])*(Y[2]-Y[0]) - (X[2]-X[0])*(Y[1]-Y[0]);
+    if (t.area == 0) return false;
+    // both windings are drawn, a clockwise triangle is handled by flipping all of its edges
+    int64_t sign = t.area > 0 ? 1 : -1;
+
+    const int64_t half = SUBPIXEL_ONE / 2;
+    for (int i=0; i<3; i++) {
+        int a = (i+1)%3, b = (i+2)%3;
+        int64_t dx = (X[b]-X[a])*sign, dy = (Y[b]-Y[a])*sign;
+        t.A[i] = -dy * SUBPIXEL_ONE;
+        t.B[i] =  dx * SUBPIXEL_ONE;
+        t.C[i] = dx*(half - Y[a]) - dy*(half - X[a]);
+        bool top_left = dy < 0 || (dy == 0 && dx < 0);
+        if (!top_left) t.C[i] -= 1; // w >= 0 then means w > 0 on this edge
+    }
+    t.area *= sign;
+    t.inv_area = 1.f / t.area;
+
+    int64_t xmin = std::min(X[0], std::min(X[1], X[2])) - margin, xmax = std::max(X[0], std::max(X[1], X[2])) + margin;
+    int64_t ymin = std::min(Y[0], std::min(Y[1], Y[2])) - margin, ymax = std::max(Y[0], std::max(Y[1], Y[2])) + margin;
+    t.box.x0 = std::max<int64_t>(clip.x0,   floor_div(xmin - half + SUBPIXEL_ONE - 1, SUBPIXEL_ONE));
+    t.box.y0 = std::max<int64_t>(clip.y0,   floor_div(ymin - half + SUBPIXEL_ONE - 1, SUBPIXEL_ONE));
+    t.box.x1 = std::min<int64_t>(clip.x1, floor_div(xmax - half, SUBPIXEL_ONE) + 1);
+    t.box.y1 = std::min<int64_t>(clip.y1, floor_div(ymax - half, SUBPIXEL_ONE) + 1);
+    return !t.box.empty();
+}
+
+// depth of the triangle at a pixel, w being the edge functions there
+inline float interpolate_depth(const RasterTriangle &t, const int64_t *w) {
+    return t.z[0]*(w[0] * t.inv_area) + t.z[1]*(w[1] * t.inv_area) + t.z[2]*(w[2] * t.inv_area);
+}
+
+// how the barycentric coordinates change from one pixel to the next along x and along y,
+// the same everywhere on the triangle
+inline void bar_derivatives(const RasterTriangle &t, Vec3f &ddx, Vec3f &ddy) {
+    for (int i=0; i<3; i++) {
+        ddx[i] = t.A[i] * t.inv_area;
+        ddy[i] = t.B[i] * t.inv_area;
+    }
+}
+
+// nearest (largest) depth of the triangle's plane over the pixels [x0, x1) x [y0, y1), w being the edge functions at (x0, y0).
+// Depth is linear in screen space so the corners bound it; the small margin covers rounding in the per pixel math
+inline float block_max_depth(const RasterTriangle &t, int x0, int y0, int x1, int y1, const int64_t *w) {
+    int64_t dx[3], dy[3], c[3];
+    for (int i=0; i<3; i++) {
+        dx[i] = t.A[i]*(x1-1-x0);
+        dy[i] = t.B[i]*(y1-1-y0);
+    }
+    float zmax = interpolate_depth(t, w);
+    for (int i=0; i<3; i++) c[i] = w[i] + dx[i];
+    zmax = std::max(zmax, interpolate_depth(t, c));
+    for (int i=0; i<3; i++) c[i] = w[i] + dy[i];
+    zmax = std::max(zmax, interpolate_depth(t, c));
+    for (int i=0; i<3; i++) c[i] = w[i] + dx[i] + dy[i];
+    zmax = std::max(zmax, interpolate_depth(t, c));
+    return zmax + 1e-5f * (std::abs(zmax) + 1.f);
+}
+
+// lets every block through
+struct AcceptAllBlocks {
+    bool operator()(int, int, int, int, const int64_t *) const { return true; }
+};
+
+// calls fn(y, x0, x1, w, inside) for every row of every block that may contain covered pixels,
+// w being the edge functions at (x0, y). inside means the whole span is covered.
+// Walks the bounding box in RASTER_BLOCK blocks: blocks outside an edge are skipped,
+// blocks fully inside skip the per pixel test and empty rows are dropped early.
+// block(x0, y0, x1, y1, w) gets asked about every block that survives the coverage test and can veto it
+template <typename SpanFn, typename BlockFn> void rasterize_spans(const RasterTriangle &t, SpanFn fn, BlockFn block) {
+    const Rect &box = t.box;
+    for (int by = box.y0 & ~(RASTER_BLOCK-1); by < box.y1; by += RASTER_BLOCK) {
+        int y0 = std::max(by, box.y0), y1 = std::min(by + RASTER_BLOCK, box.y1);
+        for (int bx = box.x0 & ~(RASTER_BLOCK-1); bx < box.x1; bx += RASTER_BLOCK) {
+            int x0 = std::max(bx, box.x0), x1 = std::min(bx + RASTER_BLOCK, box.x1);
+
+            // the edge functions are linear, checking the corner pixels is enough
+            int64_t w0[3];
+            bool outside = false, inside = true;
+            for (int i=0; i<3 && !outside; i++) {
+                w0[i] = t.A[i]*x0 + t.B[i]*y0 + t.C[i];
+                int64_t dx = t.A[i]*(x1-1-x0), dy = t.B[i]*(y1-1-y0);
+                int64_t lo = w0[i] + std::min<int64_t>(dx, 0) + std::min<int64_t>(dy, 0);
+                int64_t hi = w0[i] + std::max<int64_t>(dx, 0) + std::max<int64_t>(dy, 0);
+                outside = hi < 0;
+                inside = inside && lo >= 0;
+            }
+            if (outside || !block(x0, y0, x1, y1, w0)) continue;
+
+            for (int y=y0; y<y1; y++) {
+                int64_t w[3] = { w0[0], w0[1], w0[2] };
+                w0[0] += t.B[0]; w0[1] += t.B[1]; w0[2] += t.B[2];
+                if (!inside) {
+                    bool empty = false;
+                    for (int i=0; i<3; i++) {
+                        empty = empty || (w[i] < 0 && w[i] + t.A[i]*(x1-1-x0) < 0);
+                    }
+                    if (empty) continue;
+                }
+                fn(y, x0, x1, w, inside);
+            }
+        }
+    }
+}
+
+template <typename SpanFn> void rasterize_spans(const RasterTriangle &t, SpanFn fn) {
+    rasterize_spans(t, fn, AcceptAllBlocks());
+}
+
+// calls fn(x, y, barycentric) for every covered pixel
+template <typename PixelFn> void rasterize(const RasterTriangle &t, PixelFn fn) {
+    rasterize_spans(t, [&](int y, int x0, int x1, const int64_t *wstart, bool inside) {
+        int64_t w[3] = { wstart[0], wstart[1], wstart[2] };
+        for (int x=x0; x<x1; x++) {
+            if (inside || (w[0] | w[1] | w[2]) >= 0) {
+                fn(x, y, Vec3f(w[0] * t.inv_area, w[1] * t.inv_area, w[2] * t.inv_area));
+            }
+            w[0] += t.A[0]; w[1] += t.A[1]; w[2] += t.A[2];
+        }
+    });
+}
+
+// true if the edge functions stay within 32 bits over the whole bounding box, which the SIMD kernels rely on
+inline bool fits_int32(const RasterTriangle &t) {
+    const int64_t limit = (int64_t(1) << 31) - 1;
+    for (int i=0; i<3; i++) {
+        int64_t corner[4] = { t.A[i]*t.box.x0     + t.B[i]*t.box.y0,     t.A[i]*(t.box.x1-1) + t.B[i]*t.box.y0,
+                              t.A[i]*t.box.x0     + t.B[i]*(t.box.y1-1), t.A[i]*(t.box.x1-1) + t.B[i]*(t.box.y1-1) };
+        for (int k=0; k<4; k++) {
+            if (std::abs(corner[k] + t.C[i]) > limit) return false;
+        }
+    }
+    return true;
+}
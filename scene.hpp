@@ -0,0 +1,102 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include "geometry.hpp"
+#include "model.hpp"
+#include "bvh.hpp"
+#include "hiz.hpp"
+#include "pipeline.hpp"
+
+// one placement of a model in the world
+struct Instance {
+    const Model *model;
+    Mat4f transform; // model to world
+    Mat4f inverse;   // world to model
+    AABB bounds;     // world space box, kept up to date by Scene
+    float alpha;     // opacity, below 1 it's drawn as a translucent surface through the OIT buffer
+};
+
+// A flat scene graph: many instances of (usually few) models, with a BVH over their world
+// boxes so that culling a frame costs about the number of visible instances, not the total.
+// It also remembers which instances were drawn last frame, for two phase occlusion culling:
+// draw what was visible last time, build the hi-z, then test everything else against it.
+class Scene {
+    std::vector<Instance> _instances;
+    std::vector<unsigned char> _visible; // per instance, drawn and not occluded last frame
+    std::vector<int> _visible_list;      // the same as a list, so resetting it doesn't touch every instance
+    std::vector<std::pair<int, AABB> > _moved; // added or moved since clear_moved(), with the box they had before
+    BVH _bvh;
+    bool _dirty;
+
+public:
+    Scene() : _dirty(false) {}
+
+    int add(const Model *model, const Mat4f &transform = Mat4f::identity()) {
+        Instance inst;
+        inst.model = model;
+        inst.transform = transform;
+        inst.inverse = transform.inverse();
+        inst.bounds = transform_box(model->bounds(), transform);
+        inst.alpha = 1.f;
+        _instances.push_back(inst);
+        _visible.push_back(0);
+        _moved.push_back(std::make_pair((int)_instances.size() - 1, inst.bounds));
+        _dirty = true;
+        return (int)_instances.size() - 1;
+    }
+
+    void set_transform(int i, const Mat4f &transform) {
+        _moved.push_back(std::make_pair(i, _instances[i].bounds));
+        _instances[i].transform = transform;
+        _instances[i].inverse = transform.inverse();
+        _instances[i].bounds = transform_box(_instances[i].model->bounds(), transform);
+        _dirty = true;
+    }
+
+    void set_alpha(int i, float alpha) {
+        _moved.push_back(std::make_pair(i, _instances[i].bounds));
+        _instances[i].alpha = alpha;
+    }
+
+    // the BVH is only rebuilt when instances were added or moved
+    void update() {
+        if (!_dirty) return;
+        std::vector<AABB> boxes(_instances.size());
+        for (size_t i=0; i<_instances.size(); i++) boxes[i] = _instances[i].bounds;
+        _bvh.build(boxes, 2);
+        _dirty = false;
+    }
+
+    // what changed on screen, for redrawing only that
+    const std::vector<std::pair<int, AABB> > &moved() const { return _moved; }
+    void clear_moved() { _moved.clear(); }
+
+    int size() const { return (int)_instances.size(); }
+    const Instance &instance(int i) const { return _instances[i]; }
+    bool was_visible(int i) const { return _visible[i] != 0; }
+
+    // what the next frame's first phase draws
+    void set_visible(const std::vector<int> &ids) {
+        for (size_t i=0; i<_visible_list.size(); i++) _visible[_visible_list[i]] = 0;
+        _visible_list = ids;
+        for (size_t i=0; i<ids.size(); i++) _visible[ids[i]] = 1;
+    }
+
+    // instances at least partly inside the image, and not hidden behind the hi-z when one is given.
+    // view is world to homogeneous screen. Call update() first
+    void cull(const Mat4f &view, const Rect &screen, const HiZ *hiz, std::vector<int> &out) const {
+        out.clear();
+        const std::vector<int> &order = _bvh.order();
+        _bvh.traverse([&](const AABB &box, bool inside) {
+            return cull_box(box, view, screen, inside, hiz);
+        }, [&](int first, int count) {
+            for (int i = first; i < first + count; i++) {
+                int id = order[i];
+                if (count == 1 || cull_box(_instances[id].bounds, view, screen, false, hiz) != VIS_OUTSIDE) {
+                    out.push_back(id);
+                }
+            }
+        });
+    }
+};
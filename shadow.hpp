@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cmath>
+#include <algorithm>
+#include <memory>
+#include "geometry.hpp"
+#include "image.hpp"
+#include "tiler.hpp"
+#include "thread_pool.hpp"
+#include "bvh.hpp"
+#include "depth.hpp"
+#include "our_gl.hpp"
+
+// Shadows of the directional light. Once per frame the scene is drawn depth only from the
+// light into the shadow map, an orthographic view fitted around the scene (the depth only
+// pass is in depth_raster.hpp). Once the image is drawn, every pixel's position goes from
+// its screen x, y and depth back to the world and on into the map, where a PCF lookup tells
+// how much of the light gets there, and the pixel's color is scaled by that. Being a pass over
+// the finished image it shades every visible pixel once, whatever the render mode, and the
+// shader's lighting is all diffuse, so scaling the color is the same as scaling the light.
+const float SHADOW_BIAS = 1.5f;      // in texels of depth, against surfaces shadowing themselves
+const float SHADOW_MAX_SLOPE = 4.f;  // texels of depth per texel, steeper than that only gets this much bias
+
+class ShadowMap {
+    std::unique_ptr<Image> _map;  // depth only
+    float _range; // of the depth fit() maps the scene to
+    float _bias;  // SHADOW_BIAS in the map's depth units
+
+    // the 4x4 texels from (x0, y0) up, outside the map is the clear value which nothing is
+    // behind. Reads the format's storage straight away when they're all inside, which is the
+    // usual case
+    void fetch(int x0, int y0, float d[4][4]) const {
+        const Image &m = *_map;
+        const DepthBuffer &depth = m.depth;
+        if (x0 < 0 || y0 < 0 || x0 + 4 > (int)m._width || y0 + 4 > (int)m._height) {
+            for (int j=0; j<4; j++) {
+                for (int i=0; i<4; i++) {
+                    int x = x0 + i, y = y0 + j;
+                    bool inside = x >= 0 && x < (int)m._width && y >= 0 && y < (int)m._height;
+                    d[j][i] = inside ? depth.get((m._height - y - 1) * m._width + x) : depth.clear_value();
+                }
+            }
+            return;
+        }
+        size_t row = (m._height - y0 - 1) * m._width + x0;
+        switch (depth.format()) {
+            case DEPTH_D24S8:
+                for (int j=0; j<4; j++, row -= m._width) {
+                    for (int i=0; i<4; i++) d[j][i] = (float)(depth.words()[row + i] >> 8);
+                }
+                break;
+            case DEPTH_D16:
+                for (int j=0; j<4; j++, row -= m._width) {
+                    for (int i=0; i<4; i++) d[j][i] = (float)depth.halves()[row + i];
+                }
+                break;
+            default:
+                for (int j=0; j<4; j++, row -= m._width) {
+                    for (int i=0; i<4; i++) d[j][i] = depth.floats()[row + i];
+                }
+                break;
+        }
+    }
+
+public:
+    ShadowMap() : _range(0), _bias(0) {}
+
+    void init(int size, DepthFormat format) {
+        _map.reset(new Image(size, size, format, 1, false));
+        _range = format == DEPTH_FLOAT ? 1.f : depth_scale(format);
+        _bias = SHADOW_BIAS * _range / size;
+    }
+
+    bool empty() const { return !_map; }
+    Image &map() { return *_map; }
+
+    // world to map, x and y in texels and z larger for closer to the light: the map aimed from
+    // the light (light_dir points towards it) at bounds, all of it inside. Depth goes over the
+    // range of the map's format, a texel deep is as much as a texel wide
+    Mat4f fit(Vec3f light_dir, const AABB &bounds) const {
+        Vec3f center = bounds.center(), dir = light_dir.normalize();
+        float radius = std::max(1e-3f, (bounds.hi - bounds.lo).norm() * .5f);
+        Vec3f up = std::abs(dir.y) < .99f ? Vec3f(0, 1, 0) : Vec3f(1, 0, 0);
+        float size = (float)_map->_width;
+        Mat4f ortho = Mat4f::identity();
+        ortho[0][0] = ortho[1][1] = size / (2.f * radius);
+        ortho[0][3] = ortho[1][3] = size / 2.f;
+        ortho[2][2] = _range / (2.f * radius);
+        ortho[2][3] = _range / 2.f;
+        return ortho * lookat(center + dir, center, up); // lookat puts center at z = 0
+    }
+
+    // How much light reaches the point p (map coordinates), 0 to 1. PCF over 4x4 texels: 3x3
+    // depth comparisons, bilinearly weighted by where p is, so the edges come out smooth and
+    // slide along between texels instead of stepping. The outer texels are up to 2 away from p,
+    // so on a slope the surface itself is that much closer to the light there: the bias grows
+    // with the slope the middle texels show, up to SHADOW_MAX_SLOPE. Outside the map is lit
+    float lit(const Vec3f &p) const {
+        float fx = p.x - .5f, fy = p.y - .5f;
+        if (!(std::abs(fx) < 1e9f && std::abs(fy) < 1e9f)) return 1.f; // way off the map, or not a number
+        float ix = std::floor(fx), iy = std::floor(fy), ax = fx - ix, ay = fy - iy;
+        int x0 = (int)ix - 1, y0 = (int)iy - 1;
+        const float wx[4] = { 1.f - ax, 1.f, 1.f, ax }, wy[4] = { 1.f - ay, 1.f, 1.f, ay };
+        float d[4][4];
+        fetch(x0, y0, d);
+        float texel = _bias / SHADOW_BIAS, slope = 0;
+        for (int k=1; k<3; k++) {
+            slope = std::max(slope, std::abs(d[k][2] - d[k][1]));
+            slope = std::max(slope, std::abs(d[2][k] - d[1][k]));
+        }
+        float z = p.z + _bias + 2.f * std::min(slope, SHADOW_MAX_SLOPE * texel), sum = 0;
+        for (int j=0; j<4; j++) {
+            for (int i=0; i<4; i++) {
+                if (!(d[j][i] > z)) sum += wx[i] * wy[j];
+            }
+        }
+        return sum * (1.f / 9);
+    }
+};
+
+// darkens what the light doesn't reach in the tiles of image drawn this frame, in parallel.
+// light is what fit() gave for the map's contents, view the frame's world to homogeneous screen
+inline void apply_shadows(const ShadowMap &shadow, const Mat4f &light, Image &image, const Mat4f &view, TileGrid &tiles, ThreadPool &pool) {
+    Mat4f screen_to_map = light * view.inverse();
+    DepthFormat format = image.depth.format();
+    float half = format == DEPTH_D24S8 || format == DEPTH_D16 ? .5f : 0.f; // the unorms round down, take the middle of the step
+    pool.parallel_for(tiles.ntiles(), [&](int i) {
+        const Tile &tile = tiles.tile(i);
+        if (!tile.active) return;
+        const Rect &r = tile.rect;
+        for (int y = r.y0; y < r.y1; y++) {
+            unsigned row = (image._height - y - 1) * image._width;
+            Vec4f start = screen_to_map * Vec4f(r.x0 + .5f, y + .5f, 0.f, 1.f); // the row at depth 0, linear in x and depth from there
+            for (int x = r.x0; x < r.x1; x++) {
+                unsigned idx = row + x;
+                if (!image.depth.covered(idx)) continue;
+                float z = image.depth.get(idx) + half, dx = (float)(x - r.x0);
+                Vec4f q;
+                for (int k=0; k<4; k++) q[k] = start[k] + dx * screen_to_map[k][0] + z * screen_to_map[k][2];
+                float light = shadow.lit(Vec3f(q.x / q.w, q.y / q.w, q.z / q.w));
+                if (light >= 1.f) continue;
+                uint32_t c = image.pixels[idx], out = 0;
+                for (int shift=0; shift<24; shift+=8) out |= (uint32_t)((c >> shift & 0xff) * light) << shift;
+                image.pixels[idx] = out;
+            }
+        }
+    });
+}
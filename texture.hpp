@@ -0,0 +1,190 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <stdint.h>
+#include <algorithm>
+#include "tgaimage.hpp"
+
+// Textures for the shaders, built once from a TGAImage: texels unpacked to 32 bits (the
+// TGAColor::val layout, b g r a from the low byte up), a full mip chain down to 1x1, and every
+// level stored in 8x8 tiles with the texels of a tile in Morton (Z) order. A tile is 256 bytes,
+// 4 cache lines, so a bilinear footprint or a small patch of a triangle lands in one or two
+// lines whichever way the triangle runs across the texture, where the row linear TGAImage
+// needs a new line for every row. Coordinates are clamped to the edge.
+
+const int TEXTURE_TILE = 8; // texels per tile side
+const int TEXTURE_TILE_SHIFT = 3;
+
+enum TextureFilter {
+    FILTER_NEAREST,   // point sampling of the full size level, what TGAImage::get() did
+    FILTER_BILINEAR,  // 2x2 texels of the closest mip level
+    FILTER_TRILINEAR  // bilinear on the two closest mip levels, blended
+};
+
+struct TextureLevel {
+    int width, height;
+    int tiles_x;     // tiles per row
+    uint32_t offset; // of the level's first texel in the texture's storage
+};
+
+// position of texel (x, y) of a tile, 0..63: the bits of x and y interleaved
+inline uint32_t morton8(uint32_t x, uint32_t y) {
+    return (x & 1) | (y & 1) << 1 | (x & 2) << 1 | (y & 2) << 2 | (x & 4) << 2 | (y & 4) << 3;
+}
+
+// a*(256-f) + b*f over 256 for the four 8 bit channels at once, f in [0, 256].
+// Two channels per 32 bit multiply, their products can't run into each other
+inline uint32_t lerp_texel(uint32_t a, uint32_t b, uint32_t f) {
+    uint32_t rb = (((a & 0xff00ff) * (256 - f) + (b & 0xff00ff) * f) >> 8) & 0xff00ff;
+    uint32_t ag = ((a >> 8 & 0xff00ff) * (256 - f) + (b >> 8 & 0xff00ff) * f) & 0xff00ff00;
+    return rb | ag;
+}
+
+class Texture {
+    std::vector<uint32_t> _storage;
+    uint32_t *_texels; // _storage aligned to a cache line, so tiles don't straddle lines
+    std::vector<TextureLevel> _levels;
+    TextureFilter _filter;
+
+    uint32_t *tile_texel(const TextureLevel &l, int x, int y) {
+        return _texels + l.offset + (((y >> TEXTURE_TILE_SHIFT) * l.tiles_x + (x >> TEXTURE_TILE_SHIFT)) << 6) + morton8(x & 7, y & 7);
+    }
+
+public:
+    Texture() : _texels(NULL), _filter(FILTER_TRILINEAR) {}
+
+    explicit Texture(TGAImage &image) : _texels(NULL), _filter(FILTER_TRILINEAR) {
+        int w = image.get_width(), h = image.get_height(), bpp = image.get_bytespp();
+        const unsigned char *src = image.buffer();
+        if (!src || w <= 0 || h <= 0) return;
+
+        uint32_t total = 0;
+        for (int lw = w, lh = h; ; lw = std::max(1, lw / 2), lh = std::max(1, lh / 2)) {
+            TextureLevel l;
+            l.width = lw;
+            l.height = lh;
+            l.tiles_x = (lw + TEXTURE_TILE - 1) / TEXTURE_TILE;
+            l.offset = total;
+            total += l.tiles_x * ((lh + TEXTURE_TILE - 1) / TEXTURE_TILE) * TEXTURE_TILE * TEXTURE_TILE;
+            _levels.push_back(l);
+            if (lw == 1 && lh == 1) break;
+        }
+        _storage.assign(total + 16, 0);
+        _texels = &_storage[0] + ((64 - ((uintptr_t)&_storage[0] & 63)) & 63) / sizeof(uint32_t);
+
+        for (int y=0; y<h; y++) {
+            for (int x=0; x<w; x++) {
+                *tile_texel(_levels[0], x, y) = TGAColor(src + (x + y * w) * bpp, bpp).val;
+            }
+        }
+        // 2x2 box filter, the last row or column is repeated for odd sizes
+        for (size_t i=1; i<_levels.size(); i++) {
+            const TextureLevel &p = _levels[i - 1], &l = _levels[i];
+            for (int y=0; y<l.height; y++) {
+                for (int x=0; x<l.width; x++) {
+                    int x0 = std::min(2*x, p.width - 1), x1 = std::min(2*x + 1, p.width - 1);
+                    int y0 = std::min(2*y, p.height - 1), y1 = std::min(2*y + 1, p.height - 1);
+                    uint32_t c[4] = { fetch(i - 1, x0, y0), fetch(i - 1, x1, y0), fetch(i - 1, x0, y1), fetch(i - 1, x1, y1) };
+                    uint32_t out = 0;
+                    for (int k=0; k<32; k+=8) {
+                        uint32_t sum = 2;
+                        for (int j=0; j<4; j++) sum += c[j] >> k & 0xff;
+                        out |= (sum >> 2) << k;
+                    }
+                    *tile_texel(l, x, y) = out;
+                }
+            }
+        }
+    }
+
+    // no copies, _texels points into _storage
+    Texture(const Texture &) = delete;
+    Texture &operator=(const Texture &) = delete;
+
+    bool empty() const { return _levels.empty(); }
+    int nlevels() const { return (int)_levels.size(); }
+    const TextureLevel &level(int i) const { return _levels[i]; }
+    const uint32_t *texels() const { return _texels; }
+    int width() const { return empty() ? 0 : _levels[0].width; }
+    int height() const { return empty() ? 0 : _levels[0].height; }
+
+    // how shaders sample it, like a GL texture parameter
+    TextureFilter filter() const { return _filter; }
+    void set_filter(TextureFilter f) { _filter = f; }
+
+    // x, y inside the level
+    uint32_t fetch(int level, int x, int y) const {
+        const TextureLevel &l = _levels[level];
+        return _texels[l.offset + (((y >> TEXTURE_TILE_SHIFT) * l.tiles_x + (x >> TEXTURE_TILE_SHIFT)) << 6) + morton8(x & 7, y & 7)];
+    }
+
+    uint32_t nearest(int level, float u, float v) const {
+        const TextureLevel &l = _levels[level];
+        int x = std::min(std::max((int)(l.width * u), 0), l.width - 1);
+        int y = std::min(std::max((int)(l.height * v), 0), l.height - 1);
+        return fetch(level, x, y);
+    }
+
+    // texel centers are at half integers. Weights are 8 bit fixed point, the SIMD kernels
+    // in raster_simd.hpp do the same math and get the same colors
+    uint32_t bilinear(int level, float u, float v) const {
+        const TextureLevel &l = _levels[level];
+        float fx = l.width * u - .5f, fy = l.height * v - .5f;
+        float x0f = std::floor(fx), y0f = std::floor(fy);
+        uint32_t wx = (uint32_t)(int)((fx - x0f) * 256.f), wy = (uint32_t)(int)((fy - y0f) * 256.f);
+        int x0 = (int)x0f, y0 = (int)y0f;
+        int x1 = std::min(std::max(x0 + 1, 0), l.width - 1), y1 = std::min(std::max(y0 + 1, 0), l.height - 1);
+        x0 = std::min(std::max(x0, 0), l.width - 1);
+        y0 = std::min(std::max(y0, 0), l.height - 1);
+        uint32_t top = lerp_texel(fetch(level, x0, y0), fetch(level, x1, y0), wx);
+        uint32_t bottom = lerp_texel(fetch(level, x0, y1), fetch(level, x1, y1), wx);
+        return lerp_texel(top, bottom, wy);
+    }
+
+    // mip level (fractional) for the given uv derivatives along screen x and y, 0 when magnified
+    float lod(float dudx, float dvdx, float dudy, float dvdy) const {
+        if (empty()) return 0;
+        float w = (float)_levels[0].width, h = (float)_levels[0].height;
+        float rx = (dudx * w) * (dudx * w) + (dvdx * h) * (dvdx * h);
+        float ry = (dudy * w) * (dudy * w) + (dvdy * h) * (dvdy * h);
+        float rho2 = std::max(rx, ry);
+        if (!(rho2 > 1.f)) return 0;
+        return std::min(.5f * std::log2(rho2), (float)(nlevels() - 1));
+    }
+};
+
+// a texture with its filter and the mip level(s) picked for one triangle, which is as far
+// as the level of detail goes: it comes from the uv derivatives, and uv is linear in screen
+// space over a triangle
+struct TextureSampler {
+    const Texture *texture;
+    TextureFilter filter;
+    int level;    // the first (or only) level read
+    uint32_t mix; // trilinear: weight of level + 1, in 1/256th
+
+    TextureSampler() : texture(NULL), filter(FILTER_NEAREST), level(0), mix(0) {}
+
+    TextureSampler(const Texture &tex, TextureFilter f, float lod) : texture(&tex), filter(f), level(0), mix(0) {
+        if (tex.empty() || filter == FILTER_NEAREST) return;
+        if (filter == FILTER_BILINEAR) {
+            level = std::min((int)(lod + .5f), tex.nlevels() - 1);
+            return;
+        }
+        level = (int)lod;
+        if (level + 1 < tex.nlevels()) mix = (uint32_t)(int)((lod - level) * 256.f);
+    }
+
+    uint32_t operator()(float u, float v) const {
+        if (!texture || texture->empty()) return 0;
+        switch (filter) {
+        case FILTER_NEAREST:
+            return texture->nearest(0, u, v);
+        case FILTER_BILINEAR:
+            return texture->bilinear(level, u, v);
+        default:
+            if (!mix) return texture->bilinear(level, u, v);
+            return lerp_texel(texture->bilinear(level, u, v), texture->bilinear(level + 1, u, v), mix);
+        }
+    }
+};
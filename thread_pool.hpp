@@ -0,0 +1,161 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+
+// Small work-stealing thread pool.
+// Every worker owns a deque of tasks: it pops from the back of its own deque and,
+// when that runs dry, steals from the front of the others. The thread calling
+// parallel_for() pushes the tasks and then helps out until its job is finished,
+// so a pool of size N keeps N-1 extra threads around.
+class ThreadPool {
+    struct Job {
+        std::function<void(int)> fn;
+        std::atomic<int> remaining; // tasks not finished yet
+    };
+
+    struct Task {
+        Job *job;
+        int begin, end;
+    };
+
+    struct Queue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::thread> _threads;
+    std::vector<Queue*> _queues;
+    std::atomic<int> _queued;     // tasks sitting in any queue
+    std::atomic<unsigned> _next;  // round robin start for pushes
+    std::mutex _sleep_lock;
+    std::condition_variable _wake;
+    bool _stop;
+
+public:
+    // nthreads is the total number of threads working on a parallel_for, the caller included.
+    // 0 means one per hardware thread
+    explicit ThreadPool(int nthreads = 0) : _queued(0), _next(0), _stop(false) {
+        if (nthreads <= 0) {
+            nthreads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (int i = 0; i < nthreads - 1; i++) {
+            _queues.push_back(new Queue());
+        }
+        for (int i = 0; i < nthreads - 1; i++) {
+            _threads.push_back(std::thread(&ThreadPool::worker, this, i));
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> guard(_sleep_lock);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for (size_t i = 0; i < _threads.size(); i++) {
+            _threads[i].join();
+        }
+        for (size_t i = 0; i < _queues.size(); i++) {
+            delete _queues[i];
+        }
+    }
+
+    int size() const {
+        return (int)_threads.size() + 1;
+    }
+
+    // calls fn(i) for every i in [0, n), grain consecutive indices per task. Returns once all of them are done.
+    // Safe to call from several threads at once
+    void parallel_for(int n, std::function<void(int)> fn, int grain = 1) {
+        if (n <= 0) return;
+        if (grain < 1) grain = 1;
+        int ntasks = (n + grain - 1) / grain;
+        if (_threads.empty() || ntasks == 1) {
+            for (int i = 0; i < n; i++) fn(i);
+            return;
+        }
+
+        Job job;
+        job.fn = fn;
+        job.remaining = ntasks;
+
+        // deal the tasks out round robin so every worker starts with something local
+        unsigned q = _next.fetch_add(1);
+        for (int begin = 0; begin < n; begin += grain, q++) {
+            Task task = { &job, begin, std::min(n, begin + grain) };
+            Queue *queue = _queues[q % _queues.size()];
+            std::lock_guard<std::mutex> guard(queue->lock);
+            queue->tasks.push_back(task);
+        }
+        {
+            std::lock_guard<std::mutex> guard(_sleep_lock);
+            _queued += ntasks;
+        }
+        _wake.notify_all();
+
+        // help until our job is done. Whatever we grab may belong to another caller, that's fine
+        while (job.remaining.load() > 0) {
+            Task task;
+            if (steal(-1, task)) {
+                run(task);
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+private:
+    void run(Task &task) {
+        for (int i = task.begin; i < task.end; i++) {
+            task.job->fn(i);
+        }
+        task.job->remaining--;
+    }
+
+    bool pop_own(int self, Task &task) {
+        Queue *queue = _queues[self];
+        std::lock_guard<std::mutex> guard(queue->lock);
+        if (queue->tasks.empty()) return false;
+        task = queue->tasks.back();
+        queue->tasks.pop_back();
+        _queued--;
+        return true;
+    }
+
+    // take the oldest task from somebody else's queue, self=-1 for threads outside the pool
+    bool steal(int self, Task &task) {
+        int nqueues = (int)_queues.size();
+        for (int k = 1; k <= nqueues; k++) {
+            int victim = (self + k + nqueues) % nqueues;
+            if (victim == self) continue;
+            Queue *queue = _queues[victim];
+            std::lock_guard<std::mutex> guard(queue->lock);
+            if (queue->tasks.empty()) continue;
+            task = queue->tasks.front();
+            queue->tasks.pop_front();
+            _queued--;
+            return true;
+        }
+        return false;
+    }
+
+    void worker(int self) {
+        for (;;) {
+            Task task;
+            if (pop_own(self, task) || steal(self, task)) {
+                run(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> guard(_sleep_lock);
+            _wake.wait(guard, [this] { return _stop || _queued.load() > 0; });
+            if (_stop) return;
+        }
+    }
+};
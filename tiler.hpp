@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "geometry.hpp"
+
+const int TILE_SIZE = 64;
+
+// screen rectangle in raster coordinates, [x0, x1) x [y0, y1)
+struct Rect {
+    int x0, y0, x1, y1;
+
+    Rect() : x0(0), y0(0), x1(0), y1(0) {}
+    Rect(int X0, int Y0, int X1, int Y1) : x0(X0), y0(Y0), x1(X1), y1(Y1) {}
+    bool empty() const { return x0 >= x1 || y0 >= y1; }
+};
+
+struct Tile {
+    Rect rect;
+    std::vector<int> tris; // triangle ids in submission order, so depth ties resolve like a serial draw
+    bool active;           // drawn this frame. Inactive tiles get nothing binned and keep their pixels
+
+    Tile() : active(true) {}
+};
+
+// Bins screen-space triangles into TILE_SIZE x TILE_SIZE tiles.
+// Every tile owns its own rectangle of the color and depth buffers, so tiles
+// can be rasterized on different threads without any locking.
+class TileGrid {
+    int _width, _height, _tile_size;
+    int _cols, _rows;
+    std::vector<Tile> _tiles;
+
+public:
+    TileGrid(int width, int height, int tile_size = TILE_SIZE) : _width(width), _height(height), _tile_size(tile_size) {
+        _cols = (width + tile_size - 1) / tile_size;
+        _rows = (height + tile_size - 1) / tile_size;
+        _tiles.resize(_cols * _rows);
+        for (int ty = 0; ty < _rows; ty++) {
+            for (int tx = 0; tx < _cols; tx++) {
+                _tiles[ty * _cols + tx].rect = Rect(tx * tile_size, ty * tile_size,
+                                                    std::min(width, (tx + 1) * tile_size), std::min(height, (ty + 1) * tile_size));
+            }
+        }
+    }
+
+    int ntiles() const { return (int)_tiles.size(); }
+    int cols() const { return _cols; }
+    int rows() const { return _rows; }
+    int tile_size() const { return _tile_size; }
+    Tile &tile(int i) { return _tiles[i]; }
+
+    // empties the bins but keeps their memory around for the next frame
+    void clear() {
+        for (size_t i = 0; i < _tiles.size(); i++) {
+            _tiles[i].tris.clear();
+        }
+    }
+
+    // adds triangle id to every tile its bounding box touches
+    void bin(int id, const Vec3f *pts) {
+        float xmin = std::min(pts[0].x, std::min(pts[1].x, pts[2].x));
+        float xmax = std::max(pts[0].x, std::max(pts[1].x, pts[2].x));
+        float ymin = std::min(pts[0].y, std::min(pts[1].y, pts[2].y));
+        float ymax = std::max(pts[0].y, std::max(pts[1].y, pts[2].y));
+        if (xmax < 0 || ymax < 0 || xmin >= _width || ymin >= _height) return;
+
+        int tx0 = std::max(0, (int)std::floor(xmin) / _tile_size);
+        int ty0 = std::max(0, (int)std::floor(ymin) / _tile_size);
+        int tx1 = std::min(_cols - 1, (int)std::ceil(xmax) / _tile_size);
+        int ty1 = std::min(_rows - 1, (int)std::ceil(ymax) / _tile_size);
+        for (int ty = ty0; ty <= ty1; ty++) {
+            for (int tx = tx0; tx <= tx1; tx++) {
+                Tile &tile = _tiles[ty * _cols + tx];
+                if (tile.active) tile.tris.push_back(id);
+            }
+        }
+    }
+};
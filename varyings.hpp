@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include "geometry.hpp"
+#include "rasterizer.hpp"
+
+// Perspective correct interpolation of a shader's N float varyings. Over a triangle neither the
+// varyings nor the barycentric coordinates are linear in screen space, but varying/w and 1/w are,
+// so each of them gets a plane equation once per triangle. At the start of a span the planes are
+// evaluated exactly from the integer edge functions, then stepped along x: a pixel costs one
+// division for w plus a multiply-add and a multiply per varying, whatever N is.
+// The SIMD kernels do the same math, lane by lane, and get the same numbers.
+template <int N> struct VaryingPlanes {
+    float corner[3][N + 1]; // varyings/w and 1/w at the three corners
+    float dx[N + 1];        // their change per pixel along x
+    float dy[N + 1];        // and along y
+    float inv_area;
+
+    // v are the corner varyings, rhw 1/w of the corners (all 1 for a plain screen space triangle)
+    void setup(const RasterTriangle &t, const float (*v)[N], const float *rhw) {
+        inv_area = t.inv_area;
+        for (int i=0; i<3; i++) {
+            for (int k=0; k<N; k++) corner[i][k] = v[i][k] * rhw[i];
+            corner[i][N] = rhw[i];
+        }
+        Vec3f ddx, ddy;
+        bar_derivatives(t, ddx, ddy);
+        for (int k=0; k<=N; k++) {
+            dx[k] = corner[0][k] * ddx[0] + corner[1][k] * ddx[1] + corner[2][k] * ddx[2];
+            dy[k] = corner[0][k] * ddy[0] + corner[1][k] * ddy[1] + corner[2][k] * ddy[2];
+        }
+    }
+
+    // the planes at the pixel whose edge functions are w, the start of a span
+    void start(const int64_t *w, float *row) const {
+        float b0 = w[0] * inv_area, b1 = w[1] * inv_area, b2 = w[2] * inv_area;
+        for (int k=0; k<=N; k++) row[k] = corner[0][k] * b0 + corner[1][k] * b1 + corner[2][k] * b2;
+    }
+
+    // the varyings step pixels to the right of where row was taken
+    void at(const float *row, float step, float *out) const {
+        float rq = 1.f / (row[N] + step * dx[N]);
+        for (int k=0; k<N; k++) out[k] = (row[k] + step * dx[k]) * rq;
+    }
+
+    // change of the varyings per pixel along x and y, taken at the centroid. What texture
+    // filtering needs to pick a mip level, once per triangle
+    void derivatives(float *ddx, float *ddy) const {
+        float q = (corner[0][N] + corner[1][N] + corner[2][N]) * (1.f / 3);
+        for (int k=0; k<N; k++) {
+            float value = (corner[0][k] + corner[1][k] + corner[2][k]) * (1.f / 3) / q;
+            ddx[k] = (dx[k] - value * dx[N]) / q;
+            ddy[k] = (dy[k] - value * dy[N]) / q;
+        }
+    }
+};
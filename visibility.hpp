@@ -0,0 +1,290 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cfloat>
+#include <iostream>
+#include <stdint.h>
+#include <algorithm>
+#include "geometry.hpp"
+#include "image.hpp"
+#include "tiler.hpp"
+#include "thread_pool.hpp"
+#include "rasterizer.hpp"
+#include "texture.hpp"
+#include "pipeline.hpp"
+#include "scene.hpp"
+#include "our_gl.hpp"
+
+// Visibility buffer rendering for the textured look. The raster pass interpolates nothing but
+// depth: a covered pixel gets the 32 bit id of what's on it, scene instance and face packed
+// together, next to its depth. The resolve pass then goes over the pixels, fetches the three
+// corners of the face straight from the instance's Model again, finds the pixel's perspective
+// correct barycentric coordinates from their homogeneous screen positions and shades, once per
+// pixel. Neighbouring pixels mostly show the same face, so the per face work is cached.
+// Nothing the raster pass produced besides id and depth is needed, clipped pieces included.
+
+// same rows as Image, row 0 at the top. A pixel is covered when Image's depth says so,
+// ids of uncovered pixels are left over from earlier frames
+struct VisibilityBuffer {
+    int width, height;
+    int face_bits; // low bits of an id, the face. The instance is in the rest
+    std::vector<uint32_t> id;
+
+    VisibilityBuffer() : width(0), height(0), face_bits(0) {}
+
+    // false if instances * faces ids don't fit in 32 bits
+    bool init(int w, int h, int instances, int faces) {
+        face_bits = 0;
+        while (face_bits < 32 && (int64_t(1) << face_bits) < faces) face_bits++;
+        int instance_bits = 0;
+        while (instance_bits < 32 && (int64_t(1) << instance_bits) < instances) instance_bits++;
+        if (face_bits + instance_bits > 32) {
+            std::cerr << "visibility buffer: " << instances << " instances of " << faces << " faces don't fit in 32 bit ids\n";
+            return false;
+        }
+        width = w;
+        height = h;
+        id.assign(w * h, 0);
+        return true;
+    }
+
+    uint32_t pack(int instance, int face) const { return (uint32_t)instance << face_bits | (uint32_t)face; }
+    int instance(uint32_t bits) const { return face_bits < 32 ? (int)(bits >> face_bits) : 0; }
+    int face(uint32_t bits) const { return (int)(bits & (uint32_t)((uint64_t(1) << face_bits) - 1)); }
+};
+
+// what draw() in main.cpp binds per draw item: the instance part of the ids
+struct VisibilityShader {
+    const VisibilityBuffer *buffer;
+    uint32_t instance_id;
+
+    explicit VisibilityShader(const VisibilityBuffer &vis) : buffer(&vis), instance_id(0) {}
+
+    void bind(const DrawItem &item) {
+        instance_id = buffer->pack(item.instance, 0);
+    }
+};
+
+inline void visibility_span_scalar(const RasterTriangle &t, const Vec3f *pts, uint32_t id, VisibilityBuffer &vis, Image &image,
+                                   int y, int x0, int x1, const int64_t *wstart, bool inside) {
+    int64_t w[3] = { wstart[0], wstart[1], wstart[2] };
+    unsigned row = (image._height - y - 1) * image._width;
+    for (int x=x0; x<x1; x++, w[0] += t.A[0], w[1] += t.A[1], w[2] += t.A[2]) {
+        if (!inside && (w[0] | w[1] | w[2]) < 0) continue;
+        float z = pts[0][2]*(w[0] * t.inv_area) + pts[1][2]*(w[1] * t.inv_area) + pts[2][2]*(w[2] * t.inv_area);
+        if (!image.depth.update(row + x, z)) continue;
+        vis.id[row + x] = id;
+    }
+}
+
+#ifdef RASTER_SIMD_X86
+// the depth half of textured_span_avx2(), ids stored where it passes
+__attribute__((target("avx2")))
+inline void visibility_span_avx2(const RasterTriangle &t, const Vec3f *pts, uint32_t id, VisibilityBuffer &vis, Image &image,
+                                 int y, int x0, int x1, const int64_t *w) {
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i active = _mm256_cmpgt_epi32(_mm256_set1_epi32(x1 - x0), lane);
+    __m256i w0 = _mm256_add_epi32(_mm256_set1_epi32((int)w[0]), _mm256_mullo_epi32(_mm256_set1_epi32((int)t.A[0]), lane));
+    __m256i w1 = _mm256_add_epi32(_mm256_set1_epi32((int)w[1]), _mm256_mullo_epi32(_mm256_set1_epi32((int)t.A[1]), lane));
+    __m256i w2 = _mm256_add_epi32(_mm256_set1_epi32((int)w[2]), _mm256_mullo_epi32(_mm256_set1_epi32((int)t.A[2]), lane));
+    __m256i cover = _mm256_andnot_si256(_mm256_srai_epi32(_mm256_or_si256(w0, _mm256_or_si256(w1, w2)), 31), active);
+    if (_mm256_testz_si256(cover, cover)) return;
+
+    __m256 inv = _mm256_set1_ps(t.inv_area);
+    __m256 z = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(pts[0].z), _mm256_mul_ps(_mm256_cvtepi32_ps(w0), inv)),
+                                           _mm256_mul_ps(_mm256_set1_ps(pts[1].z), _mm256_mul_ps(_mm256_cvtepi32_ps(w1), inv))),
+                             _mm256_mul_ps(_mm256_set1_ps(pts[2].z), _mm256_mul_ps(_mm256_cvtepi32_ps(w2), inv)));
+    unsigned idx = (image._height - y - 1) * image._width + x0;
+    __m256i pass = depth_pass_avx2(image.depth, idx, x1 - x0, z, cover);
+    depth_store_avx2(image.depth, idx, x1 - x0, z, pass);
+    _mm256_maskstore_epi32((int*)&vis.id[idx], pass, _mm256_set1_epi32((int)id));
+}
+#endif
+
+// the raster pass of a primitive: depth test, then depth and id
+inline void visibility_triangle(const Primitive &prim, uint32_t id, VisibilityBuffer &vis, Image &image, const Rect &clip) {
+    RasterTriangle t;
+    if (!setup_triangle(prim.pts, clip, t)) return;
+    if (raster_state.hiz && hiz_hidden(image.hiz, t)) return;
+    HiZBlockTest block(image.hiz, t, raster_state.hiz);
+    const Vec3f *pts = prim.pts;
+#ifdef RASTER_SIMD_X86
+    if (simd_level() == SIMD_AVX2 && fits_int32(t)) {
+        rasterize_spans(t, [&](int y, int x0, int x1, const int64_t *w, bool) {
+            visibility_span_avx2(t, pts, id, vis, image, y, x0, x1, w);
+        }, block);
+        return;
+    }
+#endif
+    rasterize_spans(t, [&](int y, int x0, int x1, const int64_t *w, bool inside) {
+        visibility_span_scalar(t, pts, id, vis, image, y, x0, x1, w, inside);
+    }, block);
+}
+
+// A face as the resolve pass sees it. With the corners in homogeneous screen space (x, y, w),
+// before the divide, e_i(p) = (corner j x corner k) . (px, py, 1) is linear on the screen and
+// e_i / (e_0 + e_1 + e_2) is the perspective correct barycentric coordinate of corner i at p.
+// That holds for corners behind the eye too, so clipped faces need nothing special
+struct VisibilityFace {
+    Vec3f edge[3];                      // corner j x corner k
+    float varying[3][TEXTURED_VARYINGS]; // u, v, normal of the corners
+    TextureSampler sampler;             // with the face's mip level(s)
+
+    // the corners' attributes, the mip level from the uv derivatives at the face's screen centroid
+    // (or at its nearest corner when the centroid can't be projected), like the forward path
+    void setup(const Model &model, int face, const Mat4f &transform, const Texture &texture) {
+        Vec4f clip[3];
+        for (int j=0; j<3; j++) {
+            uint32_t i = model.index(face, j);
+            clip[j] = transform * Vec4f(model.verts()[i]);
+            varying[j][0] = model.texcoords()[i].x;
+            varying[j][1] = model.texcoords()[i].y;
+            varying[j][2] = model.normals()[i].x;
+            varying[j][3] = model.normals()[i].y;
+            varying[j][4] = model.normals()[i].z;
+        }
+        for (int i=0; i<3; i++) {
+            const Vec4f &a = clip[(i + 1) % 3], &b = clip[(i + 2) % 3];
+            edge[i] = cross(Vec3f(a.x, a.y, a.w), Vec3f(b.x, b.y, b.w));
+        }
+
+        float px = 0, py = 0;
+        if (clip[0].w > 0 && clip[1].w > 0 && clip[2].w > 0) {
+            for (int j=0; j<3; j++) {
+                px += clip[j].x / clip[j].w / 3;
+                py += clip[j].y / clip[j].w / 3;
+            }
+        } else {
+            int n = clip[0].w > clip[1].w ? (clip[0].w > clip[2].w ? 0 : 2) : (clip[1].w > clip[2].w ? 1 : 2);
+            px = clip[n].x / clip[n].w;
+            py = clip[n].y / clip[n].w;
+        }
+        float e[3], sum = 0, sum_x = 0, sum_y = 0;
+        for (int i=0; i<3; i++) {
+            e[i] = edge[i].x * px + edge[i].y * py + edge[i].z;
+            sum += e[i];
+            sum_x += edge[i].x;
+            sum_y += edge[i].y;
+        }
+        float ddx[2] = { 0, 0 }, ddy[2] = { 0, 0 };
+        if (sum != 0) {
+            for (int i=0; i<3; i++) {
+                float b = e[i] / sum;
+                float bx = (edge[i].x - b * sum_x) / sum, by = (edge[i].y - b * sum_y) / sum;
+                for (int k=0; k<2; k++) {
+                    ddx[k] += varying[i][k] * bx;
+                    ddy[k] += varying[i][k] * by;
+                }
+            }
+        }
+        sampler = TextureSampler(texture, texture.filter(), texture.lod(ddx[0], ddx[1], ddy[0], ddy[1]));
+    }
+};
+
+// the reference scalar shading of pixel (x, y), spelled out so the AVX2 version below gets the same colors
+inline void resolve_pixel(const VisibilityFace &f, Image &image, Vec3f light_dir, int x, int y, unsigned idx) {
+    float px = x + .5f, py = y + .5f;
+    float e[3];
+    for (int i=0; i<3; i++) e[i] = f.edge[i].x * px + f.edge[i].y * py + f.edge[i].z;
+    float inv = 1.f / (e[0] + e[1] + e[2]);
+    float b0 = e[0] * inv, b1 = e[1] * inv, b2 = e[2] * inv;
+    float v[TEXTURED_VARYINGS];
+    for (int k=0; k<TEXTURED_VARYINGS; k++) v[k] = f.varying[0][k] * b0 + f.varying[1][k] * b1 + f.varying[2][k] * b2;
+    TGAColor c(f.sampler(v[0], v[1]), 4);
+    float intensity = std::min(1.0f, std::max(0.0f, Vec3f(v[2], v[3], v[4]) * light_dir));
+    image.pixels[idx] = (int)(c.r * intensity) | (int)(c.g * intensity) << 8 | (int)(c.b * intensity) << 16;
+}
+
+#ifdef RASTER_SIMD_X86
+// 8 pixels of a row starting at (x, y), all the covered ones showing the same face
+__attribute__((target("avx2")))
+inline void resolve_avx2(const VisibilityFace &f, Image &image, Vec3f light_dir, int x, int y, unsigned idx) {
+    __m256i mask = depth_covered_avx2(image.depth, idx);
+    __m256 px = _mm256_add_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(x), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))), _mm256_set1_ps(.5f));
+    __m256 py = _mm256_set1_ps(y + .5f);
+#define EDGE(i) _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(f.edge[i].x), px), _mm256_mul_ps(_mm256_set1_ps(f.edge[i].y), py)), _mm256_set1_ps(f.edge[i].z))
+    __m256 e0 = EDGE(0), e1 = EDGE(1), e2 = EDGE(2);
+#undef EDGE
+    __m256 inv = _mm256_div_ps(_mm256_set1_ps(1.f), _mm256_add_ps(_mm256_add_ps(e0, e1), e2));
+    __m256 b0 = _mm256_mul_ps(e0, inv), b1 = _mm256_mul_ps(e1, inv), b2 = _mm256_mul_ps(e2, inv);
+#define VARYING(k) _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(f.varying[0][k]), b0), _mm256_mul_ps(_mm256_set1_ps(f.varying[1][k]), b1)), \
+                                 _mm256_mul_ps(_mm256_set1_ps(f.varying[2][k]), b2))
+    __m256 u = VARYING(0), v = VARYING(1);
+    __m256 nx = VARYING(2), ny = VARYING(3), nz = VARYING(4);
+#undef VARYING
+    __m256 intensity = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nz, _mm256_set1_ps(light_dir.z)), _mm256_mul_ps(ny, _mm256_set1_ps(light_dir.y))),
+                                     _mm256_mul_ps(nx, _mm256_set1_ps(light_dir.x)));
+    intensity = _mm256_min_ps(_mm256_set1_ps(1.f), _mm256_max_ps(_mm256_setzero_ps(), intensity));
+
+    __m256i tex = sample_avx2(f.sampler, u, v, mask);
+    __m256i mask8 = _mm256_set1_epi32(0xff);
+    __m256 b = _mm256_cvtepi32_ps(_mm256_and_si256(tex, mask8));
+    __m256 g = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(tex, 8), mask8));
+    __m256 r = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(tex, 16), mask8));
+    __m256i color = _mm256_or_si256(_mm256_cvttps_epi32(_mm256_mul_ps(r, intensity)),
+                    _mm256_or_si256(_mm256_slli_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(g, intensity)), 8),
+                                    _mm256_slli_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(b, intensity)), 16)));
+    _mm256_maskstore_epi32((int*)(image.pixels + idx), mask, color);
+}
+#endif
+
+// The resolve pass: every covered pixel shaded once, tiles in parallel. view is world to
+// homogeneous screen, the same the raster pass had. The face of the last id seen is kept
+// around, runs of 8 pixels on one face go through AVX2 when the cpu has it
+inline void resolve_visibility(const VisibilityBuffer &vis, Image &image, const Scene &scene, const Mat4f &view,
+                               const Texture &texture, Vec3f light_dir, TileGrid &tiles, ThreadPool &pool) {
+    pool.parallel_for(tiles.ntiles(), [&](int i) {
+        if (!tiles.tile(i).active) return; // kept from the last frame
+        const Rect &r = tiles.tile(i).rect;
+        VisibilityFace face;
+        uint32_t current = 0;
+        bool have = false;
+        int bound = -1; // instance of transform
+        Mat4f transform;
+        auto fetch = [&](uint32_t id) {
+            if (have && id == current) return;
+            int inst = vis.instance(id);
+            if (inst != bound) {
+                bound = inst;
+                transform = view * scene.instance(inst).transform;
+            }
+            face.setup(*scene.instance(inst).model, vis.face(id), transform, texture);
+            current = id;
+            have = true;
+        };
+        for (int y = r.y0; y < r.y1; y++) {
+            unsigned row = (image._height - y - 1) * image._width;
+            int x = r.x0;
+#ifdef RASTER_SIMD_X86
+            if (simd_level() == SIMD_AVX2) {
+                for (; x + 8 <= r.x1; x += 8) {
+                    const uint32_t *ids = &vis.id[row + x];
+                    bool covered[8];
+                    for (int k=0; k<8; k++) covered[k] = image.depth.covered(row + x + k);
+                    int first = 0;
+                    while (first < 8 && !covered[first]) first++;
+                    if (first == 8) continue;
+                    bool same = true;
+                    for (int k=first + 1; k<8 && same; k++) same = !covered[k] || ids[k] == ids[first];
+                    if (same) {
+                        fetch(ids[first]);
+                        resolve_avx2(face, image, light_dir, x, y, row + x);
+                    } else {
+                        for (int k=first; k<8; k++) {
+                            if (!covered[k]) continue;
+                            fetch(ids[k]);
+                            resolve_pixel(face, image, light_dir, x + k, y, row + x + k);
+                        }
+                    }
+                }
+            }
+#endif
+            for (; x < r.x1; x++) {
+                if (!image.depth.covered(row + x)) continue;
+                fetch(vis.id[row + x]);
+                resolve_pixel(face, image, light_dir, x, y, row + x);
+            }
+        }
+    });
+}